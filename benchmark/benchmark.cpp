@@ -19,11 +19,17 @@
 #include <iostream>
 #include <ptrie/ptrie.h>
 #include <stdlib.h>
+// the sparse and dense types need Google's sparsehash, without it the
+// benchmark builds with the other types only
+#if __has_include(<sparsehash/sparse_hash_set>)
+#define PTRIE_HAS_SPARSEHASH
 #include <sparsehash/sparse_hash_set>
 #include <sparsehash/dense_hash_set>
+#endif
 //#include <tbb/concurrent_unordered_set.h>
 #include <random>
 #include <ptrie/ptrie_stable.h>
+#include <ptrie/hugepage_allocator.h>
 #include <chrono>
 #include <unordered_set>
 #include "MurmurHash2.h"
@@ -77,7 +83,7 @@ struct wrapper_t
 };
 
 template<typename T>
-void set_insert(T& set, size_t elements, size_t seed, size_t bytes, double deletes, double read_rate, size_t mv)
+void set_insert(T& set, size_t elements, size_t seed, size_t bytes, [[maybe_unused]] double deletes, double read_rate, size_t mv)
 {
     std::default_random_engine generator(seed);
     std::uniform_real_distribution<double> dist;
@@ -133,7 +139,7 @@ void set_insert(T& set, size_t elements, size_t seed, size_t bytes, double delet
 }
 
 template<typename T> 
-void set_insert_ptrie(T& set, size_t elements, size_t seed, size_t bytes, double deletes, double read_rate, size_t mv)
+void set_insert_ptrie(T& set, size_t elements, size_t seed, size_t bytes, [[maybe_unused]] double deletes, double read_rate, size_t mv)
 {
     std::default_random_engine del_generator(seed);
     std::uniform_real_distribution<double> del_dist;
@@ -142,7 +148,9 @@ void set_insert_ptrie(T& set, size_t elements, size_t seed, size_t bytes, double
     std::default_random_engine read_generator(seed);
     std::normal_distribution<double> read_dist(read_rate, read_rate / 2.0);
     std::uniform_int_distribution<int> read_el(0, elements);
+    tlb_counter_t tlb;
     auto start = std::chrono::system_clock::now();
+    tlb.start();
 
     for(size_t i = 0; i < elements; ++i)
     {
@@ -169,9 +177,15 @@ void set_insert_ptrie(T& set, size_t elements, size_t seed, size_t bytes, double
             torem.release();
         }*/
     }
+    auto misses = tlb.stop();
     auto end = std::chrono::system_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
     std::cout << "COMPLETED IN " << (0.001*elapsed.count()) << " SECONDS " << std::endl;
+    if(tlb.available())
+        std::cout << "DTLB LOAD MISSES " << misses << std::endl;
+    else
+        std::cout << "DTLB LOAD MISSES NOT AVAILABLE" << std::endl;
+    std::cout << "ANON HUGE PAGES " << anon_huge_kb() << " KB" << std::endl;
 }
 
 
@@ -202,7 +216,7 @@ int main(int argc, const char** argv)
 {
     if(argc < 3 || argc > 8)
     {
-        std::cout << "usage : <ptrie/std/sparse/dense> <number elements> <?seed> <?number of bytes> <?delete ratio> <?read rate> <?max byte val>" << std::endl;
+        std::cout << "usage : <ptrie/ptrie-huge/std/sparse/dense> <number elements> <?seed> <?number of bytes> <?delete ratio> <?read rate> <?max byte val>" << std::endl;
         exit(-1);
     }
 
@@ -227,6 +241,13 @@ int main(int argc, const char** argv)
         set<> set;
         set_insert_ptrie(set, elements, seed, bytes, deletes, read_rate, maxval);
     }
+    else if(strcmp(type, "ptrie-huge") == 0)
+    {
+        // same as ptrie, with nodes and buckets in huge pages
+        print_settings(type, elements, seed, bytes, deletes, read_rate, maxval);
+        set<uchar, 17, 129, 8, 1024*64, hugepage_allocator<uchar>, true> set;
+        set_insert_ptrie(set, elements, seed, bytes, deletes, read_rate, maxval);
+    }
     else if (strcmp(type, "std") == 0) {
         print_settings(type, elements, seed, bytes, deletes, read_rate, maxval);
         std::unordered_set<wrapper_t, hasher_o, equal_o> set;
@@ -238,6 +259,7 @@ int main(int argc, const char** argv)
         tbb::concurrent_unordered_set<wrapper_t, hasher_o, equal_o> set;
         set_insert(set, elements, seed, bytes, deletes, read_rate, maxval);
     }*/
+#ifdef PTRIE_HAS_SPARSEHASH
     else if(strcmp(type, "sparse") == 0)
     {
         print_settings(type, elements, seed, bytes, deletes, read_rate, maxval);
@@ -256,9 +278,10 @@ int main(int argc, const char** argv)
         if(deletes > 0.0) set.set_deleted_key(del);
         set_insert(set, elements, seed, bytes, deletes, read_rate, maxval);
     }
+#endif
     else
     {
-        std::cerr << "ERROR IN TYPE, ONLY VALUES ALLOWED : ptrie, std, sparse, dense" << std::endl;
+        std::cerr << "ERROR IN TYPE, ONLY VALUES ALLOWED : ptrie, ptrie-huge, std, sparse, dense" << std::endl;
         exit(-1);
     }
 
@@ -289,7 +289,7 @@ namespace ptrie
             free(data);
         }
         
-        static inline uchar* offset(uchar* data, uint16_t size)
+        static inline uchar* offset(uchar* data, uint16_t /*size*/)
         {
 //            if((size % __BW_BSIZE__) == 0) return data;
 //            else return &data[(__BW_BSIZE__ - (size % __BW_BSIZE__))];
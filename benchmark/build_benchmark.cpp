@@ -0,0 +1,62 @@
+/*
+ * Copyright Peter G. Jensen <root@petergjoel.dk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Filling a set_stable from a vector of keys with insert, and with build for
+// a growing number of threads.
+
+#include <ptrie/ptrie_stable.h>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using bytes_t = std::vector<unsigned char>;
+
+int main(int argc, const char** argv)
+{
+    size_t elements = argc > 1 ? std::stoull(argv[1]) : 10000000;
+    size_t max_threads = argc > 2 ? std::stoull(argv[2]) : 64;
+    size_t length = argc > 3 ? std::stoull(argv[3]) : 16;
+    std::mt19937_64 gen(42);
+    std::vector<bytes_t> keys(elements);
+    std::vector<std::pair<const unsigned char*, size_t>> spans;
+    for (auto& key : keys) {
+        key.resize(length);
+        for (auto& b : key) b = gen();
+        spans.emplace_back(key.data(), key.size());
+    }
+    std::vector<ptrie::returntype_t> results(elements);
+    std::cout << std::thread::hardware_concurrency() << " hardware threads" << std::endl;
+    {
+        auto start = std::chrono::steady_clock::now();
+        ptrie::set_stable<> set;
+        for (auto& key : keys)
+            set.insert(key);
+        double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "insert\t\t" << elements / t / 1e6 << " M keys/s" << std::endl;
+    }
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        auto start = std::chrono::steady_clock::now();
+        ptrie::set_stable<> set;
+        set.build(spans, results, threads);
+        double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "build\t" << threads << " threads\t" << elements / t / 1e6 << " M keys/s" << std::endl;
+    }
+    return 0;
+}
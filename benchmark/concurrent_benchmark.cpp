@@ -0,0 +1,171 @@
+/*
+ * Copyright Peter G. Jensen <root@petergjoel.dk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Insert and exists throughput of sharded_set for a growing number of
+// threads, next to a single set behind one mutex. Then one thread inserting
+// while the others look up keys, in a set with shared_reads and in one
+// behind a reader-writer lock.
+
+#include <ptrie/ptrie_sharded.h>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using bytes_t = std::vector<unsigned char>;
+
+std::vector<bytes_t> make_keys(size_t elements, size_t length, size_t seed)
+{
+    std::mt19937_64 gen(seed);
+    std::vector<bytes_t> keys(elements);
+    for (auto& key : keys) {
+        key.resize(length);
+        for (auto& b : key) b = gen();
+    }
+    return keys;
+}
+
+// one set behind one mutex, what sharded_set is measured against
+struct locked_set {
+    std::mutex _lock;
+    ptrie::set<> _set;
+    ptrie::returntype_t insert(const bytes_t& key) {
+        std::lock_guard guard(_lock);
+        return _set.insert(key);
+    }
+    ptrie::returntype_t exists(const bytes_t& key) {
+        std::lock_guard guard(_lock);
+        return _set.exists(key);
+    }
+};
+
+// one set behind a reader-writer lock, what shared_reads is measured against
+struct rwlocked_set {
+    std::shared_mutex _lock;
+    ptrie::set<> _set;
+    ptrie::returntype_t insert(const bytes_t& key) {
+        std::unique_lock guard(_lock);
+        return _set.insert(key);
+    }
+    ptrie::returntype_t exists(const bytes_t& key) {
+        std::shared_lock guard(_lock);
+        return _set.exists(key);
+    }
+};
+
+struct shared_set {
+    ptrie::set<> _set;
+    shared_set() { _set.shared_reads(); }
+    ptrie::returntype_t insert(const bytes_t& key) { return _set.insert(key); }
+    ptrie::returntype_t exists(const bytes_t& key) { return _set.exists(key); }
+};
+
+template<typename F>
+double timed(size_t threads, F f)
+{
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < threads; ++t)
+        workers.emplace_back(f, t);
+    for (auto& w : workers)
+        w.join();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template<typename T>
+void run(const std::string& name, const std::vector<bytes_t>& keys, size_t reads, size_t threads)
+{
+    T set;
+    // every thread inserts its share of the keys, then looks up keys
+    // spread over all of them
+    double insert = timed(threads, [&](size_t t) {
+        for (size_t i = t; i < keys.size(); i += threads)
+            set.insert(keys[i]);
+    });
+    std::vector<size_t> found(threads);
+    double exists = timed(threads, [&](size_t t) {
+        std::mt19937_64 gen(t);
+        size_t n = 0;
+        for (size_t i = 0; i < reads / threads; ++i)
+            n += set.exists(keys[gen() % keys.size()]).first;
+        found[t] = n;
+    });
+    std::cout << name << "\t" << threads << " threads\t" << keys.size() / insert / 1e6 << " M inserts/s\t"
+              << reads / exists / 1e6 << " M exists/s" << std::endl;
+}
+
+template<typename T>
+void run_readers(const std::string& name, const std::vector<bytes_t>& keys, size_t threads)
+{
+    // thread 0 inserts every key, the others look up keys it has inserted
+    // until it is done
+    T set;
+    std::atomic<size_t> inserted = 0;
+    std::vector<size_t> lookups(threads);
+    double writer = 0;
+    double total = timed(threads, [&](size_t t) {
+        if (t == 0) {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < keys.size(); ++i) {
+                set.insert(keys[i]);
+                inserted.store(i + 1, std::memory_order_release);
+            }
+            writer = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return;
+        }
+        std::mt19937_64 gen(t);
+        size_t n = 0, found = 0;
+        while (true) {
+            const size_t known = inserted.load(std::memory_order_acquire);
+            if (known == keys.size()) break;
+            if (known == 0) continue;
+            found += set.exists(keys[gen() % known]).first;
+            ++n;
+        }
+        lookups[t] = n;
+        (void)found;
+    });
+    size_t reads = 0;
+    for (auto n : lookups) reads += n;
+    std::cout << name << "\t" << threads - 1 << " readers\t" << keys.size() / writer / 1e6 << " M inserts/s\t"
+              << reads / total / 1e6 << " M exists/s" << std::endl;
+}
+
+int main(int argc, const char** argv)
+{
+    size_t elements = argc > 1 ? std::stoull(argv[1]) : 1000000;
+    size_t reads = argc > 2 ? std::stoull(argv[2]) : 4000000;
+    size_t max_threads = argc > 3 ? std::stoull(argv[3]) : 64;
+    auto keys = make_keys(elements, 16, 42);
+    std::cout << std::thread::hardware_concurrency() << " hardware threads" << std::endl;
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        run<locked_set>("one mutex ", keys, reads, threads);
+        run<ptrie::sharded_set<unsigned char, size_t, 256, ptrie::route_prefix<2>>>("256 prefix", keys, reads, threads);
+        run<ptrie::sharded_set<>>("16 shards ", keys, reads, threads);
+        run<ptrie::sharded_set<unsigned char, size_t, 64, ptrie::route_bytes<0>>>("64 ranges ", keys, reads, threads);
+    }
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        run_readers<rwlocked_set>("rw lock   ", keys, threads);
+        run_readers<shared_set>("shared    ", keys, threads);
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright Peter G. Jensen <root@petergjoel.dk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Insert and exists with and without use_filter, where most of the lookups
+// are for keys not in the trie as in a state space exploration.
+
+#include <ptrie/ptrie.h>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using bytes_t = std::vector<unsigned char>;
+
+std::vector<bytes_t> make_keys(size_t elements, size_t length, size_t alphabet, size_t seed)
+{
+    std::mt19937_64 gen(seed);
+    std::vector<bytes_t> keys(elements);
+    for (auto& key : keys) {
+        key.resize(length);
+        for (auto& b : key) b = gen() % alphabet;
+    }
+    return keys;
+}
+
+template<typename T>
+void run(const std::string& name, size_t elements, size_t length, size_t reads, size_t miss_percent, size_t alphabet)
+{
+    auto keys = make_keys(elements, length, alphabet, 42);
+    auto missing = make_keys(elements, length, alphabet, 1337);
+    std::mt19937_64 gen(7);
+    std::vector<const bytes_t*> order(reads);
+    for (auto& k : order)
+        k = gen() % 100 < miss_percent ? &missing[gen() % elements] : &keys[gen() % elements];
+
+    for (bool filter : {false, true}) {
+        T set;
+        set.use_filter(filter);
+        auto start = std::chrono::steady_clock::now();
+        for (auto& key : keys)
+            set.insert(key.data(), key.size());
+        auto end = std::chrono::steady_clock::now();
+        double insert_ns = std::chrono::duration<double, std::nano>(end - start).count() / elements;
+
+        size_t found = 0;
+        start = std::chrono::steady_clock::now();
+        for (auto* k : order)
+            found += set.exists(k->data(), k->size()).first;
+        end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count() / reads;
+
+        std::cout << name << (filter ? " filter" : "       ") << "\t" << elements << " keys of " << length
+                  << " bytes over " << alphabet << " values, " << miss_percent << "% misses\t"
+                  << insert_ns << " ns/insert\t" << ns << " ns/exists\t(" << found << " found, "
+                  << set.memory_usage()._filter_bytes << " filter bytes)" << std::endl;
+    }
+}
+
+int main(int argc, const char** argv)
+{
+    size_t elements = argc > 1 ? std::stoull(argv[1]) : 1000000;
+    size_t reads = argc > 2 ? std::stoull(argv[2]) : 5000000;
+    run<ptrie::set<unsigned char, 17, 129>>("split 129", elements, 16, reads, 70, 256);
+    run<ptrie::set<unsigned char, 17, 129>>("split 129", elements, 32, reads, 70, 4);
+    run<ptrie::set<unsigned char, 17, 129>>("split 129", elements, 64, reads, 70, 4);
+    run<ptrie::set<unsigned char, 17, 129>>("split 129", elements, 64, reads, 30, 4);
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright Peter G. Jensen <root@petergjoel.dk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Latency of exists on tries with large buckets, where the scan of the
+// first-array in bucket_search dominates. Built twice, as scan_benchmark and
+// as scan_benchmark_scalar with PTRIE_NO_SIMD, to compare the two scans.
+// Each run also times the same lookups through exists_batch.
+
+#include <ptrie/ptrie.h>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <span>
+#include <string>
+#include <vector>
+
+using bytes_t = std::vector<unsigned char>;
+
+// keys are drawn from the first alphabet values of each byte, a small
+// alphabet gives the long shared prefixes of state vectors
+std::vector<bytes_t> make_keys(size_t elements, size_t min_length, size_t max_length, size_t alphabet, size_t seed)
+{
+    std::mt19937_64 gen(seed);
+    std::uniform_int_distribution<size_t> length(min_length, max_length);
+    std::vector<bytes_t> keys(elements);
+    for (auto& key : keys) {
+        key.resize(length(gen));
+        for (auto& b : key) b = gen() % alphabet;
+    }
+    return keys;
+}
+
+template<typename T>
+void run(const std::string& name, size_t elements, size_t min_length, size_t max_length, size_t reads, size_t alphabet = 256)
+{
+    T set;
+    auto keys = make_keys(elements, min_length, max_length, alphabet, 42);
+    for (auto& key : keys)
+        set.insert(key.data(), key.size());
+    // half of the lookups are for keys not in the set
+    auto missing = make_keys(elements, min_length, max_length, alphabet, 1337);
+
+    std::mt19937_64 gen(7);
+    std::vector<const bytes_t*> order(reads);
+    for (auto& k : order)
+        k = gen() % 2 ? &keys[gen() % elements] : &missing[gen() % elements];
+
+    size_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto* k : order)
+        found += set.exists(k->data(), k->size()).first;
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / reads;
+
+    // the same lookups through exists_batch, 64 at a time
+    std::vector<std::pair<const unsigned char*, size_t>> batch;
+    for (auto* k : order)
+        batch.emplace_back(k->data(), k->size());
+    std::vector<std::pair<bool, size_t>> results(64);
+    size_t batch_found = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < reads; i += 64) {
+        auto keys = std::span(batch).subspan(i, std::min<size_t>(64, reads - i));
+        set.exists_batch(keys, results);
+        for (size_t j = 0; j < keys.size(); ++j)
+            batch_found += results[j].first;
+    }
+    end = std::chrono::steady_clock::now();
+    double batch_ns = std::chrono::duration<double, std::nano>(end - start).count() / reads;
+
+    std::cout << name << "\t" << elements << " keys of " << min_length << "-" << max_length
+              << " bytes over " << alphabet << " values\t" << ns << " ns/exists\t"
+              << batch_ns << " ns/exists_batch\t(" << found << "/" << batch_found << " found)" << std::endl;
+}
+
+int main(int argc, const char** argv)
+{
+    size_t elements = argc > 1 ? std::stoull(argv[1]) : 1000000;
+    size_t reads = argc > 2 ? std::stoull(argv[2]) : 5000000;
+#ifdef PTRIE_SSE2
+#ifdef PTRIE_AVX2
+    std::cout << "SCAN AVX2" << std::endl;
+#else
+    std::cout << "SCAN SSE2" << std::endl;
+#endif
+#else
+    std::cout << "SCAN SCALAR" << std::endl;
+#endif
+    run<ptrie::set<unsigned char, 17, 129>>("split 129", elements, 8, 8, reads);
+    run<ptrie::set<unsigned char, 17, 129>>("split 129", elements, 16, 16, reads);
+    run<ptrie::set<unsigned char, 17, 129>>("split 129", elements, 1, 24, reads);
+    run<ptrie::set<unsigned char, 17, 256>>("split 256", elements, 8, 8, reads);
+    run<ptrie::set<unsigned char, 17, 256>>("split 256", elements, 1, 24, reads);
+    run<ptrie::set<unsigned char, 17, 129>>("split 129", elements, 32, 32, reads, 4);
+    run<ptrie::set<unsigned char, 17, 256>>("split 256", elements, 64, 64, reads, 4);
+    // small tries are a handful of buckets at byte 0 and 1
+    run<ptrie::set<unsigned char, 17, 256>>("split 256", 200, 1, 4, reads);
+    return 0;
+}
@@ -20,6 +20,84 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// counts the dTLB load misses of this thread between start and stop, where
+// the kernel allows it (see perf_event_paranoid).
+class tlb_counter_t {
+    int _fd = -1;
+public:
+    tlb_counter_t()
+    {
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        _fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~tlb_counter_t()
+    {
+#ifdef __linux__
+        if(_fd >= 0) close(_fd);
+#endif
+    }
+
+    bool available() const { return _fd >= 0; }
+
+    void start()
+    {
+#ifdef __linux__
+        if(_fd < 0) return;
+        ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    uint64_t stop()
+    {
+        uint64_t count = 0;
+#ifdef __linux__
+        if(_fd < 0) return 0;
+        ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(_fd, &count, sizeof(count)) != sizeof(count)) count = 0;
+#endif
+        return count;
+    }
+};
+
+// the anonymous memory of this process that is backed by transparent huge
+// pages, in kB, or 0 where /proc/self/smaps_rollup does not exist
+inline size_t anon_huge_kb()
+{
+    size_t kb = 0;
+#ifdef __linux__
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    if(f == nullptr) return 0;
+    char line[256];
+    while(fgets(line, sizeof(line), f) != nullptr)
+        if(sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+            break;
+    fclose(f);
+#endif
+    return kb;
+}
 
 template<typename T>
 void read_arg(const char* data, T& dest, const char* error, const char* type)
@@ -0,0 +1,202 @@
+/*
+ * Copyright Peter G. Jensen <root@petergjoel.dk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * File:   bloom_filter.h
+ * Author: Peter G. Jensen
+ *
+ * Cache-blocked Bloom filter answering for keys that are not in a ptrie.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <utility>
+
+#include "prefetch.h"
+
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+namespace ptrie {
+
+    // A split block Bloom filter: a key sets one bit in each of the eight
+    // words of a single cache line, so a lookup is one cache miss and a few
+    // multiplications. At BITS bits per key about 0.1% of the absent keys
+    // get through. Keys can not be taken out again, the owner drops them by
+    // building a new filter.
+    template<typename ALLOC>
+    class bloom_filter_t {
+    public:
+        static constexpr size_t BITS = 16;
+    private:
+        static constexpr size_t WORDS = 8;
+        static constexpr size_t KEYSPERBLOCK = WORDS * 64 / BITS;
+
+        using word_alloc_t = typename std::allocator_traits<ALLOC>::template rebind_alloc<uint64_t>;
+        using traits = std::allocator_traits<word_alloc_t>;
+
+        [[no_unique_address]] word_alloc_t _alloc;
+        uint64_t* _memory = nullptr;    // as allocated, _words is aligned to a cache line
+        uint64_t* _words = nullptr;
+        size_t _blocks = 0;
+        size_t _count = 0;
+        size_t _capacity = 0;
+
+        static constexpr size_t allocated(size_t blocks) {
+            return blocks * WORDS + WORDS - 1;
+        }
+
+        // the high half of the hash picks the block, the low half a bit of
+        // each of its words
+        uint64_t* block(uint64_t hash) const {
+            return _words + (((hash >> 32) * _blocks) >> 32) * WORDS;
+        }
+
+        static uint64_t bit(uint64_t hash, size_t word) {
+            constexpr uint32_t SALT[WORDS] = {
+                0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+                0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+            };
+            return uint64_t{1} << ((static_cast<uint32_t>(hash) * SALT[word]) >> 26);
+        }
+
+        static constexpr uint64_t K = 0x9e3779b97f4a7c15ULL;
+
+        static uint64_t mix(uint64_t h, uint64_t word) {
+            h = (h ^ word) * K;
+            return h ^ (h >> 29);
+        }
+
+        static uint64_t finish(uint64_t h) {
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ULL;
+            return h ^ (h >> 33);
+        }
+    public:
+        explicit bloom_filter_t(const ALLOC& alloc = ALLOC()) : _alloc(alloc) {}
+        bloom_filter_t(const bloom_filter_t&) = delete;
+        bloom_filter_t& operator=(const bloom_filter_t&) = delete;
+        ~bloom_filter_t() { reset(0); }
+
+        bool enabled() const { return _blocks != 0; }
+        // an empty filter sized for capacity keys, 0 disables it
+        void reset(size_t capacity);
+        // forgets all keys and keeps the size
+        void clear() {
+            std::fill(_words, _words + _blocks * WORDS, 0);
+            _count = 0;
+        }
+        void copy(const bloom_filter_t& other);
+        void swap(bloom_filter_t& other);
+
+        void add(uint64_t hash) {
+            uint64_t* b = block(hash);
+            for (size_t w = 0; w < WORDS; ++w)
+                b[w] |= bit(hash, w);
+            ++_count;
+        }
+
+        void prefetch(uint64_t hash) const {
+            ptrie_prefetch(block(hash));
+        }
+
+        // false only for keys never added
+        bool may_contain(uint64_t hash) const {
+            const uint64_t* b = block(hash);
+            uint64_t missing = 0;
+            for (size_t w = 0; w < WORDS; ++w)
+                missing |= bit(hash, w) & ~b[w];
+            return missing == 0;
+        }
+
+        // more keys were added than the filter was sized for
+        bool full() const { return _count > _capacity; }
+        size_t capacity() const { return _capacity; }
+        size_t bytes() const { return _memory == nullptr ? 0 : allocated(_blocks) * sizeof(uint64_t); }
+
+        // the same hash for the same bytes, whether they are given in memory
+        // or through an accessor returning byte i.
+        static uint64_t hash(const unsigned char* data, size_t length) {
+            uint64_t h = length * K;
+            size_t i = 0;
+            for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+                uint64_t word;
+                memcpy(&word, data + i, sizeof(uint64_t));
+                h = mix(h, word);
+            }
+            if (i < length) {
+                uint64_t word = 0;
+                memcpy(&word, data + i, length - i);
+                h = mix(h, word);
+            }
+            return finish(h);
+        }
+
+        template<typename F>
+        static uint64_t hash(size_t length, F&& byte) {
+            uint64_t h = length * K;
+            for (size_t i = 0; i < length; i += sizeof(uint64_t)) {
+                uint64_t word = 0;
+                const size_t n = std::min(sizeof(uint64_t), length - i);
+                for (size_t j = 0; j < n; ++j)
+                    reinterpret_cast<unsigned char*>(&word)[j] = byte(i + j);
+                h = mix(h, word);
+            }
+            return finish(h);
+        }
+    };
+
+    template<typename ALLOC>
+    void bloom_filter_t<ALLOC>::reset(size_t capacity)
+    {
+        if (_memory != nullptr)
+            traits::deallocate(_alloc, _memory, allocated(_blocks));
+        _memory = _words = nullptr;
+        _blocks = _count = _capacity = 0;
+        if (capacity == 0) return;
+        _blocks = (capacity + KEYSPERBLOCK - 1) / KEYSPERBLOCK;
+        _capacity = _blocks * KEYSPERBLOCK;
+        _memory = traits::allocate(_alloc, allocated(_blocks));
+        const size_t line = WORDS * sizeof(uint64_t);
+        _words = reinterpret_cast<uint64_t*>((reinterpret_cast<uintptr_t>(_memory) + line - 1) & ~(uintptr_t)(line - 1));
+        clear();
+    }
+
+    template<typename ALLOC>
+    void bloom_filter_t<ALLOC>::copy(const bloom_filter_t& other)
+    {
+        reset(other._capacity);
+        std::copy(other._words, other._words + other._blocks * WORDS, _words);
+        _count = other._count;
+    }
+
+    template<typename ALLOC>
+    void bloom_filter_t<ALLOC>::swap(bloom_filter_t& other)
+    {
+        std::swap(_memory, other._memory);
+        std::swap(_words, other._words);
+        std::swap(_blocks, other._blocks);
+        std::swap(_count, other._count);
+        std::swap(_capacity, other._capacity);
+    }
+}
+
+#endif /* BLOOM_FILTER_H */
@@ -0,0 +1,311 @@
+/*
+ * Copyright Peter G. Jensen <root@petergjoel.dk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * File:   bucket_pool.h
+ * Author: Peter G. Jensen
+ *
+ * Size-class slab pool for the bucket blocks of a ptrie.
+ */
+#include <stdint.h>
+#include <assert.h>
+#include <algorithm>
+#include <bit>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include "region_table.h"
+
+#ifndef BUCKET_POOL_H
+#define BUCKET_POOL_H
+
+namespace ptrie {
+
+    // fragmentation report of a bucket_pool_t, all numbers in bytes.
+    struct pool_stats_t {
+        size_t _reserved = 0;   // memory obtained from the allocator
+        size_t _live = 0;       // handed out
+        size_t _free = 0;       // given back, but not yet returned to the allocator
+        size_t _large = 0;      // blocks too large for the slabs, served directly
+
+        // share of the reserved memory not holding a live block
+        double fragmentation() const {
+            return _reserved == 0 ? 0.0 : double(_reserved - _live) / double(_reserved);
+        }
+    };
+
+    // an allocator can ask for memory to be requested in chunks of at least
+    // chunk_size bytes, see hugepage_allocator.
+    template<typename A, typename = void>
+    struct __chunk_size : std::integral_constant<size_t, 0> {};
+
+    template<typename A>
+    struct __chunk_size<A, std::void_t<decltype(A::chunk_size)>>
+    : std::integral_constant<size_t, A::chunk_size> {};
+
+    // Buckets are bounded by HEAPBOUND * SPLITBOUND, so their sizes fall in a
+    // small known range. Sizes are rounded to a power of two size class and
+    // served from SLABSIZE aligned slabs with a free list per class. Buckets
+    // grow until they split, so blocks are freed in one class and requested in
+    // another; freed blocks are merged with their buddy to keep them usable.
+    // Each slab starts with a bitmap marking where free blocks begin, the
+    // class of a free block is kept in its list links. Memory is only
+    // returned to the allocator when the pool is released. Slabs are taken
+    // from the allocator in batches of the chunk_size it asks for.
+    // With HANDLES every slab is registered in the region_table_t, so the
+    // blocks can be named by 32-bit handles.
+    template<typename ALLOC, bool HANDLES = false>
+    class bucket_pool_t {
+    public:
+        static constexpr size_t SLABSIZE = 1024 * 64;
+        static constexpr size_t MINBLOCK = 16;
+        static constexpr size_t MAXBLOCK = SLABSIZE / 2;
+    private:
+        static constexpr size_t UNITS = SLABSIZE / MINBLOCK;
+        static constexpr size_t ORDERS = std::bit_width(MAXBLOCK / MINBLOCK);
+        static constexpr size_t BATCH = std::max<size_t>(1, __chunk_size<ALLOC>::value / SLABSIZE);
+
+        struct alignas(SLABSIZE) slab_t {
+            unsigned char _data[SLABSIZE];
+        };
+
+        struct header_t {
+            slab_t* _next;      // the next batch, for the first slab of a batch
+            uint32_t _slabs;    // slabs in the batch, for the first slab of a batch
+            uint32_t _region;
+            uint64_t _map[UNITS / 64];
+        };
+        // the header occupies the first block of this order in every slab
+        static constexpr size_t HEADORDER = std::bit_width((sizeof(header_t) - 1) / MINBLOCK);
+
+        struct free_t {
+            free_t* _next;
+            uintptr_t _prev; // previous block, the order lives in the low bits
+        };
+        static_assert(sizeof(free_t) <= MINBLOCK && ORDERS < MINBLOCK);
+        static_assert(!HANDLES || (SLABSIZE == region_table_t::REGIONSIZE && MINBLOCK == region_table_t::UNIT));
+
+        using slab_alloc_t = typename std::allocator_traits<ALLOC>::template rebind_alloc<slab_t>;
+        using slab_traits = std::allocator_traits<slab_alloc_t>;
+        using word_alloc_t = typename std::allocator_traits<ALLOC>::template rebind_alloc<size_t>;
+        using word_traits = std::allocator_traits<word_alloc_t>;
+
+        [[no_unique_address]] slab_alloc_t _alloc;
+        free_t* _free[ORDERS] = {};
+        uint32_t _nonempty = 0;
+        slab_t* _slabs = nullptr;
+        slab_t* _spare = nullptr;   // slabs of the last batch not yet in use
+        size_t _spares = 0;
+        pool_stats_t _stats;
+
+        static constexpr size_t words(size_t bytes) {
+            return (bytes + sizeof(size_t) - 1) / sizeof(size_t);
+        }
+
+        static constexpr size_t order_of(size_t bytes) {
+            return bytes <= MINBLOCK ? 0 : std::bit_width((bytes - 1) / MINBLOCK);
+        }
+
+        static header_t* header(const void* block) {
+            return reinterpret_cast<header_t*>(reinterpret_cast<uintptr_t>(block) & ~(SLABSIZE - 1));
+        }
+
+        static size_t unit(const void* block) {
+            return (reinterpret_cast<uintptr_t>(block) & (SLABSIZE - 1)) / MINBLOCK;
+        }
+
+        static size_t order(const free_t* block) {
+            return block->_prev & (MINBLOCK - 1);
+        }
+
+        void push(unsigned char* ptr, size_t k);
+        void unlink(free_t* block, size_t k);
+        void new_slab();
+    public:
+        explicit bucket_pool_t(const ALLOC& alloc = ALLOC()) : _alloc(alloc) {}
+        bucket_pool_t(const bucket_pool_t&) = delete;
+        bucket_pool_t& operator=(const bucket_pool_t&) = delete;
+        ~bucket_pool_t() { release(); }
+
+        // the number of bytes actually reserved for a request of bytes
+        static constexpr size_t round(size_t bytes) {
+            return bytes <= MAXBLOCK ? MINBLOCK << order_of(bytes) : words(bytes) * sizeof(size_t);
+        }
+
+        void* allocate(size_t bytes);
+        void deallocate(void* ptr, size_t bytes);
+
+        // the handle of a block of at most MAXBLOCK bytes
+        static uint32_t handle(const void* block) {
+            static_assert(HANDLES);
+            return region_table_t::handle(header(block)->_region, header(block), block);
+        }
+
+        // returns all slabs to the allocator, invalidates every block
+        void release();
+        void swap(bucket_pool_t& other);
+
+        const pool_stats_t& stats() const { return _stats; }
+    };
+
+    template<typename ALLOC, bool HANDLES>
+    void bucket_pool_t<ALLOC, HANDLES>::push(unsigned char* ptr, size_t k)
+    {
+        auto* block = reinterpret_cast<free_t*>(ptr);
+        block->_next = _free[k];
+        block->_prev = k;
+        if (_free[k] != nullptr)
+            _free[k]->_prev = reinterpret_cast<uintptr_t>(block) | k;
+        _free[k] = block;
+        _nonempty |= 1u << k;
+        auto u = unit(block);
+        header(block)->_map[u / 64] |= uint64_t{1} << (u % 64);
+    }
+
+    template<typename ALLOC, bool HANDLES>
+    void bucket_pool_t<ALLOC, HANDLES>::unlink(free_t* block, size_t k)
+    {
+        auto* prev = reinterpret_cast<free_t*>(block->_prev & ~(MINBLOCK - 1));
+        if (prev != nullptr) prev->_next = block->_next;
+        else _free[k] = block->_next;
+        if (block->_next != nullptr)
+            block->_next->_prev = block->_prev;
+        if (_free[k] == nullptr)
+            _nonempty &= ~(1u << k);
+        auto u = unit(block);
+        header(block)->_map[u / 64] &= ~(uint64_t{1} << (u % 64));
+    }
+
+    template<typename ALLOC, bool HANDLES>
+    void* bucket_pool_t<ALLOC, HANDLES>::allocate(size_t bytes)
+    {
+        if (bytes > MAXBLOCK) {
+            _stats._large += round(bytes);
+            word_alloc_t a(_alloc);
+            return word_traits::allocate(a, words(bytes));
+        }
+        const auto k = order_of(bytes);
+        auto larger = _nonempty >> k;
+        if (larger == 0) {
+            new_slab();
+            larger = _nonempty >> k;
+        }
+        // split the smallest free block that fits, the halves go back
+        auto j = k + std::countr_zero(larger);
+        auto* block = _free[j];
+        unlink(block, j);
+        auto* ptr = reinterpret_cast<unsigned char*>(block);
+        while (j > k) {
+            --j;
+            push(ptr + (MINBLOCK << j), j);
+        }
+        _stats._live += MINBLOCK << k;
+        _stats._free -= MINBLOCK << k;
+        return ptr;
+    }
+
+    template<typename ALLOC, bool HANDLES>
+    void bucket_pool_t<ALLOC, HANDLES>::deallocate(void* ptr, size_t bytes)
+    {
+        if (ptr == nullptr) return;
+        if (bytes > MAXBLOCK) {
+            _stats._large -= round(bytes);
+            word_alloc_t a(_alloc);
+            word_traits::deallocate(a, static_cast<size_t*>(ptr), words(bytes));
+            return;
+        }
+        auto k = order_of(bytes);
+        _stats._live -= MINBLOCK << k;
+        _stats._free += MINBLOCK << k;
+        auto* block = static_cast<unsigned char*>(ptr);
+        auto* head = header(block);
+        while (k + 1 < ORDERS) {
+            auto* buddy = reinterpret_cast<unsigned char*>(head) +
+                    ((block - reinterpret_cast<unsigned char*>(head)) ^ (MINBLOCK << k));
+            auto u = unit(buddy);
+            if ((head->_map[u / 64] & (uint64_t{1} << (u % 64))) == 0 ||
+                order(reinterpret_cast<free_t*>(buddy)) != k)
+                break;
+            unlink(reinterpret_cast<free_t*>(buddy), k);
+            block = std::min(block, buddy);
+            ++k;
+        }
+        push(block, k);
+    }
+
+    template<typename ALLOC, bool HANDLES>
+    void bucket_pool_t<ALLOC, HANDLES>::new_slab()
+    {
+        if (_spares == 0) {
+            auto* batch = slab_traits::allocate(_alloc, BATCH);
+            auto* head = reinterpret_cast<header_t*>(batch);
+            head->_next = _slabs;
+            head->_slabs = BATCH;
+            _slabs = _spare = batch;
+            _spares = BATCH;
+            _stats._reserved += BATCH * SLABSIZE;
+        }
+        auto* slab = _spare;
+        auto* head = reinterpret_cast<header_t*>(slab);
+        head->_region = 0;
+        if constexpr (HANDLES)
+            head->_region = region_table_t::add(slab);
+        ++_spare;
+        --_spares;
+        std::fill(std::begin(head->_map), std::end(head->_map), 0);
+        // everything behind the header, as one free block of each order
+        for (size_t k = HEADORDER; k < ORDERS; ++k)
+            push(slab->_data + (MINBLOCK << k), k);
+        _stats._free += SLABSIZE - (MINBLOCK << HEADORDER);
+    }
+
+    template<typename ALLOC, bool HANDLES>
+    void bucket_pool_t<ALLOC, HANDLES>::release()
+    {
+        // only the last batch, which is first in the list, has spares
+        while (_slabs != nullptr) {
+            auto* head = reinterpret_cast<header_t*>(_slabs);
+            auto* next = head->_next;
+            const size_t count = head->_slabs;
+            if constexpr (HANDLES) {
+                for (size_t i = 0; i + _spares < count; ++i)
+                    region_table_t::remove(reinterpret_cast<header_t*>(_slabs + i)->_region);
+            }
+            slab_traits::deallocate(_alloc, _slabs, count);
+            _slabs = next;
+            _spares = 0;
+        }
+        _spare = nullptr;
+        std::fill(std::begin(_free), std::end(_free), nullptr);
+        _nonempty = 0;
+        _stats._reserved = _stats._live = _stats._free = 0;
+    }
+
+    template<typename ALLOC, bool HANDLES>
+    void bucket_pool_t<ALLOC, HANDLES>::swap(bucket_pool_t& other)
+    {
+        std::swap(_free, other._free);
+        std::swap(_nonempty, other._nonempty);
+        std::swap(_slabs, other._slabs);
+        std::swap(_spare, other._spare);
+        std::swap(_spares, other._spares);
+        std::swap(_stats, other._stats);
+    }
+}
+
+#endif /* BUCKET_POOL_H */
@@ -0,0 +1,146 @@
+/*
+ * Copyright Peter G. Jensen <root@petergjoel.dk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * File:   epoch.h
+ * Author: Peter G. Jensen
+ *
+ * Epoch-based reclamation for a ptrie that is read while it is written.
+ */
+#include <stdint.h>
+#include <assert.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+namespace ptrie {
+
+    // One writer retires the memory it has unlinked, readers pin the epoch
+    // they start in for the length of a lookup. A reader pinned in epoch e
+    // can only reach what was retired in e or later, so the memory retired
+    // in e - 1 is handed back when the writer moves from e to e + 1, which
+    // it only does once no reader is left in e - 1. Readers count themselves
+    // under the parity of their epoch in one of SLOTS cache lines, picked
+    // per thread, and the writer tries to move on every BATCH retirements.
+    template<typename R, typename ALLOC = std::allocator<R>>
+    class epoch_t {
+    public:
+        static constexpr size_t SLOTS = 64;
+        static constexpr size_t BATCH = 256;
+    private:
+        struct alignas(64) slot_t {
+            std::atomic<size_t> _readers[2] = {0, 0};
+        };
+
+        std::unique_ptr<slot_t[]> _slots;
+        std::atomic<size_t> _epoch = 0;
+        std::vector<R, ALLOC> _retired[2];
+        size_t _since = 0;
+
+        static size_t slot() {
+            static std::atomic<size_t> next = 0;
+            thread_local const size_t mine = next.fetch_add(1, std::memory_order_relaxed) % SLOTS;
+            return mine;
+        }
+
+        size_t readers(size_t parity) const {
+            size_t n = 0;
+            for (size_t s = 0; s < SLOTS; ++s)
+                n += _slots[s]._readers[parity].load(std::memory_order_seq_cst);
+            return n;
+        }
+    public:
+        // keeps the epoch it was made in pinned until it is destroyed, does
+        // nothing while the epochs are not enabled
+        class guard_t {
+            std::atomic<size_t>* _readers = nullptr;
+        public:
+            explicit guard_t(const epoch_t& epochs) {
+                if (!epochs.enabled()) return;
+                auto& slot = epochs._slots[epoch_t::slot()];
+                size_t e = epochs._epoch.load(std::memory_order_seq_cst);
+                while (true) {
+                    _readers = &slot._readers[e & 1];
+                    _readers->fetch_add(1, std::memory_order_seq_cst);
+                    // the writer may have moved on before we were counted
+                    const size_t now = epochs._epoch.load(std::memory_order_seq_cst);
+                    if (now == e) break;
+                    _readers->fetch_sub(1, std::memory_order_release);
+                    e = now;
+                }
+            }
+            guard_t(const guard_t&) = delete;
+            guard_t& operator=(const guard_t&) = delete;
+            ~guard_t() {
+                if (_readers != nullptr)
+                    _readers->fetch_sub(1, std::memory_order_release);
+            }
+        };
+
+        explicit epoch_t(const ALLOC& alloc = ALLOC())
+        : _retired{std::vector<R, ALLOC>(alloc), std::vector<R, ALLOC>(alloc)} {}
+        epoch_t(const epoch_t&) = delete;
+        epoch_t& operator=(const epoch_t&) = delete;
+
+        bool enabled() const { return _slots != nullptr; }
+
+        // the retired records have to be drained before disabling
+        void enable(bool enable = true) {
+            assert(_retired[0].empty() && _retired[1].empty());
+            if (!enable) _slots = nullptr;
+            else if (_slots == nullptr) _slots = std::make_unique<slot_t[]>(SLOTS);
+        }
+
+        void retire(const R& record) {
+            _retired[_epoch.load(std::memory_order_relaxed) & 1].push_back(record);
+            ++_since;
+        }
+
+        // calls reclaim for the records no reader can reach anymore
+        template<typename F>
+        void collect(F&& reclaim) {
+            if (_since < BATCH) return;
+            _since = 0;
+            const size_t e = _epoch.load(std::memory_order_relaxed);
+            // the readers of e - 1 are counted with those of e + 1
+            if (readers((e + 1) & 1) != 0) return;
+            auto& old = _retired[(e + 1) & 1];
+            for (auto& record : old)
+                reclaim(record);
+            old.clear();
+            _epoch.store(e + 1, std::memory_order_seq_cst);
+        }
+
+        // calls reclaim for every record, there must be no readers
+        template<typename F>
+        void drain(F&& reclaim) {
+            for (auto& retired : _retired) {
+                for (auto& record : retired)
+                    reclaim(record);
+                retired.clear();
+            }
+            _since = 0;
+        }
+
+        size_t retired() const { return _retired[0].size() + _retired[1].size(); }
+    };
+}
+
+#endif /* EPOCH_H */
@@ -0,0 +1,176 @@
+/*
+ * Copyright Peter G. Jensen <root@petergjoel.dk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * File:   first_scan.h
+ * Author: Peter G. Jensen
+ *
+ * Vectorized scans over the sorted first-array of a bucket, and the
+ * comparison of the suffixes stored next to it.
+ */
+#ifndef FIRST_SCAN_H
+#define FIRST_SCAN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <bit>
+
+#if !defined(PTRIE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#define PTRIE_SSE2 1
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#define PTRIE_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+namespace ptrie {
+
+    // The kernels below only read first[0..count), the remainder of a block
+    // is handled one element at a time. Define PTRIE_NO_SIMD to always use
+    // the scalar loops.
+    namespace first_scan {
+
+#ifdef PTRIE_SSE2
+        // SSE2/AVX2 only compare signed 16 bit lanes, flipping the sign bit
+        // turns that into an unsigned compare.
+        inline __m128i flip(__m128i v) {
+            return _mm_xor_si128(v, _mm_set1_epi16((short)0x8000));
+        }
+#ifdef PTRIE_AVX2
+        inline __m256i flip(__m256i v) {
+            return _mm256_xor_si256(v, _mm256_set1_epi16((short)0x8000));
+        }
+#endif
+#endif
+
+        // The first index in [0, count) where less does not hold, less must
+        // hold for a prefix of the range. The halving compiles to
+        // conditional moves, so only the calls to less can branch.
+        template<typename F>
+        inline size_t partition(size_t count, F&& less) {
+            if (count == 0) return 0;
+            size_t base = 0;
+            while (count > 1) {
+                const size_t half = count / 2;
+                base = less(base + half) ? base + half : base;
+                count -= half;
+            }
+            return base + less(base);
+        }
+
+        // index of the first element >= key in the sorted first[0..count)
+        inline size_t lower_bound(const uint16_t* first, size_t count, uint16_t key) {
+            size_t i = 0;
+#ifdef PTRIE_SSE2
+#ifdef PTRIE_AVX2
+            const __m256i key16 = flip(_mm256_set1_epi16((short)key));
+            for (; i + 16 <= count; i += 16) {
+                __m256i f = flip(_mm256_loadu_si256((const __m256i*)(first + i)));
+                // lanes where first < key, set for a prefix of the block
+                uint32_t less = _mm256_movemask_epi8(_mm256_cmpgt_epi16(key16, f));
+                if (less != 0xFFFFFFFFu)
+                    return i + std::countr_zero(~less) / 2;
+            }
+#endif
+            const __m128i key8 = flip(_mm_set1_epi16((short)key));
+            for (; i + 8 <= count; i += 8) {
+                __m128i f = flip(_mm_loadu_si128((const __m128i*)(first + i)));
+                uint32_t less = _mm_movemask_epi8(_mm_cmplt_epi16(f, key8));
+                if (less != 0xFFFFu)
+                    return i + std::countr_zero(~less) / 2;
+            }
+#endif
+            for (; i < count; ++i)
+                if (first[i] >= key) break;
+            return i;
+        }
+
+        // The bytes taken up by the first count suffixes of a bucket where
+        // the suffix length is stored in first, that is for bucket-byte 0 the
+        // length itself and for bucket-byte 1 the low byte of the length in
+        // the upper half (high is the high byte of the length, and one byte
+        // of the suffix is already covered by first). Lengths of HEAPBOUND
+        // and up are stored as a pointer.
+        template<size_t HEAPBOUND>
+        inline size_t suffix_bytes(const uint16_t* first, size_t count, bool byte, uint16_t high) {
+            auto size = [&](uint16_t f) -> size_t {
+                uint16_t len = byte ? (uint16_t)((high | (f >> 8)) - 1) : f;
+                return len >= HEAPBOUND ? sizeof(unsigned char*) : len;
+            };
+            size_t i = 0;
+            size_t sum = 0;
+#ifdef PTRIE_SSE2
+            // the lanes are summed pairwise as signed 16 bit values, so
+            // only lengths below 2^15 can be kept in a lane
+            if constexpr (HEAPBOUND <= 0x8000) {
+                const __m128i bound = flip(_mm_set1_epi16((short)(HEAPBOUND - 1)));
+                const __m128i ptr = _mm_set1_epi16((short)sizeof(unsigned char*));
+                const __m128i hi = _mm_set1_epi16((short)high);
+                const __m128i one = _mm_set1_epi16(1);
+                __m128i acc = _mm_setzero_si128();
+                for (; i + 8 <= count; i += 8) {
+                    __m128i len = _mm_loadu_si128((const __m128i*)(first + i));
+                    if (byte)
+                        len = _mm_sub_epi16(_mm_or_si128(hi, _mm_srli_epi16(len, 8)), one);
+                    __m128i heap = _mm_cmpgt_epi16(flip(len), bound);
+                    len = _mm_or_si128(_mm_and_si128(heap, ptr), _mm_andnot_si128(heap, len));
+                    acc = _mm_add_epi32(acc, _mm_madd_epi16(len, one));
+                }
+                alignas(16) uint32_t lanes[4];
+                _mm_store_si128((__m128i*)lanes, acc);
+                sum = (size_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            }
+#endif
+            for (; i < count; ++i)
+                sum += size(first[i]);
+            return sum;
+        }
+
+        // Orders a[0..n) and b[0..n) like memcmp, eight bytes at a time. The
+        // first byte where two words differ is the lowest set byte of their
+        // xor on a little endian machine, the highest on a big endian one.
+        // A tail shorter than a word is compared as the last eight bytes,
+        // overlapping bytes already known to be equal.
+        inline int compare(const unsigned char* a, const unsigned char* b, size_t n) {
+            if (n >= sizeof(uint64_t)) {
+                auto differ = [&](size_t i) -> int {
+                    uint64_t wa, wb;
+                    memcpy(&wa, a + i, sizeof(uint64_t));
+                    memcpy(&wb, b + i, sizeof(uint64_t));
+                    const uint64_t x = wa ^ wb;
+                    if (x == 0) return 0;
+                    if constexpr (std::endian::native == std::endian::big)
+                        i += std::countl_zero(x) / 8;
+                    else
+                        i += std::countr_zero(x) / 8;
+                    return a[i] < b[i] ? -1 : 1;
+                };
+                size_t i = 0;
+                for (; i + sizeof(uint64_t) < n; i += sizeof(uint64_t))
+                    if (int cmp = differ(i)) return cmp;
+                return differ(n - sizeof(uint64_t));
+            }
+            for (size_t i = 0; i < n; ++i)
+                if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+            return 0;
+        }
+    }
+}
+
+#endif /* FIRST_SCAN_H */
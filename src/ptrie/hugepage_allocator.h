@@ -0,0 +1,130 @@
+/*
+ * Copyright Peter G. Jensen <root@petergjoel.dk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * File:   hugepage_allocator.h
+ * Author: Peter G. Jensen
+ *
+ * Allocator placing large blocks in 2MB huge pages.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#ifndef HUGEPAGE_ALLOCATOR_H
+#define HUGEPAGE_ALLOCATOR_H
+
+namespace ptrie {
+
+    // Blocks of at least HUGEPAGE bytes are mapped directly, aligned to
+    // HUGEPAGE and advised to be backed by transparent huge pages. With
+    // EXPLICIT the mapping is first tried from the reserved huge pages
+    // (MAP_HUGETLB), sized in whole huge pages. When huge pages are not
+    // available the mapping falls back to normal pages, and on other
+    // systems than Linux everything comes from std::allocator.
+    //
+    // Smaller blocks are served by std::allocator, so the tries request
+    // their slabs (see bucket_pool_t) in chunks of chunk_size. For the
+    // linked_bucket_t blocks of set_stable and map to be placed in huge
+    // pages, ALLOCSIZE times the size of an entry should be at least
+    // HUGEPAGE.
+    template<typename T, bool EXPLICIT = false>
+    class hugepage_allocator {
+    public:
+        using value_type = T;
+        static constexpr size_t HUGEPAGE = 2 * 1024 * 1024;
+        static constexpr size_t chunk_size = HUGEPAGE;
+
+        template<typename U>
+        struct rebind {
+            using other = hugepage_allocator<U, EXPLICIT>;
+        };
+
+        hugepage_allocator() = default;
+        template<typename U>
+        hugepage_allocator(const hugepage_allocator<U, EXPLICIT>&) {}
+
+        T* allocate(size_t n);
+        void deallocate(T* ptr, size_t n);
+
+        bool operator==(const hugepage_allocator&) const { return true; }
+        bool operator!=(const hugepage_allocator&) const { return false; }
+    private:
+        static constexpr size_t PAGE = 4096;
+
+        static constexpr size_t mapped(size_t bytes) {
+            const size_t unit = EXPLICIT ? HUGEPAGE : PAGE;
+            return (bytes + unit - 1) & ~(unit - 1);
+        }
+    };
+
+    template<typename T, bool EXPLICIT>
+    T* hugepage_allocator<T, EXPLICIT>::allocate(size_t n)
+    {
+        const size_t bytes = n * sizeof(T);
+#ifdef __linux__
+        if (bytes >= HUGEPAGE && alignof(T) <= HUGEPAGE) {
+            const size_t length = mapped(bytes);
+#ifdef MAP_HUGETLB
+            if constexpr (EXPLICIT) {
+                void* ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (ptr != MAP_FAILED)
+                    return static_cast<T*>(ptr);
+            }
+#endif
+            // over-map so the block can start on a huge page boundary
+            void* raw = mmap(nullptr, length + HUGEPAGE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw == MAP_FAILED)
+                throw std::bad_alloc();
+            auto* begin = static_cast<unsigned char*>(raw);
+            auto* ptr = reinterpret_cast<unsigned char*>(
+                    (reinterpret_cast<uintptr_t>(begin) + HUGEPAGE - 1) & ~(uintptr_t)(HUGEPAGE - 1));
+            if (ptr != begin)
+                munmap(begin, ptr - begin);
+            munmap(ptr + length, (begin + length + HUGEPAGE) - (ptr + length));
+#ifdef MADV_HUGEPAGE
+            // failing only means we stay on normal pages
+            madvise(ptr, length, MADV_HUGEPAGE);
+#endif
+            return reinterpret_cast<T*>(ptr);
+        }
+#endif
+        return std::allocator<T>().allocate(n);
+    }
+
+    template<typename T, bool EXPLICIT>
+    void hugepage_allocator<T, EXPLICIT>::deallocate(T* ptr, size_t n)
+    {
+        const size_t bytes = n * sizeof(T);
+#ifdef __linux__
+        if (bytes >= HUGEPAGE && alignof(T) <= HUGEPAGE) {
+            munmap(ptr, mapped(bytes));
+            return;
+        }
+#endif
+        std::allocator<T>().deallocate(ptr, n);
+    }
+}
+
+#endif /* HUGEPAGE_ALLOCATOR_H */
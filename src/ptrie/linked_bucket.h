@@ -23,14 +23,16 @@
  */
 #include <stdlib.h>
 #include <assert.h>
+#include <algorithm>
 #include <atomic>
+#include <mutex>
 #include <vector>
-#include <iostream>
+#include <memory>
 
 #ifndef LINKED_BUCKET_H
 #define LINKED_BUCKET_H
 
-template<typename T, size_t C>
+template<typename T, size_t C, typename A = std::allocator<T>>
 class linked_bucket_t {
 private:
 
@@ -38,93 +40,99 @@ private:
         std::atomic<bucket_t*> _nbucket;
         std::atomic<size_t> _offset;
         size_t _count;
+        size_t _thread;     // the thread handing out the ids of the bucket
         T _data[C];
     };
     
-    struct index_t
-    {
-        bucket_t* _index[C];
-        std::atomic<index_t*> _next;
+    // ids map to buckets through a two-level directory: a leaf holds LEAF
+    // bucket pointers, the directory holds the leaves. Leaves never move,
+    // a full directory is copied into one twice the size and the old one is
+    // kept until destruction, so readers never wait for a writer.
+    static constexpr size_t LEAF = 512;
+
+    struct leaf_t {
+        std::atomic<bucket_t*> _buckets[LEAF];
     };
 
+    struct directory_t {
+        std::atomic<leaf_t*>* _leaves;
+        size_t _size;
+        directory_t* _retired;
+    };
+
+    using alloc_traits = std::allocator_traits<A>;
+    using bucket_alloc_t = typename alloc_traits::template rebind_alloc<bucket_t>;
+    using leaf_alloc_t = typename alloc_traits::template rebind_alloc<leaf_t>;
+    using dir_alloc_t = typename alloc_traits::template rebind_alloc<directory_t>;
+    using slot_alloc_t = typename alloc_traits::template rebind_alloc<std::atomic<leaf_t*>>;
+    using bucket_traits = std::allocator_traits<bucket_alloc_t>;
+    using leaf_traits = std::allocator_traits<leaf_alloc_t>;
+    using dir_traits = std::allocator_traits<dir_alloc_t>;
+    using slot_traits = std::allocator_traits<slot_alloc_t>;
+
+    [[no_unique_address]] bucket_alloc_t _balloc;
+    [[no_unique_address]] leaf_alloc_t _lalloc;
+    [[no_unique_address]] dir_alloc_t _dalloc;
+    [[no_unique_address]] slot_alloc_t _salloc;
     bucket_t* _begin;
     std::vector<bucket_t* > _tnext;
-    index_t* _index;
+    std::atomic<directory_t*> _directory;
+    std::atomic<size_t> _leaves;
+    std::mutex _grow;   // held by writers adding leaves or growing the directory
 public:
 
-    linked_bucket_t(size_t threads)
-    : _tnext(threads) {
+    linked_bucket_t(size_t threads, const A& alloc = A())
+    : _balloc(alloc), _lalloc(alloc), _dalloc(alloc), _salloc(alloc), _tnext(threads) {
         for (size_t i = 0; i < threads; ++i) {
             _tnext[i] = nullptr;
         }
-        _begin = new bucket_t;
-        _begin->_count = 0;
+        _begin = new_bucket();
         _begin->_offset = 0;
-        _begin->_nbucket = nullptr;
         _tnext[0] = _begin;
 
-        _index = new index_t;
-        _index->_next = nullptr;
-
-        memset(&_begin->_data, 0, sizeof(T)*C);        
-        memset(&_index->_index, 0, sizeof(bucket_t*)*C);
-        _index->_index[0] = _begin;
+        try {
+            _directory = new_directory(8, nullptr);
+        } catch (...) {
+            delete_bucket(_begin);
+            throw;
+        }
+        _leaves = 0;
+        try {
+            insertToIndex(_begin, 0);
+        } catch (...) {
+            delete_directory(_directory.load());
+            delete_bucket(_begin);
+            throw;
+        }
     }
 
     ~linked_bucket_t() {
 
         do {
             bucket_t* n = _begin->_nbucket.load();
-            delete _begin;
+            delete_bucket(_begin);
             _begin = n;
 
         } while (_begin != nullptr);
 
-        do {
-            index_t* n = _index->_next.load();
-            delete _index;
-            _index = n;
-
-        } while (_index != nullptr);
-    }
-
-    inline T& operator[](size_t i) {
-        bucket_t* n = indexToBucket(i);
-        if(n != nullptr)
-        {
-            return n->_data[i % C];
+        directory_t* dir = _directory.load();
+        for (size_t i = 0; i < dir->_size; ++i) {
+            leaf_t* leaf = dir->_leaves[i].load();
+            if (leaf != nullptr) delete_leaf(leaf);
         }
-        
-        size_t b = C;
-        n = _begin;
-        while (b <= i) {
-            b += C;
-            n = n->_nbucket.load();
-            if(n == nullptr) std::cerr << "FAILED FETCHING ID: " << i << std::endl;
-            assert(n != nullptr);
+        while (dir != nullptr) {
+            directory_t* n = dir->_retired;
+            delete_directory(dir);
+            dir = n;
         }
+    }
 
-        return n->_data[i % C];
+    inline T& operator[](size_t i) {
+        return indexToBucket(i)->_data[i % C];
     }
 
     inline const T& operator[](size_t i) const {
-
-        bucket_t* n = indexToBucket(i);
-        if(n != nullptr)
-        {
-            return n->_data[i % C];
-        }
-        
-        n = _begin;        
-        size_t b = C;
-
-        while (b <= i) {
-            b += C;
-            n = n->_nbucket.load();
-            assert(n != nullptr);
-        }
-
-        return n->_data[i % C];
+        return indexToBucket(i)->_data[i % C];
     }
 
     size_t size() {
@@ -137,13 +145,32 @@ public:
         return cnt;
     }
 
+    // the entry blocks and index leaves currently allocated
+    size_t blocks() const {
+        size_t cnt = 0;
+        for (bucket_t* n = _begin; n != nullptr; n = n->_nbucket.load())
+            ++cnt;
+        return cnt;
+    }
+
+    size_t index_blocks() const {
+        return _leaves.load();
+    }
+
+    // the leaves and the directories, also the retired ones
+    size_t index_bytes() const {
+        size_t bytes = index_blocks() * sizeof(leaf_t);
+        for (directory_t* d = _directory.load(); d != nullptr; d = d->_retired)
+            bytes += sizeof(directory_t) + d->_size * sizeof(std::atomic<leaf_t*>);
+        return bytes;
+    }
+
+    static constexpr size_t block_size() { return sizeof(bucket_t); }
+
     inline size_t next(size_t thread) {
+        assert(thread < _tnext.size());
         if (_tnext[thread] == nullptr || _tnext[thread]->_count == C) {
-            bucket_t* next = new bucket_t;
-            next->_count = 0;
-            next->_nbucket = nullptr;
-            next->_offset = 0;
-            memset(&next->_data, 0, sizeof(T)*C);
+            bucket_t* next = new_bucket();
             
             bucket_t* n = _tnext[thread];
             if (n == nullptr) {
@@ -151,6 +178,7 @@ public:
             }
 
             next->_offset = n->_offset.load() + C; // beginning of next
+            next->_thread = thread;
 
             bucket_t* tmp = nullptr;
 
@@ -172,6 +200,11 @@ public:
         return c->_offset + (c->_count++);
     }
 
+    // the thread that handed out id
+    inline size_t owner(size_t id) const {
+        return indexToBucket(id)->_thread;
+    }
+
     inline void pop_back(size_t thread)
     {
         assert(_tnext[thread] != nullptr && _tnext[thread]->_count > 0);
@@ -179,46 +212,110 @@ public:
     }
     
     private:
-        
-        inline void insertToIndex(bucket_t* bucket, size_t id)
+
+        bucket_t* new_bucket()
         {
-            index_t* tmp = _index;
-            while(id >= C*C)
-            {
-                index_t* old = tmp;
-                tmp = old->_next;
-                if(tmp == nullptr)
-                {
-                    // extend index if needed
-                    index_t* nindex = new index_t;
-                    memset(&nindex->_index, 0, sizeof(bucket_t*)*C);
-                    nindex->_next = 0;
-                    if(!old->_next.compare_exchange_strong(tmp, nindex)) 
-                    {
-                        delete nindex;
-                        tmp = old;
-                        continue;
-                    }
-                    else
-                    {
-                        tmp = nindex;
-                    }
-                }
-                id -= C*C;
+            bucket_t* b = bucket_traits::allocate(_balloc, 1);
+            bucket_traits::construct(_balloc, b);
+            b->_nbucket = nullptr;
+            b->_offset = 0;
+            b->_count = 0;
+            b->_thread = 0;
+            memset(&b->_data, 0, sizeof(T)*C);
+            return b;
+        }
+
+        void delete_bucket(bucket_t* b)
+        {
+            bucket_traits::destroy(_balloc, b);
+            bucket_traits::deallocate(_balloc, b, 1);
+        }
+
+        leaf_t* new_leaf()
+        {
+            leaf_t* l = leaf_traits::allocate(_lalloc, 1);
+            leaf_traits::construct(_lalloc, l);
+            for (auto& b : l->_buckets)
+                b.store(nullptr, std::memory_order_relaxed);
+            return l;
+        }
+
+        void delete_leaf(leaf_t* l)
+        {
+            leaf_traits::destroy(_lalloc, l);
+            leaf_traits::deallocate(_lalloc, l, 1);
+        }
+
+        directory_t* new_directory(size_t size, directory_t* old)
+        {
+            directory_t* d = dir_traits::allocate(_dalloc, 1);
+            dir_traits::construct(_dalloc, d);
+            try {
+                d->_leaves = slot_traits::allocate(_salloc, size);
+            } catch (...) {
+                dir_traits::destroy(_dalloc, d);
+                dir_traits::deallocate(_dalloc, d, 1);
+                throw;
             }
-            tmp->_index[id/C] = bucket;
+            d->_size = size;
+            d->_retired = old;
+            for (size_t i = 0; i < size; ++i) {
+                slot_traits::construct(_salloc, d->_leaves + i,
+                                       i < (old ? old->_size : 0) ? old->_leaves[i].load() : nullptr);
+            }
+            return d;
         }
-        
-        inline bucket_t* indexToBucket(size_t id) const
+
+        void delete_directory(directory_t* d)
+        {
+            for (size_t i = 0; i < d->_size; ++i)
+                slot_traits::destroy(_salloc, d->_leaves + i);
+            slot_traits::deallocate(_salloc, d->_leaves, d->_size);
+            dir_traits::destroy(_dalloc, d);
+            dir_traits::deallocate(_dalloc, d, 1);
+        }
+
+        // the leaf covering bucket b, created (and the directory grown) on
+        // first use
+        leaf_t* leaf(size_t b)
         {
-            index_t* tmp = _index;
-            while(id >= C*C)
-            {
-                tmp = tmp->_next;
-                if(tmp == nullptr) return nullptr;
-                id -= C*C;
+            const size_t l = b / LEAF;
+            directory_t* dir = _directory.load(std::memory_order_acquire);
+            if (l < dir->_size) {
+                leaf_t* leaf = dir->_leaves[l].load(std::memory_order_acquire);
+                if (leaf != nullptr) return leaf;
+            }
+            std::lock_guard<std::mutex> lock(_grow);
+            dir = _directory.load(std::memory_order_relaxed);
+            if (l >= dir->_size) {
+                dir = new_directory(std::max(dir->_size * 2, l + 1), dir);
+                _directory.store(dir, std::memory_order_release);
+            }
+            leaf_t* leaf = dir->_leaves[l].load(std::memory_order_relaxed);
+            if (leaf == nullptr) {
+                leaf = new_leaf();
+                dir->_leaves[l].store(leaf, std::memory_order_release);
+                ++_leaves;
             }
-            return tmp->_index[id/C];
+            return leaf;
+        }
+
+        inline void insertToIndex(bucket_t* bucket, size_t id)
+        {
+            const size_t b = id / C;
+            leaf(b)->_buckets[b % LEAF].store(bucket, std::memory_order_release);
+        }
+
+        inline bucket_t* indexToBucket(size_t id) const
+        {
+            const size_t b = id / C;
+            const directory_t* dir = _directory.load(std::memory_order_acquire);
+            assert(b / LEAF < dir->_size);
+            const leaf_t* leaf = dir->_leaves[b / LEAF].load(std::memory_order_acquire);
+            assert(leaf != nullptr);
+            bucket_t* bucket = leaf->_buckets[b % LEAF].load(std::memory_order_acquire);
+            assert(bucket != nullptr);
+            return bucket;
         }
 } __attribute__ ((aligned (64)));
 
@@ -27,14 +27,29 @@
 
 #include <stdint.h>
 #include <assert.h>
+#include <atomic>
 #include <limits>
 #include <stack>
 #include <cstring>
+#include <exception>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "linked_bucket.h"
+#include "bucket_pool.h"
+#include "suffix_arena.h"
+#include "region_table.h"
+#include "first_scan.h"
+#include "prefetch.h"
+#include "bloom_filter.h"
+#include "epoch.h"
 
 
 
@@ -58,11 +73,89 @@ namespace ptrie {
     };
     typedef std::pair<bool, size_t> returntype_t;
 
+    // memory held by the structure of a trie, bytes and object counts per
+    // category. Unused pool and arena space is reported by bucket_stats()
+    // and suffix_stats() instead.
+    struct memory_usage_t {
+        size_t _fwdnodes = 0;
+        size_t _fwdnode_bytes = 0;      // including child maps kept outside the node
+        size_t _nodes = 0;
+        size_t _node_bytes = 0;         // node_t headers
+        size_t _first_bytes = 0;        // the first-arrays of the buckets
+        size_t _entry_bytes = 0;        // the entry-ids of the buckets
+        size_t _data_bytes = 0;         // inline key data and pointers to suffixes
+        size_t _slack_bytes = 0;        // bucket capacity not yet in use
+        size_t _suffixes = 0;
+        size_t _suffix_bytes = 0;       // suffixes stored on the heap
+        size_t _entry_blocks = 0;
+        size_t _entry_block_bytes = 0;  // linked_bucket_t blocks of stable sets and maps
+        size_t _index_blocks = 0;
+        size_t _index_bytes = 0;        // and their index
+        size_t _filter_bytes = 0;       // the filter of use_filter
+
+        size_t bucket_bytes() const {
+            return _first_bytes + _entry_bytes + _data_bytes + _slack_bytes;
+        }
+
+        size_t total() const {
+            return _fwdnode_bytes + _node_bytes + bucket_bytes() + _suffix_bytes +
+                   _entry_block_bytes + _index_bytes + _filter_bytes;
+        }
+
+        memory_usage_t& operator+=(const memory_usage_t& other) {
+            _fwdnodes += other._fwdnodes;
+            _fwdnode_bytes += other._fwdnode_bytes;
+            _nodes += other._nodes;
+            _node_bytes += other._node_bytes;
+            _first_bytes += other._first_bytes;
+            _entry_bytes += other._entry_bytes;
+            _data_bytes += other._data_bytes;
+            _slack_bytes += other._slack_bytes;
+            _suffixes += other._suffixes;
+            _suffix_bytes += other._suffix_bytes;
+            _entry_blocks += other._entry_blocks;
+            _entry_block_bytes += other._entry_block_bytes;
+            _index_blocks += other._index_blocks;
+            _index_bytes += other._index_bytes;
+            _filter_bytes += other._filter_bytes;
+            return *this;
+        }
+    };
+
     struct __base_t {
         uchar _path;
         uchar _type;
     };
 
+    // nodes of a trie with COMPRESSED references carry their own handle,
+    // see region_table_t, so a reference to them can be formed from a pointer.
+    template<bool COMPRESSED>
+    struct __node_base_t : public __base_t {
+        explicit __node_base_t(uint32_t = 0) {}
+    };
+
+    template<>
+    struct __node_base_t<true> : public __base_t {
+        uint32_t _self;
+        explicit __node_base_t(uint32_t self = 0) : _self(self) {}
+    };
+
+    // a 32-bit reference to a node of a trie with COMPRESSED references,
+    // behaves as a N* otherwise.
+    template<typename N>
+    class __ref_t {
+        uint32_t _handle;
+    public:
+        __ref_t() = default;
+        __ref_t(N* node) { *this = node; }
+        __ref_t& operator=(N* node) {
+            _handle = node == nullptr ? 0 : static_cast<const __node_base_t<true>*>(node)->_self;
+            return *this;
+        }
+        operator N*() const { return static_cast<N*>(region_table_t::resolve(_handle)); }
+        N* operator->() const { return *this; }
+    };
+
     template<typename KEY>
     struct byte_iterator {
         static constexpr typename std::enable_if<std::has_unique_object_representations<KEY>::value, uchar&>::type access(KEY* data, size_t id)
@@ -113,14 +206,14 @@ namespace ptrie {
             if(_node->_type == 255)
             {
                 auto* fwd = static_cast<const typename P::fwdnode_t*>(_node);
-                while(fwd->_children[_index] == fwd) 
+                while(_index != MAX+INC && fwd->child(_index) == fwd)
                     _index += INC;
                 if(_index == MAX+INC) // we have reached the end of this fwdnode
                 {
                     if(fwd->_parent == nullptr)
                         return false; // we have reached the end of structure
                     int i = MAX;
-                    while(fwd->_parent->_children[i] != fwd)
+                    while(fwd->_parent->child(i) != fwd)
                         i -= INC; // find next element in parent (or end of parent)
 
                     _node = fwd->_parent;
@@ -129,7 +222,7 @@ namespace ptrie {
                 }
                 else
                 {
-                    _node = fwd->_children[_index];
+                    _node = fwd->child(_index);
                     _index = 255-MAX;
                     if(_node->_type != 255)
                     {
@@ -149,7 +242,7 @@ namespace ptrie {
                 else if(MAX == 0 && _index >= 0)
                     return false;
                 int i = MAX;
-                while(node->_parent->_children[i] != node)
+                while(node->_parent->child(i) != node)
                     i -= INC; // find next element in parent (or end of parent)
                 _node = node->_parent;
                 _index = i+INC;
@@ -243,12 +336,12 @@ namespace ptrie {
                 (node, path, _index, offset, ps, size);
             dest.resize(size/byte_iterator<typename P::key_t>::element_size());
             __write_data<typename P::node_t, typename P::key_t, P::bdiv, P::bsize, P::heapbound>
-                (node, path, _index, offset, ps, size);
+                (dest.data(), node, path, _index, offset, ps, size);
         }                
     };
     
-#define PTRIETPL typename KEY, uint16_t HEAPBOUND, uint16_t SPLITBOUND, uint8_t BSIZE, size_t ALLOCSIZE, typename T, typename I, bool HAS_ENTRIES
-#define PTRIETLPA KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, T, I, HAS_ENTRIES
+#define PTRIETPL typename KEY, uint16_t HEAPBOUND, uint16_t SPLITBOUND, uint8_t BSIZE, size_t ALLOCSIZE, typename T, typename I, bool HAS_ENTRIES, typename ALLOC, bool COMPRESSED, uint16_t FIXED_LENGTH
+#define PTRIETLPA KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, T, I, HAS_ENTRIES, ALLOC, COMPRESSED, FIXED_LENGTH
     
     template<
     typename KEY = uchar,
@@ -258,18 +351,28 @@ namespace ptrie {
     size_t ALLOCSIZE = (1024 * 64),
     typename T = void,
     typename I = size_t,
-    bool HAS_ENTRIES = false
+    bool HAS_ENTRIES = false,
+    typename ALLOC = std::allocator<uchar>,
+    bool COMPRESSED = false,
+    uint16_t FIXED_LENGTH = 0
     >
     class __ptrie {
     public:
         struct fwdnode_t;
         struct node_t;
+        struct hint_t;
     protected:
         static_assert(BSIZE == 2 || BSIZE == 4 || BSIZE == 8);
 
         static constexpr auto WIDTH = 1 << BSIZE;
         static constexpr auto BDIV = 8/BSIZE;
         static constexpr auto FILTER = 0xFF >> (8-BSIZE);
+        // fwdnodes change representation with their fan-out for BSIZE == 8
+        static constexpr bool ADAPTIVE = WIDTH == 256;
+        static constexpr size_t SMALLRUNS = 6;
+        static constexpr size_t MEDIUMSLOTS = 48;
+        // levels a fwdnode can cover beyond its own, see fwdnode_t::_prefix
+        static constexpr size_t MAXSKIP = 13;
 
         static_assert(HEAPBOUND * SPLITBOUND < std::numeric_limits<uint16_t>::max(),
                 "HEAPBOUND * SPLITBOUND should be less than 2^16");
@@ -279,11 +382,30 @@ namespace ptrie {
 
         static_assert(HEAPBOUND > sizeof(size_t),
                 "HEAPBOUND MUST BE LARGER THAN sizeof(size_t)");
+
+        // With a FIXED_LENGTH every key has that many elements, so the
+        // fwdnodes of the size-bytes are a single chain built up front and
+        // the walks start below it, at _top on level TOPLEVEL.
+        static constexpr uint TOPLEVEL = FIXED_LENGTH == 0 ? 0 : 2 * BDIV;
+        static constexpr size_t FIXEDSIZE = FIXED_LENGTH * byte_iterator<KEY>::element_size();
+        static_assert(FIXEDSIZE < 65536, "FIXED_LENGTH keys must be shorter than 2^16 bytes");
+
+        // byte is one of the two size-bytes, which is never the case below _top
+        static constexpr bool size_byte(size_t byte) {
+            return FIXED_LENGTH == 0 && byte < 2;
+        }
                 
     protected:
 
-        typedef __ptrie_el_t<T, node_t*> entry_t;
-        using entrylist_t = linked_bucket_t<entry_t, ALLOCSIZE>;
+        using node_base_t = __node_base_t<COMPRESSED>;
+        template<typename N>
+        using ref_t = std::conditional_t<COMPRESSED, __ref_t<N>, N*>;
+
+        typedef __ptrie_el_t<T, ref_t<node_t>> entry_t;
+        using alloc_traits = std::allocator_traits<ALLOC>;
+        template<typename U>
+        using rebind_t = typename alloc_traits::template rebind_alloc<U>;
+        using entrylist_t = linked_bucket_t<entry_t, ALLOCSIZE, rebind_t<entry_t>>;
         struct bucket_t {
 
             bucket_t() {
@@ -305,40 +427,117 @@ namespace ptrie {
             }
 
             constexpr uchar* data(uint16_t count) {
-                return ((uchar*) (&_data)) + overhead(count);
+                return reinterpret_cast<uchar*>(this) + overhead(count);
             }
 
             constexpr uint16_t& first(uint16_t = 0, uint16_t index = 0) {
-                return ((uint16_t*) &_data)[index];
+                return reinterpret_cast<uint16_t*>(this)[index];
+            }
+
+            // grow by half of the current capacity, buckets are short-lived
+            // once they reach SPLITBOUND so there is no need to go further.
+            static constexpr size_t grow(size_t capacity, size_t needed) {
+                return (std::max(needed, capacity + capacity / 2) + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
             }
 
         };
 
         // nodes in the tree
     public:
-        struct node_t : public __base_t {
+        struct node_t : public node_base_t {
             uint16_t _count = 0; // bucket-counts
             uint32_t _totsize = 0; 
-            fwdnode_t* _parent = nullptr;
+            uint32_t _capacity = 0; // bytes allocated for _data, >= _totsize + overhead(_count)
+            ref_t<fwdnode_t> _parent = nullptr;
             bucket_t* _data = nullptr; // back-pointers to data-array up to date
-            void cleanup(size_t depth, uint16_t remainder);
+            explicit node_t(uint32_t self = 0) : node_base_t(self) {}
             constexpr uchar* data() const { return _data->data(_count); }
             constexpr uint16_t& first(size_t index) const { return _data->first(_count, index); }
             constexpr uint16_t* first() const { return &_data->first(_count, 0); }
             constexpr I* entries() const { return _data->entries(_count); }
-            constexpr void clone(const node_t& other, entrylist_t* entries, const entrylist_t* other_entries, uint16_t esize, size_t depth);
         };
 
-        struct fwdnode_t : public __base_t {
-            __base_t* _children[WIDTH];
-            fwdnode_t* _parent;
-            constexpr void clone(const fwdnode_t& other, entrylist_t* entries, const entrylist_t* other_entries, uint16_t esize, size_t depth);
+        struct medium_t {
+            uchar _index[WIDTH];
+            ref_t<__base_t> _slots[MEDIUMSLOTS];
+        };
+
+        // A fwdnode maps each of its WIDTH chunk-values to a child, a child
+        // equal to the fwdnode itself marks an empty slot. Buckets cover
+        // ranges of values, so the map is a few runs in most deep fwdnodes.
+        // When ADAPTIVE it is kept in the smallest form that fits: up to
+        // SMALLRUNS runs inline, an index into MEDIUMSLOTS distinct children,
+        // or the full table. Changes go through __ptrie::set_children.
+        //
+        // With BSIZE 8 a fwdnode below the size-bytes can cover a run of
+        // levels where all keys share the same byte: the _skip bytes of
+        // _prefix come before the byte selecting the child. Such runs are
+        // made by split_fwd, cut by split_prefix and given back by readd_byte.
+        struct fwdnode_t : public node_base_t {
+            enum : uint8_t { SMALL, MEDIUM, FULL };
+            uint8_t _kind = ADAPTIVE ? SMALL : FULL;
+            uint8_t _runs = 1;
+            uchar _starts[SMALLRUNS] = {};
+            uint8_t _skip = 0;
+            uchar _prefix[MAXSKIP] = {};
+            ref_t<fwdnode_t> _parent = nullptr;
+            union {
+                ref_t<__base_t> _run[ADAPTIVE ? SMALLRUNS : WIDTH];
+                medium_t* _medium;
+                ref_t<__base_t>* _full;
+            };
+
+            explicit fwdnode_t(uint32_t self = 0) : node_base_t(self) {
+                std::fill(std::begin(_run), std::end(_run), this);
+            }
+            fwdnode_t(const fwdnode_t&) = delete;
+            fwdnode_t& operator=(const fwdnode_t&) = delete;
+
+            __base_t* child(size_t i) const {
+                assert(i < WIDTH);
+                if constexpr (!ADAPTIVE) return load(_run[i]);
+                else if (_kind == SMALL) {
+                    size_t r = _runs - 1;
+                    while (_starts[r] > i) --r;
+                    return _run[r];
+                }
+                else if (_kind == MEDIUM) return _medium->_slots[_medium->_index[i]];
+                else return load(_full[i]);
+            }
+
+            // the slots of a full map are swapped one at a time while
+            // readers walk the trie, see __ptrie::shared_reads
+            static __base_t* load(const ref_t<__base_t>& slot) {
+                if constexpr (COMPRESSED) return slot;
+                else return std::atomic_ref(const_cast<ref_t<__base_t>&>(slot)).load(std::memory_order_acquire);
+            }
+            static void store(ref_t<__base_t>& slot, __base_t* child) {
+                if constexpr (COMPRESSED) slot = child;
+                else std::atomic_ref(slot).store(child, std::memory_order_release);
+            }
+
+            // bytes of the child map kept outside the node
+            size_t map_bytes() const {
+                if constexpr (ADAPTIVE) {
+                    if (_kind == MEDIUM) return sizeof(medium_t);
+                    if (_kind == FULL) return WIDTH * sizeof(ref_t<__base_t>);
+                }
+                return 0;
+            }
+
+            // the table of a FULL fwdnode
+            ref_t<__base_t>* table() {
+                assert(_kind == FULL);
+                if constexpr (ADAPTIVE) return _full;
+                else return _run;
+            }
+
             size_t dist_to(fwdnode_t* other) const
             {
                 assert(this);
                 if(this == other) return 0;
                 assert(_parent != nullptr);
-                return 1 + _parent->dist_to(other);
+                return 1 + _skip + _parent->dist_to(other);
             }
             
             constexpr uchar get_byte() const {
@@ -347,23 +546,182 @@ namespace ptrie {
             
             constexpr uchar _get_byte(size_t i) const
             {
-                if(i == 1) return _path;
-                return _path | (_parent->_get_byte(i-1) << BSIZE);
+                if(i == 1) return this->_path;
+                return this->_path | (_parent->_get_byte(i-1) << BSIZE);
             }
         };
     protected:
-        std::shared_ptr<entrylist_t> _entries = nullptr;
-
-        fwdnode_t _root;
+        [[no_unique_address]] ALLOC _alloc;
+        bucket_pool_t<ALLOC, COMPRESSED> _pool{_alloc};
+        suffix_arena_t<ALLOC> _suffixes{_alloc};
 
+        std::shared_ptr<entrylist_t> _entries = nullptr;
+        // the threads the entries hand out ids to, each from blocks of its own
+        size_t _threads = 1;
+        // ids of erased elements, handed out again by insert when _recycle.
+        // An id goes back to the thread whose block it is from.
+        using freelist_t = std::vector<I, rebind_t<I>>;
+        std::vector<freelist_t, rebind_t<freelist_t>> _free_ids{rebind_t<freelist_t>(_alloc)};
+        size_t _dead = 0;
+        bool _recycle = false;
+        // bumped when fwdnodes are freed or change the levels they cover,
+        // which invalidates the hints taken before
+        size_t _version = 0;
+        // answers for most absent keys when enabled by use_filter
+        bloom_filter_t<ALLOC> _filter{_alloc};
+        static constexpr size_t MINFILTER = 1024 * 4;
+
+        // memory unlinked by the writer while readers may still be on it,
+        // handed back by reclaim once they are gone, see shared_reads
+        struct retired_t {
+            enum : uint8_t { BUCKET, NODE, ARENA } _kind;
+            void* _ptr;
+            size_t _bytes;
+        };
+        using epochs_t = epoch_t<retired_t, rebind_t<retired_t>>;
+        epochs_t _epochs{rebind_t<retired_t>(_alloc)};
+        bool _shared = false;
+
+        // with COMPRESSED the root is a region of its own
+        alignas(COMPRESSED ? region_table_t::UNIT : alignof(fwdnode_t)) fwdnode_t _root;
+        fwdnode_t* _top = &_root;
+
+        // all structural memory goes through _alloc. Buckets come from the
+        // size-class pool, the requested size is rounded up to the class so
+        // the slack can be used for growth. With COMPRESSED the nodes are
+        // served by the pool as well, so they can be named by handles.
+        bucket_t* new_bucket(uint32_t& bytes) {
+            bytes = _pool.round(bytes);
+            return reinterpret_cast<bucket_t*>(_pool.allocate(bytes));
+        }
+        void delete_bucket(bucket_t* bucket, size_t bytes) {
+            _pool.deallocate(bucket, bytes);
+        }
+        // suffixes of HEAPBOUND bytes or more live in the arena, the dead
+        // ones are reclaimed by compact_suffixes.
+        uchar* new_suffix(size_t bytes) {
+            return _suffixes.allocate(bytes);
+        }
+        void delete_suffix(uchar* suffix, size_t bytes) {
+            _suffixes.deallocate(suffix, bytes);
+        }
+        template<typename N>
+        N* new_node() {
+            if constexpr (COMPRESSED) {
+                void* n = _pool.allocate(sizeof(N));
+                return new (n) N(_pool.handle(n));
+            }
+            rebind_t<N> a(_alloc);
+            N* n = std::allocator_traits<rebind_t<N>>::allocate(a, 1);
+            std::allocator_traits<rebind_t<N>>::construct(a, n);
+            return n;
+        }
+        template<typename N>
+        void delete_node(N* n) {
+            if constexpr (std::is_same_v<N, fwdnode_t>) free_children(n);
+            if constexpr (COMPRESSED) {
+                n->~N();
+                _pool.deallocate(n, sizeof(N));
+                return;
+            }
+            rebind_t<N> a(_alloc);
+            std::allocator_traits<rebind_t<N>>::destroy(a, n);
+            std::allocator_traits<rebind_t<N>>::deallocate(a, n, 1);
+        }
+        void init_root();
+        void init_top();
+        // the fwdnodes from _top down the first levels chunks of a key,
+        // made where missing
+        fwdnode_t* make_path(const KEY* data, size_t size, uint levels);
+        // with shared_reads a node is replaced rather than changed once it
+        // is reachable, the slots it takes in its parent are these
+        static size_t last_slot(const node_t* node) {
+            return node->_path + (WIDTH >> node->_type) - 1;
+        }
+        void retire(node_t* node);
+        void reclaim(const retired_t& record);
+        void collect() { _epochs.collect([this](const retired_t& r) { reclaim(r); }); }
+        void drain() { _epochs.drain([this](const retired_t& r) { reclaim(r); }); }
+        // gives fwd, or every fwdnode, the map kept under shared_reads
+        void widen(fwdnode_t* fwd);
+        void widen();
+        I new_id(size_t thread);
+        void release_id(I id);
+        // whether new_id(thread) hands out the id of an erased element
+        bool reuses_id(size_t thread) const {
+            return thread < _free_ids.size() && !_free_ids[thread].empty();
+        }
+        void cleanup(node_t* node);
+        // maintenance of the child-map of fwdnodes, ranges are inclusive
+        void load_children(const fwdnode_t* fwd, __base_t** table) const;
+        void store_children(fwdnode_t* fwd, __base_t* const* table);
+        void set_children(fwdnode_t* fwd, size_t first, size_t last, __base_t* child);
+        void replace_children(fwdnode_t* fwd, const __base_t* from, __base_t* to);
+        void free_children(fwdnode_t* fwd);
+        template<typename F, typename G>
+        void for_each_node(F&& f, G&& g) const;
+        template<typename F>
+        void for_each_node(F&& f) const { for_each_node(f, [](fwdnode_t*){}); }
+        template<typename F>
+        void for_each_suffix(node_t* node, size_t depth, uint16_t encsize, F&& f) const;
+        void compact_suffixes();
+        // copies a subtree of other in below node. Elements of its own
+        // entries keep their ids. Elements from other entries get new ids
+        // here, or with a base their id in other plus base, which the caller
+        // has handed out already.
+        static constexpr size_t NEWIDS = std::numeric_limits<size_t>::max();
+        void clone(fwdnode_t* node, const fwdnode_t& other, const entrylist_t* other_entries, uint16_t esize, size_t depth, size_t base = NEWIDS);
+        void clone(node_t* node, const node_t& other, const entrylist_t* other_entries, uint16_t esize, size_t depth, size_t base = NEWIDS);
+        void clear();
+
+        // the chunk of the key selecting the child of a fwdnode at p_byte
+        static uchar chunk(const KEY* data, size_t length, uint p_byte);
         __base_t* fast_forward(const KEY* data, size_t length, fwdnode_t** tree_pos, uint& byte) const;
         bool bucket_search(const KEY* data, size_t length, node_t* node, uint& b_index, uint byte) const;
 
         bool best_match(const KEY* data, size_t length, fwdnode_t** tree_pos, __base_t** node, uint& byte, uint& b_index) const;
 
+        // A lookup run as a series of steps, each ending in a prefetch of the
+        // memory the next step reads, so the steps of a batch of lookups can
+        // be interleaved to overlap their cache misses.
+        struct cursor_t {
+            enum : uint8_t { FWD, CHILD, BUCKET, SEARCH, DONE };
+            const KEY* _data;
+            size_t _length;
+            fwdnode_t* _fwd;
+            __base_t* _base = nullptr;
+            uint _p_byte = 0;
+            uint _b_index = 0;
+            uchar _chunk = 0;
+            uint8_t _step = FWD;
+            bool _found = false;
+        };
+        static constexpr size_t BATCHWIDTH = 16;
+        void advance(cursor_t& cursor) const;
+        void search_batch(std::span<const std::pair<const KEY*, size_t>> keys, std::span<returntype_t> results) const;
+
+        // the fwdnode and level a hinted operation starts from, and the
+        // recording of the path it found, see hint_t
+        fwdnode_t* resume(hint_t& hint, const KEY* data, size_t length, uint& p_byte) const;
+        void remember(hint_t& hint, fwdnode_t* fwd, const __base_t* base, uint p_byte, const KEY* data, size_t length) const;
+        // with element, the entry of the key is stored there. The value of
+        // an inserted key is then left to the caller, an id that is reused
+        // still holds the value of the erased key.
+        returntype_t insert(hint_t* hint, const KEY* data, size_t length, entry_t** element = nullptr, size_t thread = 0);
+
+        static uint64_t key_hash(const KEY* data, size_t length);
+        bool filtered_out(const KEY* data, size_t length) const {
+            return _filter.enabled() && !_filter.may_contain(key_hash(data, length));
+        }
+        void rebuild_filter();
+
         void split_node(node_t* node, fwdnode_t* jumppar, node_t* locked, int32_t bsize, size_t byte);
 
         void split_fwd(node_t* node, fwdnode_t* jumppar, node_t* locked, int32_t bsize, size_t byte);
+        bool only_child(const fwdnode_t* fwd, const __base_t* child) const;
+        void split_prefix(fwdnode_t* fwd, const KEY* data, size_t length, uint p_byte);
+        // puts a fwdnode for the first j levels of the run of fwd on top of it
+        void cut_prefix(fwdnode_t* fwd, size_t j);
 
         static constexpr uint16_t bytes(const uint16_t d) {
             return __memsize(d, HEAPBOUND);
@@ -398,6 +756,9 @@ namespace ptrie {
         void move(__ptrie& other);                
     public:
         __ptrie();
+        explicit __ptrie(const ALLOC& alloc);
+        // with ids handed out to threads threads, see insert(data, length, thread)
+        explicit __ptrie(size_t threads, const ALLOC& alloc = ALLOC());
         ~__ptrie();
         
         using key_t = KEY;
@@ -405,27 +766,113 @@ namespace ptrie {
         static constexpr auto bdiv = BDIV;
         static constexpr auto heapbound = HEAPBOUND;
         
-        returntype_t insert(const KEY* data, size_t length);
+        // where the last key passed with the hint went: the fwdnodes on its
+        // path with the level each selects a child at, and the chunks of the
+        // key above the deepest of them. Its content is only used by the trie.
+        struct hint_t {
+            const __ptrie* _trie = nullptr;
+            size_t _version = 0;
+            std::vector<std::pair<fwdnode_t*, uint>> _path;
+            std::vector<uchar> _chunks;
+        };
+
+        returntype_t insert(const KEY* data, size_t length)      { return insert(nullptr, data, length); }
         returntype_t insert(const KEY data)                      { return insert(&data, 1); }
         returntype_t insert(std::pair<const KEY*, size_t> data)  { return insert(data.first, data.second); }
         returntype_t insert(const std::vector<KEY>& data)        { return insert(data.data(), data.size()); }
+        // the id of an added key comes from the blocks of thread, one of the
+        // threads the trie was made for, or is one erased from them. Threads
+        // taking turns on one trie, each passing its own index, then never
+        // write to the same block of entries, nor to the values of a map
+        // next to each other.
+        returntype_t insert(const KEY* data, size_t length, size_t thread) {
+            return insert(nullptr, data, length, nullptr, thread);
+        }
+        returntype_t insert(const std::vector<KEY>& data, size_t thread) { return insert(data.data(), data.size(), thread); }
 
         returntype_t exists(const KEY* data, size_t length) const;
         returntype_t exists(const KEY data) const                      { return exists(&data, 1); }
         returntype_t exists(std::pair<const KEY*, size_t> data) const  { return exists(data.first, data.second); }
         returntype_t exists(const std::vector<KEY>& data) const        { return exists(data.data(), data.size()); }
+
+        // the same as calling exists (or insert) for each key in turn, storing
+        // the result in results. Up to BATCHWIDTH lookups are run interleaved,
+        // prefetching each level of the trie for all of them before reading
+        // it, which hides the cache misses of cold lookups.
+        void exists_batch(std::span<const std::pair<const KEY*, size_t>> keys, std::span<returntype_t> results) const;
+        void insert_batch(std::span<const std::pair<const KEY*, size_t>> keys, std::span<returntype_t> results);
+
+        // fills an empty trie with keys using threads threads, giving the
+        // trie insert would. The keys are grouped by the fwdnodes of their
+        // size and first byte, the groups are built in tries of their own
+        // by the threads and copied in one after the other by the caller.
+        // The ids follow the order of the groups, and the order of the keys
+        // within them, whatever the number of threads. As with insert_batch,
+        // results (when not empty) gets whether each key was added, false
+        // for repeats, and its id. A trie that is not empty
+        // is filled by insert instead. An exception thrown while building is
+        // passed on once the threads are done, the trie then holds a part
+        // of the keys.
+        void build(std::span<const std::pair<const KEY*, size_t>> keys, std::span<returntype_t> results,
+                   size_t threads = std::thread::hardware_concurrency());
+
+        // insert and exists starting from the deepest fwdnode on the path of
+        // the last key passed with the same hint that the key shares, in the
+        // spirit of std::set::insert(hint, value). Keys differing from the
+        // last one only in a suffix skip the walk from the root. A hint can
+        // be used with any key, after erase, clear, compact or a move of the
+        // trie it starts over from the root.
+        returntype_t insert(hint_t& hint, const KEY* data, size_t length) { return insert(&hint, data, length); }
+        returntype_t exists(hint_t& hint, const KEY* data, size_t length) const;
         
         bool         erase (const KEY* data, size_t length);
         bool         erase (const KEY data)                      { return erase(&data, 1); }
         bool         erase (std::pair<const KEY*, size_t> data)  { return erase(data.first, data.second); }
         bool         erase (const std::vector<KEY>& data)        { return erase(data.data(), data.size()); }
+
+        // occupancy of the bucket pool, see pool_stats_t::fragmentation. With
+        // COMPRESSED references this includes the nodes.
+        const pool_stats_t& bucket_stats() const { return _pool.stats(); }
+        // occupancy of the suffix arena, _free counts the dead suffixes
+        const pool_stats_t& suffix_stats() const { return _suffixes.stats(); }
+        // walks the trie, the cost is linear in its size
+        memory_usage_t memory_usage() const;
+        // rebuilds the trie with its nodes, buckets and suffixes laid out in
+        // depth-first order, ids of stored elements are kept.
+        void compact();
+        // let insert reuse the ids of erased elements, off by default as
+        // an id then no longer identifies a single key over time.
+        void recycle_ids(bool enable = true) {
+            _recycle = enable;
+            if (!enable) _free_ids.clear();
+        }
+        // keep a Bloom filter of the keys in front of the trie, so exists
+        // fails for most absent keys without walking it. Insert adds to the
+        // filter and rebuilds it from the trie when it fills up, erased keys
+        // stay in it until then or until compact. Not kept under shared_reads.
+        void use_filter(bool enable = true) {
+            if (!enable || _shared) _filter.reset(0);
+            else if (!_filter.enabled()) rebuild_filter();
+        }
+        // let any number of threads call exists, exists_batch and the
+        // hinted exists while a single thread inserts and erases. A node
+        // and its bucket are then never changed once they can be reached,
+        // the writer fills a copy and swaps it into the slots of the
+        // parent, which are kept as a full table so each slot is a single
+        // store. What is replaced is handed back through epoch_t once no
+        // reader can be on it. Switching it on drops the filter and cuts
+        // the fwdnodes covering several levels into one per level. It and
+        // unpack, iteration, compact, clear and copies still need the
+        // readers to be gone.
+        void shared_reads(bool enable = true);
         
         
-        __ptrie(__ptrie&& other) { move(other); }
+        __ptrie(__ptrie&& other) : _alloc(other._alloc) { init_root(); move(other); }
         
-        __ptrie& operator=(__ptrie&& other) { move(other); return *this; }
+        __ptrie& operator=(__ptrie&& other) { clear(); move(other); return *this; }
         
-        __ptrie(const __ptrie& other) : __ptrie()
+        __ptrie(const __ptrie& other)
+        : __ptrie(alloc_traits::select_on_container_copy_construction(other._alloc))
         {
             *this = other;
         }
@@ -438,19 +885,32 @@ namespace ptrie {
     uint16_t HEAPBOUND = 17,
     uint16_t SPLITBOUND = 129,
     uint8_t BSIZE = 8,
-    size_t ALLOCSIZE = (1024 * 64)
+    size_t ALLOCSIZE = (1024 * 64),
+    typename ALLOC = std::allocator<uchar>,
+    bool COMPRESSED = false,
+    uint16_t FIXED_LENGTH = 0
     >
-    class set : private __ptrie<KEY,HEAPBOUND,SPLITBOUND,BSIZE,ALLOCSIZE,void,size_t,false> {
-        using pt = __ptrie<KEY,HEAPBOUND,SPLITBOUND,BSIZE,ALLOCSIZE,void,size_t,false>;
+    class set : private __ptrie<KEY,HEAPBOUND,SPLITBOUND,BSIZE,ALLOCSIZE,void,size_t,false,ALLOC,COMPRESSED,FIXED_LENGTH> {
+        using pt = __ptrie<KEY,HEAPBOUND,SPLITBOUND,BSIZE,ALLOCSIZE,void,size_t,false,ALLOC,COMPRESSED,FIXED_LENGTH>;
     public:
         using typename pt::__ptrie;
         using pt::insert;
         using pt::exists;
         using pt::erase;
+        using pt::exists_batch;
+        using pt::insert_batch;
+        using pt::build;
+        using pt::bucket_stats;
+        using pt::suffix_stats;
+        using pt::memory_usage;
+        using pt::compact;
+        using pt::use_filter;
+        using pt::shared_reads;
         
         using node_t = typename pt::node_t;
         using fwdnode_t = typename pt::fwdnode_t;
         using typename pt::key_t; 
+        using typename pt::hint_t;
 
         static constexpr auto bsize = pt::bsize;
         static constexpr auto bdiv = pt::bdiv;
@@ -468,6 +928,17 @@ namespace ptrie {
     
     template<PTRIETPL>
     __ptrie<PTRIETLPA>::~__ptrie() {
+        clear();
+        // kept full by clear with shared reads
+        free_children(&_root);
+        _entries = nullptr;
+        if constexpr (COMPRESSED)
+            region_table_t::remove(_root._self >> region_table_t::UNITBITS);
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::clear() {
+        drain();
         std::stack<std::tuple<fwdnode_t*,size_t, uint16_t>> stack;
         stack.emplace(&_root,0,0);
         while(!stack.empty())
@@ -477,10 +948,10 @@ namespace ptrie {
             for(size_t i = 0; i < WIDTH; ++i)
             {
                 fwdnode_t* parent = std::get<0>(next);
-                __base_t* child = parent->_children[i];
+                __base_t* child = parent->child(i);
                 if(child != parent && child != nullptr)
                 {
-                    if(i > 0 && child == parent->_children[i-1]) continue;
+                    if(i > 0 && child == parent->child(i-1)) continue;
                     if(child->_type == 255)
                     {
                         auto f = std::get<2>(next);
@@ -495,19 +966,256 @@ namespace ptrie {
                     else
                     {
                         node_t* node = (node_t*) child;
-                        node->cleanup(std::get<1>(next), std::get<2>(next));
-                        delete node;
+                        cleanup(node);
+                        delete_node(node);
                     }
                 }
             }
             if(&_root != std::get<0>(next))
-                delete std::get<0>(next);
+                delete_node(std::get<0>(next));
+        }
+        set_children(&_root, 0, WIDTH - 1, &_root);
+        _top = &_root;
+        ++_version;
+        _filter.clear();
+        _pool.release();
+        _suffixes.release();
+        _free_ids.clear();
+        _dead = 0;
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::load_children(const fwdnode_t* fwd, __base_t** table) const {
+        if (fwd->_kind == fwdnode_t::SMALL) {
+            for (size_t r = 0; r < fwd->_runs; ++r) {
+                const size_t end = r + 1 < fwd->_runs ? fwd->_starts[r + 1] : WIDTH;
+                std::fill(table + fwd->_starts[r], table + end, fwd->_run[r]);
+            }
+        } else if (fwd->_kind == fwdnode_t::MEDIUM) {
+            for (size_t i = 0; i < WIDTH; ++i)
+                table[i] = fwd->_medium->_slots[fwd->_medium->_index[i]];
+        } else {
+            auto* full = const_cast<fwdnode_t*>(fwd)->table();
+            std::copy(full, full + WIDTH, table);
+        }
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::store_children(fwdnode_t* fwd, __base_t* const* table) {
+        if constexpr (!ADAPTIVE) {
+            std::copy(table, table + WIDTH, fwd->_run);
+        } else {
+            size_t runs = 1;
+            for (size_t i = 1; i < WIDTH; ++i)
+                runs += table[i] != table[i - 1];
+            if (runs <= SMALLRUNS && !_shared) {
+                free_children(fwd);
+                fwd->_runs = 0;
+                for (size_t i = 0; i < WIDTH; ++i) {
+                    if (i > 0 && table[i] == table[i - 1]) continue;
+                    fwd->_starts[fwd->_runs] = i;
+                    fwd->_run[fwd->_runs] = table[i];
+                    ++fwd->_runs;
+                }
+                return;
+            }
+
+            medium_t medium;
+            size_t used = 0;
+            for (size_t i = 0; i < WIDTH && used <= MEDIUMSLOTS; ++i) {
+                if (i > 0 && table[i] == table[i - 1]) {
+                    medium._index[i] = medium._index[i - 1];
+                    continue;
+                }
+                size_t s = 0;
+                while (s < used && medium._slots[s] != table[i]) ++s;
+                if (s == used) {
+                    if (used == MEDIUMSLOTS) {
+                        ++used;
+                        break;
+                    }
+                    medium._slots[used++] = table[i];
+                }
+                medium._index[i] = s;
+            }
+
+            if (used <= MEDIUMSLOTS && !_shared) {
+                if (fwd->_kind != fwdnode_t::MEDIUM) {
+                    free_children(fwd);
+                    rebind_t<medium_t> a(_alloc);
+                    fwd->_medium = std::allocator_traits<rebind_t<medium_t>>::allocate(a, 1);
+                    fwd->_kind = fwdnode_t::MEDIUM;
+                }
+                *fwd->_medium = medium;
+            } else {
+                if (fwd->_kind != fwdnode_t::FULL) {
+                    free_children(fwd);
+                    rebind_t<ref_t<__base_t>> a(_alloc);
+                    fwd->_full = std::allocator_traits<rebind_t<ref_t<__base_t>>>::allocate(a, WIDTH);
+                    fwd->_kind = fwdnode_t::FULL;
+                }
+                std::copy(table, table + WIDTH, fwd->_full);
+            }
         }
-        _entries = nullptr;
     }
 
     template<PTRIETPL>
-    void __ptrie<PTRIETLPA>::node_t::cleanup(size_t depth, uint16_t encsize) {
+    void __ptrie<PTRIETLPA>::set_children(fwdnode_t* fwd, size_t first, size_t last, __base_t* child) {
+        assert(first <= last && last < WIDTH);
+        __base_t* table[WIDTH];
+        if (fwd->_kind == fwdnode_t::FULL) {
+            if (_shared) {
+                for (size_t i = first; i <= last; ++i)
+                    fwdnode_t::store(fwd->table()[i], child);
+                return;
+            }
+            std::fill(fwd->table() + first, fwd->table() + last + 1, child);
+            // a full map only shrinks when slots are emptied
+            if (!ADAPTIVE || child != fwd) return;
+            load_children(fwd, table);
+        } else {
+            load_children(fwd, table);
+            std::fill(table + first, table + last + 1, child);
+        }
+        store_children(fwd, table);
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::replace_children(fwdnode_t* fwd, const __base_t* from, __base_t* to) {
+        __base_t* table[WIDTH];
+        load_children(fwd, table);
+        std::replace(table, table + WIDTH, const_cast<__base_t*>(from), to);
+        store_children(fwd, table);
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::free_children(fwdnode_t* fwd) {
+        if constexpr (ADAPTIVE) {
+            if (fwd->_kind == fwdnode_t::MEDIUM) {
+                rebind_t<medium_t> a(_alloc);
+                std::allocator_traits<rebind_t<medium_t>>::deallocate(a, fwd->_medium, 1);
+            } else if (fwd->_kind == fwdnode_t::FULL) {
+                rebind_t<ref_t<__base_t>> a(_alloc);
+                std::allocator_traits<rebind_t<ref_t<__base_t>>>::deallocate(a, fwd->_full, WIDTH);
+            }
+            fwd->_kind = fwdnode_t::SMALL;
+            fwd->_runs = 1;
+            fwd->_starts[0] = 0;
+            fwd->_run[0] = fwd;
+        }
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::widen(fwdnode_t* fwd) {
+        __base_t* table[WIDTH];
+        load_children(fwd, table);
+        store_children(fwd, table);
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::widen() {
+        widen(&_root);
+        for_each_node([](node_t*, size_t, uint16_t) {}, [this](fwdnode_t* fwd) { widen(fwd); });
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::retire(node_t* node) {
+        if (node->_data != nullptr)
+            _epochs.retire({retired_t::BUCKET, node->_data, node->_capacity});
+        _epochs.retire({retired_t::NODE, node, 0});
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::reclaim(const retired_t& record) {
+        switch (record._kind) {
+        case retired_t::BUCKET:
+            delete_bucket(static_cast<bucket_t*>(record._ptr), record._bytes);
+            break;
+        case retired_t::NODE:
+            delete_node(static_cast<node_t*>(record._ptr));
+            break;
+        case retired_t::ARENA:
+            _suffixes.free_chunks(record._ptr);
+            break;
+        }
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::shared_reads(bool enable) {
+        static_assert(!COMPRESSED, "shared_reads needs plain pointers in the fwdnodes");
+        if (enable == _shared) return;
+        if (!enable) drain();
+        _epochs.enable(enable);
+        _shared = enable;
+        if (enable) {
+            // the filter is changed by every insert
+            _filter.reset(0);
+            // a fwdnode covering several levels would be changed in place
+            // when a key leaves its run, so the runs are cut into a fwdnode
+            // per level, and the writer makes no new ones
+            std::vector<fwdnode_t*> runs;
+            for_each_node([](node_t*, size_t, uint16_t) {}, [&runs](fwdnode_t* fwd) {
+                if (fwd->_skip > 0) runs.push_back(fwd);
+            });
+            for (auto* fwd : runs)
+                while (fwd->_skip > 0)
+                    cut_prefix(fwd, 0);
+            if (!runs.empty()) ++_version;
+            widen();
+        }
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::cleanup(node_t* node) {
+        // the suffixes go with the arena
+        delete_bucket(node->_data, node->_capacity);
+        node->_data = nullptr;
+        node->_capacity = 0;
+        node->_count = 0;
+    }
+
+    template<PTRIETPL>
+    template<typename F, typename G>
+    void __ptrie<PTRIETLPA>::for_each_node(F&& f, G&& g) const {
+        // calls f(node, depth, encsize) for every bucket-node, the encoded
+        // size is only known for the part stored in the fwdnodes above.
+        // g(fwd) is called for every fwdnode below the root.
+        std::stack<std::tuple<fwdnode_t*,size_t, uint16_t>> stack;
+        stack.emplace(const_cast<fwdnode_t*>(&_root),0,0);
+        while(!stack.empty())
+        {
+            auto next = stack.top();
+            stack.pop();
+            fwdnode_t* parent = std::get<0>(next);
+            for(size_t i = 0; i < WIDTH; ++i)
+            {
+                __base_t* child = parent->child(i);
+                if(child == parent || child == nullptr) continue;
+                if(i > 0 && child == parent->child(i-1)) continue;
+                if(child->_type == 255)
+                {
+                    auto f = std::get<2>(next);
+                    if(std::get<1>(next) / BDIV < 2)
+                    {
+                        // we add bits from the most significant to the least
+                        f |= ((child->_path & FILTER) << ((16-BSIZE)-(BSIZE*std::get<1>(next))));
+                    }
+                    auto* fwd = static_cast<fwdnode_t*>(child);
+                    stack.emplace(fwd, std::get<1>(next) + 1 + fwd->_skip, f);
+                    g(fwd);
+                }
+                else
+                {
+                    f((node_t*)child, std::get<1>(next), std::get<2>(next));
+                }
+            }
+        }
+    }
+
+    template<PTRIETPL>
+    template<typename F>
+    void __ptrie<PTRIETLPA>::for_each_suffix(node_t* node, size_t depth, uint16_t encsize, F&& f) const {
+        // calls f(suffix, length) for every suffix of node stored on the heap
         const auto bdepth = depth / BDIV;
         assert(bdepth < 2 || encsize > 0);
         if (bdepth >= 2 && 
@@ -518,20 +1226,20 @@ namespace ptrie {
         } else if (bdepth >= 2) {
             // If 'encsize - bdepth < HEAPBOUND' is true and 'bdepth >= 2' we hit the if above.
             // everything is allocated on heap
-            auto ptr = (uchar **) data();
-            for (size_t i = 0; i < _count; ++i) {
-                delete[] ptr[i];
+            auto ptr = (uchar **) node->data();
+            for (size_t i = 0; i < node->_count; ++i) {
+                f(ptr[i], encsize - bdepth);
             }
         } else {
             // bdepth < 2
-            assert(_data || _count == 0);
+            assert(node->_data || node->_count == 0);
             size_t offset = 0;
-            for (size_t i = 0; i < _count; ++i) {
-                uint16_t lencsize = first(i);
+            for (size_t i = 0; i < node->_count; ++i) {
+                uint16_t lencsize = node->first(i);
                 if (bdepth == 1) {
                     lencsize = ((encsize & 0xFF00) | (lencsize >> 8));
 #ifndef NDEBUG
-                    uint16_t dummy = first(i);
+                    uint16_t dummy = node->first(i);
                     dummy >>= 8;
                     char* tmp = (char*)&dummy;
                     char* tmp2 = (char*)&encsize;
@@ -539,16 +1247,147 @@ namespace ptrie {
                     assert(dummy == lencsize);
 #endif
                 }
-                if (lencsize > bdepth && (lencsize-bdepth) > HEAPBOUND) {
-                    auto ptr = (uchar **) (&(data()[offset]));
-                    delete[] *ptr;
+                if (lencsize > bdepth && (lencsize-bdepth) >= HEAPBOUND) {
+                    auto ptr = (uchar **) (&(node->data()[offset]));
+                    f(*ptr, lencsize - bdepth);
                 }
                 offset += bytes(lencsize >= bdepth ? lencsize-bdepth : 0);
             }
         }
-        delete[] reinterpret_cast<uchar *>(_data);
-        _data = nullptr;
-        _count = 0;
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::compact_suffixes() {
+        // copy the live suffixes into a fresh arena, the old one goes with tmp
+        suffix_arena_t<ALLOC> tmp(_alloc);
+        if (!_shared) {
+            for_each_node([&](node_t* node, size_t depth, uint16_t encsize) {
+                for_each_suffix(node, depth, encsize, [&](uchar*& suffix, size_t length) {
+                    uchar* dest = tmp.allocate(length);
+                    std::copy(suffix, suffix + length, dest);
+                    suffix = dest;
+                });
+            });
+            _suffixes.swap(tmp);
+            return;
+        }
+        // readers may be on the suffixes and the buckets pointing at them,
+        // so the buckets are copied as well and the old arena is retired
+        std::vector<std::tuple<node_t*, size_t, uint16_t>> nodes;
+        for_each_node([&](node_t* node, size_t depth, uint16_t encsize) {
+            nodes.emplace_back(node, depth, encsize);
+        });
+        for (auto [node, depth, encsize] : nodes) {
+            bool on_heap = false;
+            for_each_suffix(node, depth, encsize, [&](uchar*&, size_t) { on_heap = true; });
+            if (!on_heap) continue;
+            node_t* copy = new_node<node_t>();
+            copy->_type = node->_type;
+            copy->_path = node->_path;
+            copy->_parent = node->_parent;
+            copy->_count = node->_count;
+            copy->_totsize = node->_totsize;
+            copy->_capacity = copy->_totsize + bucket_t::overhead(copy->_count);
+            copy->_data = new_bucket(copy->_capacity);
+            std::copy(reinterpret_cast<uchar*>(node->_data),
+                      reinterpret_cast<uchar*>(node->_data) + node->_totsize + bucket_t::overhead(node->_count),
+                      reinterpret_cast<uchar*>(copy->_data));
+            for_each_suffix(copy, depth, encsize, [&](uchar*& suffix, size_t length) {
+                uchar* dest = tmp.allocate(length);
+                std::copy(suffix, suffix + length, dest);
+                suffix = dest;
+            });
+            if constexpr (HAS_ENTRIES)
+                for (size_t i = 0; i < copy->_count; ++i)
+                    (*_entries)[copy->entries()[i]]._node = copy;
+            set_children(copy->_parent, copy->_path, last_slot(copy), copy);
+            retire(node);
+        }
+        _suffixes.swap(tmp);
+        _epochs.retire({retired_t::ARENA, tmp.detach(), 0});
+    }
+
+    template<PTRIETPL>
+    uint64_t __ptrie<PTRIETLPA>::key_hash(const KEY* data, size_t length) {
+        if constexpr (byte_iterator<KEY>::continious())
+            return bloom_filter_t<ALLOC>::hash(reinterpret_cast<const uchar*>(data), length);
+        else
+            return bloom_filter_t<ALLOC>::hash(length, [data](size_t i) {
+                return byte_iterator<KEY>::const_access(data, i);
+            });
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::rebuild_filter() {
+        // sized for twice the keys in the trie, which are read back so the
+        // erased ones are left out
+        size_t count = 0;
+        for_each_node([&count](node_t* node, size_t, uint16_t) {
+            count += node->_count;
+        });
+        _filter.reset(std::max(MINFILTER, 2 * count));
+        std::vector<KEY> key;
+        std::stack<uchar> path;
+        for_each_node([&](node_t* node, size_t, uint16_t) {
+            for (size_t i = 0; i < node->_count; ++i) {
+                size_t ps, offset;
+                uint16_t size;
+                while (!path.empty()) path.pop();
+                __build_path<node_t, BDIV, BSIZE, HEAPBOUND>(node, path, i, offset, ps, size);
+                key.resize(size / byte_iterator<KEY>::element_size());
+                __write_data<node_t, KEY, BDIV, BSIZE, HEAPBOUND>(key.data(), node, path, i, offset, ps, size);
+                _filter.add(key_hash(key.data(), size));
+            }
+        });
+    }
+
+    template<PTRIETPL>
+    memory_usage_t __ptrie<PTRIETLPA>::memory_usage() const {
+        memory_usage_t usage;
+        usage._fwdnodes = 1;
+        usage._fwdnode_bytes = sizeof(fwdnode_t) + _root.map_bytes();
+        for_each_node([&](node_t* node, size_t depth, uint16_t encsize) {
+            ++usage._nodes;
+            usage._node_bytes += sizeof(node_t);
+            usage._first_bytes += node->_count * sizeof(uint16_t);
+            usage._entry_bytes += bucket_t::overhead(node->_count) - node->_count * sizeof(uint16_t);
+            usage._data_bytes += node->_totsize;
+            usage._slack_bytes += node->_capacity - node->_totsize - bucket_t::overhead(node->_count);
+            for_each_suffix(node, depth, encsize, [&](uchar*&, size_t length) {
+                ++usage._suffixes;
+                usage._suffix_bytes += length;
+            });
+        }, [&](fwdnode_t* fwd) {
+            ++usage._fwdnodes;
+            usage._fwdnode_bytes += sizeof(fwdnode_t) + fwd->map_bytes();
+        });
+        if (_entries != nullptr) {
+            usage._entry_blocks = _entries->blocks();
+            usage._entry_block_bytes = usage._entry_blocks * entrylist_t::block_size();
+            usage._index_blocks = _entries->index_blocks();
+            usage._index_bytes = _entries->index_bytes();
+        }
+        usage._filter_bytes = _filter.bytes();
+        return usage;
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::compact() {
+        // the copy draws from a fresh pool and arena in the order clone
+        // visits the trie, and shares the entries so the ids are reused.
+        __ptrie tmp(_alloc);
+        tmp._entries = _entries;
+        tmp._threads = _threads;
+        tmp.clone(tmp._top, *_top, _entries.get(), FIXEDSIZE, TOPLEVEL);
+        tmp._free_ids.swap(_free_ids);
+        tmp._dead = _dead;
+        tmp._recycle = _recycle;
+        const bool filtered = _filter.enabled();
+        clear();
+        move(tmp);
+        // drops the erased keys from the filter
+        if (filtered)
+            rebuild_filter();
     }
 
     template<PTRIETPL>
@@ -557,40 +1396,105 @@ namespace ptrie {
         _entries = nullptr;
         if constexpr (HAS_ENTRIES)
         {
-            _entries = std::make_unique<entrylist_t>(1);
+            _entries = std::allocate_shared<entrylist_t>(rebind_t<entrylist_t>(_alloc), _threads, rebind_t<entry_t>(_alloc));
         }
 
         _root._parent = nullptr;
         _root._type = 255;
         _root._path = 0;
+        init_root();
+        init_top();
+    }
 
-        size_t i = 0;
-        for (; i < WIDTH; ++i) _root._children[i] = &_root;
+    template<PTRIETPL>
+    I __ptrie<PTRIETLPA>::new_id(size_t thread)
+    {
+        assert(thread < _threads);
+        if (!reuses_id(thread))
+            return _entries->next(thread);
+        I id = _free_ids[thread].back();
+        _free_ids[thread].pop_back();
+        --_dead;
+        return id;
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::release_id(I id)
+    {
+        (*_entries)[id]._node = nullptr;
+        ++_dead;
+        if (_recycle) {
+            const size_t thread = _entries->owner(id);
+            if (_free_ids.size() <= thread)
+                _free_ids.resize(thread + 1, freelist_t(rebind_t<I>(_alloc)));
+            _free_ids[thread].push_back(id);
+        }
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::init_root()
+    {
+        if constexpr (COMPRESSED) {
+            // the root was constructed without a handle, so its empty
+            // children are null until they are set again
+            _root._self = region_table_t::handle(region_table_t::add(&_root), &_root, &_root);
+            set_children(&_root, 0, WIDTH - 1, &_root);
+        }
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::init_top()
+    {
+        // the chunks of the size, most significant first, each lead to the
+        // only child of a fwdnode
+        _top = &_root;
+        for (uint l = 0; l < TOPLEVEL; ++l) {
+            fwdnode_t* fwd = new_node<fwdnode_t>();
+            fwd->_type = 255;
+            fwd->_path = (FIXEDSIZE >> (16 - BSIZE * (l + 1))) & FILTER;
+            fwd->_parent = _top;
+            set_children(_top, fwd->_path, fwd->_path, fwd);
+            _top = fwd;
+        }
     }
 
     template<PTRIETPL>
     void __ptrie<PTRIETLPA>::move(__ptrie& other)
     {
+        other.drain();
+        _pool.swap(other._pool);
+        _suffixes.swap(other._suffixes);
         _entries = std::move(other._entries);
+        _threads = other._threads;
+        _free_ids.swap(other._free_ids);
+        _dead = std::exchange(other._dead, 0);
+        _recycle = other._recycle;
+        ++_version;
+        ++other._version;
+        _filter.swap(other._filter);
         _root._parent = nullptr;
         _root._type = 255;
         _root._path = 0;
+        __base_t* table[WIDTH];
+        other.load_children(&other._root, table);
         for(size_t i = 0; i < WIDTH; ++i)
         {
-            auto e = _root._children[i] = other._root._children[i];
-            if(e == nullptr)
-                continue;
-            else if(e == &other._root)
-                _root._children[i] = &_root;
+            auto e = table[i];
+            if(e == &other._root)
+                table[i] = &_root;
+            else if(e->_type == 255)
+                static_cast<fwdnode_t*>(e)->_parent = &_root;
             else
-            {
-                if(e->_type == 255)
-                    static_cast<fwdnode_t*>(e)->_parent = &_root;
-                else
-                    static_cast<node_t*>(e)->_parent = &_root;
-            }
-            other._root._children[i] = nullptr;
-        }
+                static_cast<node_t*>(e)->_parent = &_root;
+        }
+        store_children(&_root, table);
+        other.free_children(&other._root);
+        if constexpr (!ADAPTIVE)
+            std::fill(std::begin(other._root._run), std::end(other._root._run), &other._root);
+        _top = other._top == &other._root ? &_root : other._top;
+        other.init_top();
+        if (_shared) widen();
+        if (other._shared) other.widen();
     }
     
     template<PTRIETPL>
@@ -599,128 +1503,168 @@ namespace ptrie {
         init();
     }
 
+    template<PTRIETPL>
+    __ptrie<PTRIETLPA>::__ptrie(const ALLOC& alloc)
+    : _alloc(alloc)
+    {
+        init();
+    }
+
+    template<PTRIETPL>
+    __ptrie<PTRIETLPA>::__ptrie(size_t threads, const ALLOC& alloc)
+    : _alloc(alloc), _threads(threads)
+    {
+        static_assert(HAS_ENTRIES, "only tries with ids hand them out to threads");
+        assert(threads > 0);
+        init();
+    }
+
     template<PTRIETPL>
     __ptrie<PTRIETLPA>& __ptrie<PTRIETLPA>::operator=(const ptrie::__ptrie<PTRIETLPA> &other) 
     {
-        _root.clone(other._root, _entries.get(), other._entries.get(), 0, 0);
+        if(this == &other) return *this;
+        clear();
+        _recycle = other._recycle;
+        _threads = other._threads;
+        if constexpr (HAS_ENTRIES)
+        {
+            _entries = std::allocate_shared<entrylist_t>(rebind_t<entrylist_t>(_alloc), _threads, rebind_t<entry_t>(_alloc));
+        }
+        init_top();
+        clone(_top, *other._top, other._entries.get(), FIXEDSIZE, TOPLEVEL);
+        _filter.copy(other._filter);
         return *this;
     }
     
     template<PTRIETPL>
-    constexpr void __ptrie<PTRIETLPA>::fwdnode_t::clone(const __ptrie<PTRIETLPA>::fwdnode_t& other, entrylist_t* entries, const entrylist_t* other_entries, uint16_t esize, size_t depth)
+    void __ptrie<PTRIETLPA>::clone(fwdnode_t* node, const fwdnode_t& other, const entrylist_t* other_entries, uint16_t esize, size_t depth, size_t base)
     {
-        _path = other._path;
-        _type = 255;
-
+        node->_path = other._path;
+        node->_type = 255;
+        node->_skip = other._skip;
+        std::copy(std::begin(other._prefix), std::end(other._prefix), std::begin(node->_prefix));
+
+        __base_t* children[WIDTH];
+        __base_t* table[WIDTH];
+        load_children(&other, children);
         for(size_t i = 0; i < WIDTH; ++i)
         {
-            auto* child = other._children[i];
-            if(child == nullptr)
-            {
-                _children[i] = nullptr;
-                continue;
-            }
+            auto* child = children[i];
             if(&other == child)
             {
-                _children[i] = this;
+                table[i] = node;
                 continue;
             }
-            if(i > 0 && child == other._children[i-1])
+            if(i > 0 && child == children[i-1])
             {
-                _children[i] = _children[i-1];
+                table[i] = table[i-1];
                 continue;
             }
             if(child->_type == 255)
             {
-                auto nn = new fwdnode_t;
-                _children[i] = nn;
+                auto nn = new_node<fwdnode_t>();
+                table[i] = nn;
                 auto f = esize;
                 if(depth / BDIV < 2)
                 {
                     // we add bits from the most significant to the least
                     f |= (child->_path << ((16-BSIZE)-(BSIZE*depth)));
                 }
-                nn->clone(*static_cast<const fwdnode_t*>(child), entries, other_entries, f, depth+1);
-                nn->_parent = this;
+                auto* fwd = static_cast<const fwdnode_t*>(child);
+                clone(nn, *fwd, other_entries, f, depth + 1 + fwd->_skip, base);
+                nn->_parent = node;
             }
             else
             {
-                auto nn = new node_t;
-                _children[i] = nn;
-                nn->clone(*static_cast<const node_t*>(child), entries, other_entries, esize, depth);
-                nn->_parent = this;
+                auto nn = new_node<node_t>();
+                table[i] = nn;
+                clone(nn, *static_cast<const node_t*>(child), other_entries, esize, depth, base);
+                nn->_parent = node;
             }
         }
+        store_children(node, table);
     }
 
     template<PTRIETPL>
-    constexpr void __ptrie<PTRIETLPA>::node_t::clone(const __ptrie<PTRIETLPA>::node_t& other, entrylist_t* entries, const entrylist_t* other_entries, uint16_t encsize, size_t depth) {
+    void __ptrie<PTRIETLPA>::clone(node_t* node, const node_t& other, const entrylist_t* other_entries, uint16_t encsize, size_t depth, size_t base) {
         const auto bdepth = depth / BDIV;
-        _path = other._path;
-        _type = other._type;
-        _count = other._count;
-        _totsize = other._totsize;
-        _data = (bucket_t*) new uchar[_totsize + bucket_t::overhead(_count)];
-        std::copy(other.first(), other.first() + _count, first());
+        node->_path = other._path;
+        node->_type = other._type;
+        node->_count = other._count;
+        node->_totsize = other._totsize;
+        node->_capacity = node->_totsize + bucket_t::overhead(node->_count);
+        node->_data = new_bucket(node->_capacity);
+        std::copy(other.first(), other.first() + node->_count, node->first());
         if (bdepth >= 2 &&
                 (encsize < bdepth || // already fully encoded
                 encsize - bdepth < HEAPBOUND)) // residue is directly encoded
         {
-            std::copy(other.data(), other.data() + other._totsize, data());
+            std::copy(other.data(), other.data() + other._totsize, node->data());
         } else if (bdepth >= 2) {
 
             // everything is allocated on heap
-            auto ptr = (uchar **) data();
+            auto ptr = (uchar **) node->data();
             auto optr = (uchar **) other.data();
-            for (size_t i = 0; i < _count; ++i) {
-                ptr[i] = new uchar[(encsize - bdepth)];
-                std::copy(optr[i], optr[i] + encsize, ptr[i]);
+            for (size_t i = 0; i < node->_count; ++i) {
+                ptr[i] = new_suffix(encsize - bdepth);
+                std::copy(optr[i], optr[i] + (encsize - bdepth), ptr[i]);
             }
         } else {
             size_t offset = 0;
-            for (size_t i = 0; i < _count; ++i) {
-                uint16_t lencsize = first(i);
+            for (size_t i = 0; i < node->_count; ++i) {
+                uint16_t lencsize = node->first(i);
                 if (bdepth == 1) {
                     lencsize = ((encsize & 0xFF00) | (lencsize >> 8));
                 }
-                if (lencsize > bdepth && (lencsize - bdepth) >= HEAPBOUND) {
-                    auto ptr = (uchar **) (&(data()[offset]));
+                const uint16_t len = lencsize > bdepth ? lencsize - bdepth : 0;
+                if (len >= HEAPBOUND) {
+                    auto ptr = (uchar **) (&(node->data()[offset]));
                     auto optr = (uchar **) (&(other.data()[offset]));
-                    ptr[0] = new uchar[lencsize];
-                    std::copy(optr[0], optr[0] + (lencsize - bdepth), ptr[0]);
+                    ptr[0] = new_suffix(len);
+                    std::copy(optr[0], optr[0] + len, ptr[0]);
                 } else {
-                    std::copy(other.data() + offset, other.data() + (lencsize - bdepth), data() + offset);
+                    std::copy(other.data() + offset, other.data() + offset + len, node->data() + offset);
                 }
-                offset += bytes(lencsize >= bdepth ? lencsize - bdepth : 0);
+                offset += bytes(len);
             }
         }
         if constexpr (HAS_ENTRIES) {
-            for (size_t i = 0; i < _count; ++i) {
-                auto eid = entries->next(0);
-                this->entries()[i] = eid;
-                (*entries)[eid] = (*other_entries)[other.entries()[i]];
+            for (size_t i = 0; i < node->_count; ++i) {
+                if (other_entries == _entries.get()) {
+                    // a relayout of this trie, the ids stay
+                    node->entries()[i] = other.entries()[i];
+                    (*_entries)[other.entries()[i]]._node = node;
+                    continue;
+                }
+                const size_t eid = base == NEWIDS ? _entries->next(0) : base + other.entries()[i];
+                node->entries()[i] = eid;
+                (*_entries)[eid] = (*other_entries)[other.entries()[i]];
+                (*_entries)[eid]._node = node;
             }
         }
     }
 
+    template<PTRIETPL>
+    uchar __ptrie<PTRIETLPA>::chunk(const KEY* data, size_t s, uint p_byte) {
+        uchar* sc = (uchar*) & s;
+        const auto byte = p_byte / BDIV;
+        uchar nb;
+        if (size_byte(byte)) nb = sc[1 - byte];
+        else nb = byte_iterator<KEY>::const_access(data, byte - 2);
+        if constexpr (BSIZE != 8)
+            nb = (nb >> (((BDIV - 1) - (p_byte % BDIV))*BSIZE)) & FILTER;
+        return nb;
+    }
+
     template<PTRIETPL>
     __base_t*
     __ptrie<PTRIETLPA>::fast_forward(const KEY* data, size_t s, fwdnode_t** tree_pos, uint& p_byte) const {
         fwdnode_t* t_pos = *tree_pos;
 
-        uchar* sc = (uchar*) & s;
-        
         do {
             *tree_pos = t_pos;
 
-            __base_t* next;
-            const auto byte = p_byte / BDIV;
-            uchar nb;
-            if (byte >= 2) nb = byte_iterator<KEY>::const_access(data, byte - 2);
-            else nb = sc[1 - byte];
-            if constexpr (BSIZE != 8)
-                nb = (nb >> (((BDIV - 1) - (p_byte % BDIV))*BSIZE)) & FILTER;
-            next = t_pos->_children[nb];
+            __base_t* next = t_pos->child(chunk(data, s, p_byte));
 
             assert(next != nullptr);
             if(next == t_pos)
@@ -732,6 +1676,17 @@ namespace ptrie {
             } else {
                 t_pos = static_cast<fwdnode_t*> (next);
                 ++p_byte;
+                if (t_pos->_skip != 0) {
+                    // a key leaving the shared run is not in the trie, the
+                    // caller gets the node and the first level of the run
+                    for (size_t j = 0; j < t_pos->_skip; ++j) {
+                        if (chunk(data, s, p_byte + j) != t_pos->_prefix[j]) {
+                            *tree_pos = t_pos;
+                            return nullptr;
+                        }
+                    }
+                    p_byte += t_pos->_skip;
+                }
             }
         } while (true);
         assert(false);
@@ -753,7 +1708,7 @@ namespace ptrie {
 
         uint16_t first;
         uchar* tf = (uchar*) & first;
-        if (byte <= 1) {
+        if (size_byte(byte)) {
             first = size;
             if (byte == 1) {
                 first <<= 8;
@@ -768,30 +1723,46 @@ namespace ptrie {
         }
 
         bucket_t* bucket = node->_data;
-        if (node->_count > 0) {
-            size_t offset = 0;
-            b_index = 0;
-            uint16_t bs = 0;
-            uchar* bsc = (uchar*) & bs;
-            uint16_t f;
-            uchar* fc = (uchar*) & f;
-            for (; b_index < node->_count; ++b_index) {
-                f = bucket->first(node->_count, b_index);
-                if (f >= first) break;
-                if (byte > 1) bs = encsize;
-                else if (byte == 1) {
-                    bs = size;
-                    bsc[0] = fc[1];
-                    bs -= 1;
-                } 
-                else // if byte == 0
-                {
-                    bsc[0] = fc[0];
-                    bsc[1] = fc[1];
+        if (node->_count > 0 && !size_byte(byte)) {
+            // past the second byte all suffixes have the same length, so the
+            // bucket is a sorted array of fixed stride we can bisect
+            const uint16_t count = node->_count;
+            const uint16_t* firsts = &bucket->first(count, 0);
+            const size_t begin = first_scan::partition(count, [&](size_t i) { return firsts[i] < first; });
+            b_index = begin;
+            if (begin == count || firsts[begin] != first) return false;
+            const size_t end = begin + first_scan::partition(count - begin, [&](size_t i) {
+                return firsts[begin + i] == first;
+            });
+
+            // entries with the same first are ordered by the rest of the suffix
+            const uchar* data = bucket->data(count);
+            const size_t stride = bytes(encsize);
+            auto compare = [&](size_t i) -> int {
+                const uchar* suffix = data + i * stride;
+                if constexpr (byte_iterator<KEY>::continious()) {
+                    const uchar* t = &byte_iterator<KEY>::const_access(target, byte);
+                    if (encsize < HEAPBOUND)
+                        return first_scan::compare(suffix, t, encsize);
+                    return std::memcmp(*((uchar* const*) suffix), t, encsize);
                 }
-
-                offset += bytes(bs);
-            }
+                if (encsize >= HEAPBOUND)
+                    suffix = *((uchar* const*) suffix);
+                for (size_t b = 0; b < encsize; ++b) {
+                    const uchar ob = byte_iterator<KEY>::const_access(target, b + byte);
+                    if (suffix[b] != ob)
+                        return suffix[b] < ob ? -1 : 1;
+                }
+                return 0;
+            };
+            b_index = begin + first_scan::partition(end - begin, [&](size_t i) { return compare(begin + i) < 0; });
+            return b_index < end && compare(b_index) == 0;
+        }
+        if (node->_count > 0) {
+            // skip the suffixes sorting before the target
+            const uint16_t* firsts = &bucket->first(node->_count, 0);
+            b_index = first_scan::lower_bound(firsts, node->_count, first);
+            size_t offset = first_scan::suffix_bytes<HEAPBOUND>(firsts, b_index, byte == 1, (uint16_t)size & 0xFF00);
 
             if (b_index >= node->_count ||
                     bucket->first(node->_count, b_index) > first) return false;
@@ -807,6 +1778,16 @@ namespace ptrie {
                 // if we reach here, things have same size
 
                 if (encsize < HEAPBOUND) {
+                    if constexpr (byte_iterator<KEY>::continious())
+                    {
+                        int cmp = first_scan::compare(&data[offset], &byte_iterator<KEY>::const_access(target, byte), encsize);
+                        if (cmp >= 0) {
+                            found = cmp == 0;
+                            break;
+                        }
+                        offset += bytes(encsize);
+                        continue;
+                    }
                     for (; b < encsize; ++b) {
                         ob = byte_iterator<KEY>::const_access(target, b+byte);
                         if (data[offset + b] != ob) break;
@@ -874,6 +1855,7 @@ namespace ptrie {
         // run through tree as long as there are branches covering some of 
         // the encoding
         *node = fast_forward(data, length, tree_pos, p_byte);
+        if (*node == nullptr) return false;
         if((__base_t*)*node != (__base_t*)*tree_pos) {
             return bucket_search(data, length, (node_t*)*node, b_index, p_byte/BDIV);
         } 
@@ -884,6 +1866,153 @@ namespace ptrie {
     }
 
 
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::advance(cursor_t& c) const {
+        switch (c._step) {
+        case cursor_t::FWD:
+            for (size_t j = 0; j < c._fwd->_skip; ++j) {
+                if (chunk(c._data, c._length, c._p_byte + j) != c._fwd->_prefix[j]) {
+                    c._step = cursor_t::DONE;
+                    return;
+                }
+            }
+            c._p_byte += c._fwd->_skip;
+            // the fwdnode is in cache, fetch the slot of the child if the
+            // map is kept outside the node
+            c._chunk = chunk(c._data, c._length, c._p_byte);
+            c._step = cursor_t::CHILD;
+            if constexpr (ADAPTIVE) {
+                if (c._fwd->_kind == fwdnode_t::FULL) {
+                    ptrie_prefetch(&c._fwd->_full[c._chunk]);
+                    return;
+                }
+                if (c._fwd->_kind == fwdnode_t::MEDIUM) {
+                    ptrie_prefetch(&c._fwd->_medium->_index[c._chunk]);
+                    ptrie_prefetch(&c._fwd->_medium->_slots[0]);
+                    return;
+                }
+            }
+            [[fallthrough]];
+        case cursor_t::CHILD: {
+            __base_t* next = c._fwd->child(c._chunk);
+            if (next == c._fwd) {
+                c._base = next;
+                c._step = cursor_t::DONE;
+            } else if (next->_type != 255) {
+                c._base = next;
+                c._step = cursor_t::BUCKET;
+                ptrie_prefetch(next);
+            } else {
+                c._fwd = static_cast<fwdnode_t*> (next);
+                ++c._p_byte;
+                c._step = cursor_t::FWD;
+                ptrie_prefetch(next);
+            }
+            return;
+        }
+        case cursor_t::BUCKET: {
+            auto* node = static_cast<node_t*> (c._base);
+            c._step = cursor_t::SEARCH;
+            if (node->_count > 0) {
+                ptrie_prefetch(node->_data);
+                ptrie_prefetch(reinterpret_cast<uchar*>(node->_data) + 64);
+                return;
+            }
+            [[fallthrough]];
+        }
+        case cursor_t::SEARCH:
+            c._found = bucket_search(c._data, c._length, static_cast<node_t*> (c._base), c._b_index, c._p_byte / BDIV);
+            c._step = cursor_t::DONE;
+            return;
+        }
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::search_batch(std::span<const std::pair<const KEY*, size_t>> keys,
+            std::span<returntype_t> results) const {
+        assert(results.size() >= keys.size());
+        typename epochs_t::guard_t guard(_epochs);
+        for (size_t begin = 0; begin < keys.size(); begin += BATCHWIDTH) {
+            const size_t n = std::min(BATCHWIDTH, keys.size() - begin);
+            cursor_t cursors[BATCHWIDTH];
+            for (size_t i = 0; i < n; ++i) {
+                auto& key = keys[begin + i];
+                assert(key.second <= 65536);
+                cursors[i]._data = key.first;
+                cursors[i]._length = key.second * byte_iterator<KEY>::element_size();
+                assert(FIXED_LENGTH == 0 || key.second == FIXED_LENGTH);
+                cursors[i]._fwd = _top;
+                cursors[i]._p_byte = TOPLEVEL;
+            }
+            size_t active = n;
+            if (_filter.enabled()) {
+                for (size_t i = 0; i < n; ++i) {
+                    if (!filtered_out(cursors[i]._data, cursors[i]._length)) continue;
+                    cursors[i]._step = cursor_t::DONE;
+                    --active;
+                }
+            }
+            while (active > 0) {
+                for (size_t i = 0; i < n; ++i) {
+                    if (cursors[i]._step == cursor_t::DONE) continue;
+                    advance(cursors[i]);
+                    if (cursors[i]._step == cursor_t::DONE) --active;
+                }
+            }
+            for (size_t i = 0; i < n; ++i) {
+                auto& c = cursors[i];
+                returntype_t ret(c._found, std::numeric_limits<size_t>::max());
+                if constexpr (HAS_ENTRIES) {
+                    if (c._found) {
+                        auto* node = static_cast<node_t*> (c._base);
+                        ret.second = node->entries()[c._b_index];
+                    }
+                }
+                results[begin + i] = ret;
+            }
+        }
+    }
+
+    template<PTRIETPL>
+    bool __ptrie<PTRIETLPA>::only_child(const fwdnode_t* fwd, const __base_t* child) const
+    {
+        if (fwd->_kind != fwdnode_t::SMALL) return false;
+        for (size_t r = 0; r < fwd->_runs; ++r) {
+            const __base_t* c = fwd->child(fwd->_starts[r]);
+            if (c != fwd && c != child) return false;
+        }
+        return true;
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::split_prefix(fwdnode_t* fwd, const KEY* data, size_t length, uint p_byte)
+    {
+        // p_byte is the first level covered by fwd, a fwdnode for the levels
+        // before the one where the key differs is put on top of fwd
+        size_t j = 0;
+        while (chunk(data, length, p_byte + j) == fwd->_prefix[j]) ++j;
+        cut_prefix(fwd, j);
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::cut_prefix(fwdnode_t* fwd, size_t j)
+    {
+        assert(j < fwd->_skip);
+        fwdnode_t* head = new_node<fwdnode_t>();
+        head->_type = 255;
+        head->_path = fwd->_path;
+        head->_parent = fwd->_parent;
+        head->_skip = j;
+        std::copy(fwd->_prefix, fwd->_prefix + j, head->_prefix);
+        set_children(fwd->_parent, fwd->_path, fwd->_path, head);
+
+        fwd->_path = fwd->_prefix[j];
+        fwd->_parent = head;
+        fwd->_skip -= j + 1;
+        std::copy(fwd->_prefix + j + 1, fwd->_prefix + j + 1 + fwd->_skip, fwd->_prefix);
+        set_children(head, fwd->_path, fwd->_path, fwd);
+    }
+
     template<PTRIETPL>
     void __ptrie<PTRIETLPA>::split_fwd(node_t* node, fwdnode_t* jumppar, node_t* locked, int32_t bsize, size_t p_byte)
     {
@@ -896,13 +2025,24 @@ namespace ptrie {
 
         const uint16_t bucketsize = SPLITBOUND;
         node_t lown;
-        fwdnode_t* fwd_n = new fwdnode_t;
+        fwdnode_t* fwd_n;
+        if (BSIZE == 8 && p_byte >= 2 && jumppar != _top && !_shared &&
+            jumppar->_skip < MAXSKIP && only_child(jumppar, node)) {
+            // rather than hanging a fwdnode with a single child below
+            // jumppar, let jumppar cover the level of node as well
+            fwd_n = jumppar;
+            fwd_n->_prefix[fwd_n->_skip++] = node->_path;
+            ++_version;
+            set_children(fwd_n, 0, WIDTH - 1, fwd_n);
+        } else {
+            // put in below jumppar once its children are in place
+            fwd_n = new_node<fwdnode_t>();
+            fwd_n->_parent = jumppar;
+            fwd_n->_type = 255;
+            fwd_n->_path = node->_path;
+            assert(fwd_n->_path < WIDTH);
+        }
 
-        fwd_n->_parent = jumppar;
-        fwd_n->_type = 255;
-        fwd_n->_path = node->_path;
-        assert(fwd_n->_path < WIDTH);
-        
         lown._path = 0;
         node->_path = _masks[0];
         assert(node->_path < WIDTH);
@@ -910,8 +2050,6 @@ namespace ptrie {
         node->_type = 1;
         node->_parent = fwd_n;
 
-        jumppar->_children[fwd_n->_path] = fwd_n;
-
         lown._data = nullptr;
 
         int lcnt = 0;
@@ -919,6 +2057,7 @@ namespace ptrie {
         int lsize = 0;
         int hsize = 0;
         bucket_t* bucket = node->_data;
+        const auto bucket_capacity = node->_capacity;
         int to_cut;
         if constexpr (BSIZE != 8)
             to_cut = ((p_byte + 1) % BDIV)== 0 ? 1 : 0;
@@ -930,7 +2069,7 @@ namespace ptrie {
         for (int i = 0; i < bucketsize; ++i) {
 
             lengths[i] = std::max(bsize, 0);
-            if (p_byte < BDIV*2) {
+            if (size_byte(p_byte / BDIV)) {
                 uchar* f = (uchar*)&(bucket->first(bucketsize, i));
                 uchar* d = (uchar*)&(lengths[i]);
                 if (p_byte >= BDIV) {
@@ -972,22 +2111,26 @@ namespace ptrie {
         node->_count = hcnt;
         if (hcnt == 0) node->_data = nullptr;
         else if(to_cut != 0 || lcnt != 0) 
-            node->_data = (bucket_t*) new uchar[node->_totsize + 
-                bucket_t::overhead(node->_count)];
+        {
+            node->_capacity = node->_totsize + bucket_t::overhead(node->_count);
+            node->_data = new_bucket(node->_capacity);
+        }
 
         lown._totsize = lsize > 0 ? lsize : 0;
         lown._count = lcnt;
         if (lcnt == 0) lown._data = nullptr;
         else if(to_cut != 0 || hcnt != 0) 
-            lown._data = (bucket_t*) new uchar[lown._totsize +
-                bucket_t::overhead(lown._count)];
+        {
+            lown._capacity = lown._totsize + bucket_t::overhead(lown._count);
+            lown._data = new_bucket(lown._capacity);
+        }
 
         // copy values
         int lbcnt = 0;
         int hbcnt = 0;
         int bcnt = 0;
 
-        constexpr auto move_data = [](const auto i, bucket_t* bucket, const auto bucketsize, node_t& node, const auto offset, uint16_t* lengths, int& bcnt, int& nbcnt, auto to_cut)
+        auto move_data = [this](const auto i, bucket_t* bucket, const auto bucketsize, node_t& node, const auto offset, uint16_t* lengths, int& bcnt, int& nbcnt, auto to_cut)
         {
             const auto next_length = lengths[i] - to_cut;
             const auto j = i - offset;
@@ -995,7 +2138,7 @@ namespace ptrie {
             if (lengths[i] > 0) {
                 uchar* dest = &(node.data()[nbcnt]);
                 if (next_length >= HEAPBOUND) {
-                    uchar* data = new uchar[next_length];
+                    uchar* data = new_suffix(next_length);
                     *reinterpret_cast<uchar**>(dest) = data;
                     dest = data;
                 }
@@ -1009,7 +2152,7 @@ namespace ptrie {
 
                 if(to_cut != 0)
                 {
-                    if(lengths[j] > 0)
+                    if(lengths[i] > 0)
                     {
                         uchar* f = (uchar*)&(node._data->first(node._count, j));
                         f[0] = src[0];
@@ -1026,7 +2169,7 @@ namespace ptrie {
                         assert(std::memcmp(tmp, &(src[to_cut]), next_length) == 0);
                     }
 #endif
-                    delete[] src;
+                    delete_suffix(src, lengths[i]);
                 }
                 nbcnt += bytes(next_length);
             }
@@ -1050,12 +2193,11 @@ namespace ptrie {
                     auto* e = bucket->entries(bucketsize);
                     std::copy(e, e + bucketsize, node->_data->entries(bucketsize));
                 }
-                delete[] (uchar*)bucket;
+                delete_bucket(bucket, bucket_capacity);
                 lown._data = nullptr;
             } else node->_data = bucket;
             
-            for (size_t i = 0; i < WIDTH/2; ++i) fwd_n->_children[i] = fwd_n;
-            for (size_t i = WIDTH/2; i < WIDTH; ++i) fwd_n->_children[i] = node;
+            set_children(fwd_n, WIDTH/2, WIDTH - 1, node);
             
             split_node(node, fwd_n, locked, bsize - to_cut, p_byte + 1);
         }
@@ -1067,12 +2209,12 @@ namespace ptrie {
                     auto* e = bucket->entries(bucketsize);
                     std::copy(e, e+ bucketsize, lown._data->entries(bucketsize));
                 }
-                delete[] (uchar*)bucket;
+                delete_bucket(bucket, bucket_capacity);
                 node->_data = lown._data;
+                node->_capacity = lown._capacity;
             } else node->_data = bucket;
             
-            for (size_t i = 0; i < WIDTH/2; ++i) fwd_n->_children[i] = node;
-            for (size_t i = WIDTH/2; i < WIDTH; ++i) fwd_n->_children[i] = fwd_n;
+            set_children(fwd_n, 0, WIDTH/2 - 1, node);
             
             node->_path = lown._path;
             assert(node->_path < WIDTH);
@@ -1081,16 +2223,17 @@ namespace ptrie {
             node->_type = lown._type;
             split_node(node, fwd_n, locked, bsize - to_cut, p_byte + 1);
         } else {
-            node_t* low_n = new node_t;
+            node_t* low_n = new_node<node_t>();
             low_n->_data = lown._data;
             low_n->_totsize = lown._totsize;
+            low_n->_capacity = lown._capacity;
             low_n->_count = lown._count;
             low_n->_path = lown._path;
             assert(low_n->_path < WIDTH);
             low_n->_type = lown._type;
             low_n->_parent =  fwd_n;
-            for (size_t i = 0; i < WIDTH/2; ++i) fwd_n->_children[i] = low_n;
-            for (size_t i = WIDTH/2; i < WIDTH; ++i) fwd_n->_children[i] = node;
+            set_children(fwd_n, 0, WIDTH/2 - 1, low_n);
+            set_children(fwd_n, WIDTH/2, WIDTH - 1, node);
             if constexpr (HAS_ENTRIES) {
                 // We are stopping splitting here, so correct entries if needed
                 I* ents = bucket->entries(bucketsize);
@@ -1104,8 +2247,10 @@ namespace ptrie {
                     else node->_data->entries(node->_count)[i - lown._count] = ents[i];
                 }
             }
-            delete[] (uchar*)bucket;
+            delete_bucket(bucket, bucket_capacity);
         }
+        if (fwd_n != jumppar)
+            set_children(jumppar, fwd_n->_path, fwd_n->_path, fwd_n);
     }
 
     template<PTRIETPL>
@@ -1162,7 +2307,7 @@ namespace ptrie {
                 ++lcnt;
                 --hcnt;
                 uint16_t fc;
-                if (byte < 2) {
+                if (size_byte(byte)) {
                     uchar* fcc = (uchar*) & fc;
                     if (byte == 0) {
                         fcc[0] = f[0];
@@ -1180,13 +2325,14 @@ namespace ptrie {
         }
 
         bucket_t* old = node->_data;
+        const auto old_capacity = node->_capacity;
         // copy over values
         hnode._count = hcnt;
         hnode._totsize = node->_totsize - lsize;
         node->_count = lcnt;
         node->_totsize = lsize;
 
-        if(byte >= 2)
+        if(!size_byte(byte))
         {
             assert(hnode._totsize == bytes(std::max(bsize,0)) * hnode._count);
             assert(node->_totsize == bytes(std::max(bsize,0)) * node->_count);
@@ -1200,11 +2346,12 @@ namespace ptrie {
 
         if (node->_count == 0) // only high node has data
         {
+#ifndef NDEBUG
+            // with shared reads the node is a copy, not yet in jumppar
             for(size_t i = node->_path; i < hnode._path; ++i)
-            {
-                assert(jumppar->_children[i] == node);
-                jumppar->_children[i] = jumppar;
-            }
+                assert(_shared || jumppar->child(i) == node);
+#endif
+            set_children(jumppar, node->_path, hnode._path - 1, jumppar);
 
             node->_path = hnode._path;
             assert(node->_path < WIDTH);
@@ -1217,16 +2364,16 @@ namespace ptrie {
         }
         else if (hnode._count == 0) // only low node has data
         {
+#ifndef NDEBUG
             for(size_t i = hnode._path; i < hnode._path + dist; ++i)
-            {
-                assert(jumppar->_children[i] == node);
-                jumppar->_children[i] = jumppar;
-            }
+                assert(_shared || jumppar->child(i) == node);
+#endif
+            set_children(jumppar, hnode._path, hnode._path + dist - 1, jumppar);
 
             node->_data = old;
             split_node(node, jumppar, locked, bsize, p_byte);
         } else {
-            node_t* h_node = new node_t;
+            node_t* h_node = new_node<node_t>();
             h_node->_count = hnode._count;
             h_node->_type = hnode._type;
             h_node->_path = hnode._path;
@@ -1234,16 +2381,15 @@ namespace ptrie {
             h_node->_totsize = hnode._totsize;
             h_node->_parent = jumppar;
 
+#ifndef NDEBUG
             for(size_t i = hnode._path; i < hnode._path + dist; ++i)
-            {
-                assert(jumppar->_children[i] == node);
-                jumppar->_children[i] = h_node;
-            }
+                assert(_shared || jumppar->child(i) == node);
+#endif
 
-            h_node->_data = (bucket_t*) new uchar[h_node->_totsize + 
-                    bucket_t::overhead(h_node->_count)];
-            node->_data = (bucket_t*) new uchar[node->_totsize + 
-                    bucket_t::overhead(node->_count)];
+            h_node->_capacity = h_node->_totsize + bucket_t::overhead(h_node->_count);
+            h_node->_data = new_bucket(h_node->_capacity);
+            node->_capacity = node->_totsize + bucket_t::overhead(node->_count);
+            node->_data = new_bucket(node->_capacity);
 
             // copy firsts
             {
@@ -1275,8 +2421,10 @@ namespace ptrie {
                     }
                 }
             }
+            // readers may take h_node as soon as it is in
+            set_children(jumppar, hnode._path, hnode._path + dist - 1, h_node);
 
-            delete[] (uchar*)old;
+            delete_bucket(old, old_capacity);
             assert(node->_count < SPLITBOUND || (std::max(bsize,0)+1 == (int64_t)p_byte/BDIV));
             assert(h_node->_count < SPLITBOUND || (std::max(bsize,0)+1 == (int64_t)p_byte/BDIV));
         }
@@ -1286,12 +2434,16 @@ namespace ptrie {
     std::pair<bool, size_t>
     __ptrie<PTRIETLPA>::exists(const KEY* data, size_t length) const {
         assert(length <= 65536);
+        assert(FIXED_LENGTH == 0 || length == FIXED_LENGTH);
+        if (filtered_out(data, length*byte_iterator<KEY>::element_size()))
+            return returntype_t(false, std::numeric_limits<size_t>::max());
+        typename epochs_t::guard_t guard(_epochs);
 
         uint b_index = 0;
 
-        fwdnode_t* fwd = const_cast<fwdnode_t*>(&_root);
+        fwdnode_t* fwd = _top;
         __base_t* base = nullptr;
-        uint byte = 0;
+        uint byte = TOPLEVEL;
 
         b_index = 0;
         bool res = best_match(data, length*byte_iterator<KEY>::element_size(), &fwd, &base, byte, b_index);
@@ -1305,31 +2457,354 @@ namespace ptrie {
         return ret;
     }
 
+    template<PTRIETPL>
+    std::pair<bool, size_t>
+    __ptrie<PTRIETLPA>::exists(hint_t& hint, const KEY* data, size_t length) const {
+        assert(length <= 65536);
+        assert(FIXED_LENGTH == 0 || length == FIXED_LENGTH);
+        const auto size = length*byte_iterator<KEY>::element_size();
+        if (filtered_out(data, size))
+            return returntype_t(false, std::numeric_limits<size_t>::max());
+        typename epochs_t::guard_t guard(_epochs);
+        uint b_index = 0;
+        uint p_byte = 0;
+
+        fwdnode_t* fwd = resume(hint, data, size, p_byte);
+        __base_t* base = nullptr;
+        bool res = best_match(data, size, &fwd, &base, p_byte, b_index);
+        remember(hint, fwd, base, p_byte, data, size);
+        returntype_t ret = returntype_t(res, std::numeric_limits<size_t>::max());
+        if (HAS_ENTRIES && res) {
+            node_t* node = (node_t*)base;
+            ret.second = node->_data->entries(node->_count)[b_index];
+        }
+        return ret;
+    }
+
+    template<PTRIETPL>
+    typename __ptrie<PTRIETLPA>::fwdnode_t*
+    __ptrie<PTRIETLPA>::resume(hint_t& hint, const KEY* data, size_t length, uint& p_byte) const {
+        if (hint._trie != this || hint._version != _version) {
+            hint._trie = this;
+            hint._version = _version;
+            hint._path.assign(1, {_top, TOPLEVEL});
+            hint._chunks.clear();
+        }
+        // the key reaches every fwdnode selecting at a level up to the
+        // first chunk where it differs from the last key. Levels past the
+        // size-chunks are only compared for keys of the same length.
+        size_t shared = TOPLEVEL;
+        while (shared < TOPLEVEL + hint._chunks.size() && chunk(data, length, shared) == hint._chunks[shared - TOPLEVEL])
+            ++shared;
+        while (hint._path.back().second > shared)
+            hint._path.pop_back();
+        p_byte = hint._path.back().second;
+        hint._chunks.resize(p_byte - TOPLEVEL);
+        return hint._path.back().first;
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::remember(hint_t& hint, fwdnode_t* fwd, const __base_t* base, uint p_byte,
+            const KEY* data, size_t length) const {
+        if (base == nullptr) {
+            // the key left the run of levels covered by fwd
+            p_byte -= 1;
+            fwd = fwd->_parent;
+        }
+        const fwdnode_t* start = hint._path.back().first;
+        const size_t known = hint._path.size();
+        for (; fwd != start; fwd = fwd->_parent) {
+            hint._path.emplace_back(fwd, p_byte);
+            p_byte -= 1 + fwd->_skip;
+        }
+        std::reverse(hint._path.begin() + known, hint._path.end());
+        for (size_t l = TOPLEVEL + hint._chunks.size(); l < hint._path.back().second; ++l)
+            hint._chunks.push_back(chunk(data, length, l));
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::exists_batch(std::span<const std::pair<const KEY*, size_t>> keys,
+            std::span<returntype_t> results) const {
+        search_batch(keys, results);
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::insert_batch(std::span<const std::pair<const KEY*, size_t>> keys,
+            std::span<returntype_t> results) {
+        // the batched lookup leaves the paths of the missing keys in cache,
+        // they are then inserted one at a time as earlier inserts may split
+        // the buckets later keys were found in.
+        search_batch(keys, results);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (results[i].first) {
+                results[i].first = false;
+                if constexpr (!HAS_ENTRIES) results[i].second = 0;
+            } else {
+                results[i] = insert(keys[i].first, keys[i].second);
+            }
+        }
+    }
+
+    template<PTRIETPL>
+    typename __ptrie<PTRIETLPA>::fwdnode_t*
+    __ptrie<PTRIETLPA>::make_path(const KEY* data, size_t size, uint levels) {
+        fwdnode_t* fwd = _top;
+        for (uint l = TOPLEVEL; l < TOPLEVEL + levels; ++l) {
+            const uchar c = chunk(data, size, l);
+            __base_t* child = fwd->child(c);
+            if (child == fwd) {
+                fwdnode_t* next = new_node<fwdnode_t>();
+                next->_type = 255;
+                next->_path = c;
+                next->_parent = fwd;
+                set_children(fwd, c, c, next);
+                child = next;
+            }
+            assert(child->_type == 255);
+            fwd = static_cast<fwdnode_t*>(child);
+        }
+        return fwd;
+    }
+
+    template<PTRIETPL>
+    void __ptrie<PTRIETLPA>::build(std::span<const std::pair<const KEY*, size_t>> keys,
+            std::span<returntype_t> results, size_t threads) {
+        assert(results.empty() || results.size() == keys.size());
+        assert(!_shared);
+        // the groups are copied into empty slots of the top and the entries
+        // are replaced, a trie with children there (or left behind by erase)
+        // or with ids handed out takes the keys one by one
+        bool empty = true;
+        for (size_t i = 0; i < WIDTH; ++i)
+            empty &= _top->child(i) == _top;
+        if constexpr (HAS_ENTRIES)
+            empty &= _entries->size() == 0;
+        if (!empty) {
+            for (size_t k = 0; k < keys.size(); ++k) {
+                auto res = insert(keys[k].first, keys[k].second);
+                if (!results.empty()) results[k] = res;
+            }
+            return;
+        }
+        threads = std::max<size_t>(1, threads);
+        const auto esize = byte_iterator<KEY>::element_size();
+        // the levels of the size chunks, none for FIXED_LENGTH
+        constexpr uint SIZELEVELS = FIXED_LENGTH == 0 ? 2 * BDIV : 0;
+
+        // The keys of a size are a group below the fwdnode of the size or,
+        // with enough of them to fill a fwdnode per first byte, a group per
+        // first byte. Groups too small for a fwdnode of their own in a trie
+        // built by insert, and keys without a first byte, are inserted at
+        // the end instead.
+        struct group_t {
+            uint _levels;
+            std::vector<size_t> _keys;
+        };
+        std::vector<size_t> rest;
+        std::vector<group_t> groups;
+        {
+            std::unordered_map<size_t, size_t> index;
+            std::vector<std::pair<size_t, std::vector<size_t>>> sizes;
+            for (size_t i = 0; i < keys.size(); ++i) {
+                const size_t size = keys[i].second * esize;
+                if (size == 0) {
+                    rest.push_back(i);
+                    continue;
+                }
+                auto [it, added] = index.try_emplace(size, sizes.size());
+                if (added) sizes.emplace_back(size, std::vector<size_t>());
+                sizes[it->second].second.push_back(i);
+            }
+            std::sort(sizes.begin(), sizes.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+            for (auto& [size, members] : sizes) {
+                if (members.size() < 256 * SPLITBOUND) {
+                    if (SIZELEVELS == 0 || members.size() <= SPLITBOUND)
+                        rest.insert(rest.end(), members.begin(), members.end());
+                    else
+                        groups.push_back({SIZELEVELS, std::move(members)});
+                    continue;
+                }
+                std::vector<size_t> bytes[256];
+                for (size_t i : members)
+                    bytes[byte_iterator<KEY>::const_access(keys[i].first, 0)].push_back(i);
+                for (auto& b : bytes) {
+                    if (b.size() <= SPLITBOUND)
+                        rest.insert(rest.end(), b.begin(), b.end());
+                    else
+                        groups.push_back({SIZELEVELS + BDIV, std::move(b)});
+                }
+            }
+            std::sort(rest.begin(), rest.end());
+        }
+
+        // runs of groups large enough to be worth a trie of their own,
+        // several per thread to even out the work
+        std::vector<size_t> runs{0};
+        const size_t target = std::max<size_t>(4096, keys.size() / (16 * threads));
+        for (size_t g = 0, n = 0; g < groups.size(); ++g) {
+            n += groups[g]._keys.size();
+            if (n >= target || g + 1 == groups.size()) {
+                runs.push_back(g + 1);
+                n = 0;
+            }
+        }
+        const size_t nruns = runs.size() - 1;
+        const size_t nworkers = std::min(threads, nruns);
+
+        // the workers build the runs in order, this thread copies in the
+        // groups of each one as soon as it is done
+        std::vector<std::unique_ptr<__ptrie>> built(nruns);
+        std::vector<std::atomic<int>> done(nruns);
+        std::atomic<size_t> next = 0;
+        // the first exception of any thread, passed on once they are joined.
+        // After one the workers still mark the runs they take as done, but
+        // leave them unbuilt, so this thread never waits for nothing.
+        std::exception_ptr error;
+        std::mutex error_latch;
+        std::atomic<bool> failed = false;
+        auto fail = [&]() {
+            std::lock_guard lock(error_latch);
+            if (!error) error = std::current_exception();
+            failed.store(true, std::memory_order_relaxed);
+        };
+        auto build_run = [&](size_t r) {
+            std::unique_ptr<__ptrie> trie(new __ptrie(_alloc));
+            for (size_t g = runs[r]; g < runs[r + 1]; ++g) {
+                const auto& first = keys[groups[g]._keys.front()];
+                trie->make_path(first.first, first.second * esize, groups[g]._levels);
+                for (size_t i : groups[g]._keys) {
+                    auto res = trie->insert(keys[i].first, keys[i].second);
+                    if (!results.empty()) results[i] = res;
+                }
+            }
+            built[r] = std::move(trie);
+        };
+        // The ids of a run are those of its trie, handed out in the order of
+        // its keys, after the ids of the runs before it. So the ids follow
+        // the order of the groups whichever thread built them.
+        auto copy_run = [&](size_t r) {
+            size_t base = 0;
+            if constexpr (HAS_ENTRIES) {
+                base = _entries->size();
+                for (size_t n = built[r]->_entries->size(); n > 0; --n)
+                    _entries->next(0);
+            }
+            for (size_t g = runs[r]; g < runs[r + 1]; ++g) {
+                const auto& first = keys[groups[g]._keys.front()];
+                const size_t size = first.second * esize;
+                const uint levels = groups[g]._levels;
+                // the fwdnode of the group may have been put below one
+                // skipping levels, so it is looked up again
+                const fwdnode_t* from = built[r]->_top;
+                for (uint l = TOPLEVEL; l < TOPLEVEL + levels; ++l)
+                    from = static_cast<const fwdnode_t*>(from->child(chunk(first.first, size, l)));
+                fwdnode_t* to = make_path(first.first, size, levels);
+                clone(to, *from, built[r]->_entries.get(), size, TOPLEVEL + levels + from->_skip, base);
+                if constexpr (HAS_ENTRIES) {
+                    if (!results.empty())
+                        for (size_t i : groups[g]._keys)
+                            results[i].second += base;
+                }
+            }
+            built[r] = nullptr;
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < nworkers; ++t) {
+            try {
+                workers.emplace_back([&]() {
+                    for (size_t r; (r = next.fetch_add(1, std::memory_order_relaxed)) < nruns;) {
+                        try {
+                            if (!failed.load(std::memory_order_relaxed))
+                                build_run(r);
+                        } catch (...) {
+                            fail();
+                        }
+                        done[r].store(1, std::memory_order_release);
+                        done[r].notify_one();
+                    }
+                });
+            } catch (...) {
+                // fewer threads do as well, without any the trie is untouched
+                if (workers.empty()) throw;
+                break;
+            }
+        }
+        for (size_t r = 0; r < nruns; ++r) {
+            done[r].wait(0, std::memory_order_acquire);
+            if (built[r] == nullptr) break;
+            try {
+                copy_run(r);
+            } catch (...) {
+                fail();
+                break;
+            }
+        }
+        for (auto& w : workers)
+            w.join();
+        ++_version;
+        built.clear();
+        if constexpr (HAS_ENTRIES) {
+            if (error) {
+                // the ids taken for keys that were not copied in are dead
+                size_t count = 0;
+                for_each_node([&count](node_t* node, size_t, uint16_t) { count += node->_count; });
+                _dead = _entries->size() - count;
+            }
+        }
+
+        if (!error) {
+            for (size_t i : rest) {
+                auto res = insert(keys[i].first, keys[i].second);
+                if (!results.empty()) results[i] = res;
+            }
+        }
+        if (_filter.enabled())
+            rebuild_filter();
+        if (error)
+            std::rethrow_exception(error);
+    }
+
     template<PTRIETPL>
     returntype_t
-    __ptrie<PTRIETLPA>::insert(const KEY* data, size_t length) {
+    __ptrie<PTRIETLPA>::insert(hint_t* hint, const KEY* data, size_t length, entry_t** element, size_t thread) {
         assert(length <= 65536);
+        assert(FIXED_LENGTH == 0 || length == FIXED_LENGTH);
         const auto size = byte_iterator<KEY>::element_size() * length;
         uint b_index = 0;
 
-        fwdnode_t* fwd = &_root;
+        fwdnode_t* fwd = _top;
         node_t* node = nullptr;
         __base_t* base = nullptr;
-        uint p_byte = 0;
+        uint p_byte = TOPLEVEL;
 
+        // the line of the filter is fetched while the trie is walked
+        uint64_t hash = 0;
+        if (_filter.enabled()) {
+            hash = key_hash(data, size);
+            _filter.prefetch(hash);
+        }
+        if (hint) fwd = resume(*hint, data, size, p_byte);
         bool res = best_match(data, size, &fwd, &base, p_byte, b_index);
+        if (hint) remember(*hint, fwd, base, p_byte, data, size);
         if (res) { // We are not inserting duplicates, semantics of PTrie is a set.
             returntype_t ret(false, 0);
             if constexpr (HAS_ENTRIES) {
                 node = (node_t*)base;
                 ret = returntype_t(false, node->_data->entries(node->_count)[b_index]);
+                if (element) *element = &(*_entries)[ret.second];
             }
             return ret;
         }
+        if (base == nullptr) {
+            // the key leaves the run of levels covered by fwd
+            split_prefix(fwd, data, size, p_byte);
+            return insert(hint, data, length, element, thread);
+        }
         const auto byte = p_byte / BDIV;
         if(base == (__base_t*)fwd)
         {
-            node = new node_t;
+            node = new_node<node_t>();
             node->_count = 0;
             node->_data = nullptr;
             node->_type = 0;
@@ -1339,7 +2814,7 @@ namespace ptrie {
             assert(node);
 
             uchar* sc = (uchar*) & size;
-            uchar b = (byte < 2 ? sc[1 - byte] : byte_iterator<KEY>::const_access(data, byte-2));
+            uchar b = (size_byte(byte) ? sc[1 - byte] : byte_iterator<KEY>::const_access(data, byte-2));
             if constexpr (BSIZE != 8)
                 b = (b >> (((BDIV - 1) - (p_byte % BDIV))*BSIZE)) & FILTER;
 
@@ -1353,7 +2828,7 @@ namespace ptrie {
                 min = min & (~_masks[bit]);
                 max |= _masks[bit];
                 for (int i = min; i <= max ; ++i) {
-                    if(fwd->_children[i] != fwd)
+                    if(fwd->child(i) != fwd)
                     {
                         max = (max & ~_masks[bit]) | (_masks[bit] & b);
                         min = min | (_masks[bit] & b);
@@ -1364,7 +2839,8 @@ namespace ptrie {
                 }
             } while(bit > 0 && !stop);
 
-            for (size_t i = min; i <= max; ++i) fwd->_children[i] = node;
+            // with shared reads the node is put in once it holds the key
+            if (!_shared) set_children(fwd, min, max, node);
             node->_path = min;
             assert(node->_path < WIDTH);
             node->_type = bit;
@@ -1373,6 +2849,21 @@ namespace ptrie {
             node = (node_t*)base;
         }
 
+        // with shared reads the key goes into a copy of the node, which
+        // takes its place when it is complete
+        node_t* published = nullptr;
+        if (_shared && base != (__base_t*)fwd) {
+            published = node;
+            node = new_node<node_t>();
+            node->_type = published->_type;
+            node->_path = published->_path;
+            node->_parent = published->_parent;
+            node->_count = published->_count;
+            node->_totsize = published->_totsize;
+            node->_data = published->_data;
+            node->_capacity = 0;
+        }
+
         // make a new bucket, add new entry, copy over old data
         const int32_t nenc_size = ((int32_t)size)-byte;
 
@@ -1387,21 +2878,75 @@ namespace ptrie {
 
         uint nbucketsize = node->_totsize + nitemsize;
 
-        bucket_t* nbucket = (bucket_t*) new uchar[nbucketsize + 
-                bucket_t::overhead(nbucketcount)];
+        uint tmpsize = 0;
+        if (!size_byte(byte)) tmpsize = b_index * bytes(std::max(nenc_size, 0));
+        else {
+            uint16_t o = size;
+            for (size_t i = 0; i < b_index; ++i) {
 
-        // copy over old "firsts"
+                uint16_t f = node->_data->first(node->_count, i);
+                uchar* fc = (uchar*) & f;
+                uchar* oc = (uchar*) & o;
+                if (byte != 0) {
+                    f >>= 8;
+                    fc[1] = oc[1];
+                    f -= 1;
+                }
+                tmpsize += bytes(f);
+            }
+        }
 
-        {
-            auto* src = &(node->_data->first(node->_count));
-            auto* mid = src + b_index;
-            auto* end = mid + (node->_count - b_index);
-            std::copy(src, mid, &nbucket->first(nbucketcount));
-            std::copy(mid, end, &nbucket->first(nbucketcount, b_index + 1));
+        // keep the old bucket if it has room for the new entry, otherwise
+        // grow geometrically. The layout of a bucket depends on the count, so
+        // everything is shifted towards the back, starting with the data.
+        const uint ncapacity = nbucketsize + bucket_t::overhead(nbucketcount);
+        bucket_t* obucket = node->_data;
+        bucket_t* nbucket = obucket;
+        const auto ocapacity = node->_capacity;
+        if (ncapacity > node->_capacity) {
+            node->_capacity = bucket_t::grow(node->_capacity, ncapacity);
+            nbucket = new_bucket(node->_capacity);
+        }
+
+        // move old data
+        if (node->_count > 0) {
+            auto* src = obucket->data(node->_count);
+            auto* dest = nbucket->data(nbucketcount);
+            std::memmove(dest + tmpsize + nitemsize, src + tmpsize, node->_totsize - tmpsize);
+            std::memmove(dest, src, tmpsize);
+        }
+
+        size_t entry = 0;
+        if constexpr (HAS_ENTRIES) {
+            // move over entries
+            if (node->_count > 0) {
+                auto* src = obucket->entries(node->_count);
+                auto* dest = nbucket->entries(nbucketcount);
+                std::memmove(dest + b_index + 1, src + b_index, (node->_count - b_index) * sizeof(I));
+                std::memmove(dest, src, b_index * sizeof(I));
+            }
+
+            const bool reused = reuses_id(thread);
+            entry = nbucket->entries(nbucketcount)[b_index] = new_id(thread);
+            entry_t& ent = _entries->operator[](entry);
+            ent._node = node;
+            if (element) *element = &ent;
+            else if constexpr (!std::is_void_v<T>) {
+                if (reused) ent._data = T{};
+            }
+        }
+
+        // move over old "firsts"
+        if (node->_count > 0) {
+            auto* src = &(obucket->first(node->_count));
+            auto* dest = &(nbucket->first(nbucketcount));
+            std::memmove(dest + b_index + 1, src + b_index, (node->_count - b_index) * sizeof(uint16_t));
+            if (nbucket != obucket)
+                std::memcpy(dest, src, b_index * sizeof(uint16_t));
         }
 
         uchar* f = (uchar*) & nbucket->first(nbucketcount, b_index);
-        if (byte >= 2) {
+        if (!size_byte(byte)) {
             f[1] = byte_iterator<KEY>::const_access(data, -2 + byte);
             if(byte - 1 < size)
                 f[0] = byte_iterator<KEY>::const_access(data, -2 + byte + 1);
@@ -1417,50 +2962,6 @@ namespace ptrie {
             }
         }
 
-        size_t entry = 0;
-        if constexpr (HAS_ENTRIES) {
-            // copy over entries
-            {
-                auto* src =  node->_data->entries(node->_count);
-                auto* mid = src + b_index;
-                auto* end = mid + (node->_count - b_index);
-                std::copy(src, mid, nbucket->entries(nbucketcount));
-                std::copy(mid, end, nbucket->entries(nbucketcount) + b_index + 1);
-            }
-
-            entry = nbucket->entries(nbucketcount)[b_index] = _entries->next(0);
-            entry_t& ent = _entries->operator[](entry);
-            ent._node = node;
-        }
-
-
-
-        uint tmpsize = 0;
-        if (byte >= 2) tmpsize = b_index * bytes(std::max(nenc_size, 0));
-        else {
-            uint16_t o = size;
-            for (size_t i = 0; i < b_index; ++i) {
-
-                uint16_t f = node->_data->first(nbucketcount - 1, i);
-                uchar* fc = (uchar*) & f;
-                uchar* oc = (uchar*) & o;
-                if (byte != 0) {
-                    f >>= 8;
-                    fc[1] = oc[1];
-                    f -= 1;
-                }
-                tmpsize += bytes(f);
-            }
-        }
-        // copy over old data
-        {
-            auto* src = node->data();
-            auto* mid = src + tmpsize;
-            auto* end = mid + (node->_totsize - tmpsize);
-            std::copy(src, mid, nbucket->data(nbucketcount));
-            std::copy(mid, end, nbucket->data(nbucketcount) + tmpsize + nitemsize);
-        }
-
         // copy over new data
         if (copyval) {
             if constexpr (byte_iterator<KEY>::continious())
@@ -1477,7 +2978,7 @@ namespace ptrie {
             }
         } else {
             // alloc space
-            uchar* dest = new uchar[std::max(nenc_size, 0)];
+            uchar* dest = new_suffix(std::max(nenc_size, 0));
             // copy data to heap
             if constexpr (byte_iterator<KEY>::continious())
             {
@@ -1489,29 +2990,49 @@ namespace ptrie {
                     dest[i] = byte_iterator<KEY>::const_access(data, byte+i);
 
             // copy pointer in
-            *reinterpret_cast<uchar**>(nbucket->data(nbucketcount) + tmpsize) = dest;
+            std::memcpy(nbucket->data(nbucketcount) + tmpsize, &dest, sizeof(uchar*));
         }
 
-        // if needed, split the node 
-        delete[] (uchar*)node->_data;
+        if (nbucket != obucket && published == nullptr)
+            delete_bucket(obucket, ocapacity);
         node->_data = nbucket;
         node->_count = nbucketcount;
         node->_totsize = nbucketsize;
+        if constexpr (HAS_ENTRIES) {
+            if (published != nullptr)
+                for (size_t i = 0; i < nbucketcount; ++i)
+                    (*_entries)[nbucket->entries(nbucketcount)[i]]._node = node;
+        }
 
-        if (node->_count >= SPLITBOUND) {
-            // copy over data to we can work while readers finish
-            // we have to wait for readers to finish for 
-            // tree extension
+        // if needed, split the node 
+        const bool split = node->_count >= SPLITBOUND;
+        if (split)
             split_node(node, fwd, node, nenc_size, p_byte);
+
+        if (_shared) {
+            // the parts of the range of the node that a split handed to
+            // other nodes are already theirs
+            if (node->_parent == fwd)
+                set_children(fwd, node->_path, last_slot(node), node);
+            if (published != nullptr)
+                retire(published);
         }
 
-#ifndef NDEBUG        
-        for (int i = byte - 1; i >= 2; --i) {
-            assert(fwd != nullptr);
-            assert(fwd->_parent == nullptr || fwd->_parent->_children[fwd->_path] == fwd);
-            fwd = fwd->_parent;
+        // splitting re-encodes suffixes, leaving the old ones dead
+        if (split && _suffixes.needs_compaction())
+            compact_suffixes();
+        if (_shared)
+            collect();
 
+        if (_filter.enabled()) {
+            _filter.add(hash);
+            if (_filter.full())
+                rebuild_filter();
         }
+
+#ifndef NDEBUG        
+        for (; fwd->_parent != nullptr; fwd = fwd->_parent)
+            assert(fwd->_parent->child(fwd->_path) == fwd);
         auto r = exists(data, length);
         if (!r.first) {
 
@@ -1527,9 +3048,10 @@ namespace ptrie {
     __ptrie<PTRIETLPA>::inject_byte(node_t* node, uchar topush, size_t totsize, std::function<uint16_t(size_t)> _sizes)
     {
         bucket_t *nbucket = node->_data;
+        uint32_t ncapacity = node->_capacity;
         if(totsize > 0) {
-            nbucket = (bucket_t *) new uchar[totsize +
-                                          bucket_t::overhead(node->_count)];
+            ncapacity = totsize + bucket_t::overhead(node->_count);
+            nbucket = new_bucket(ncapacity);
         }
 
         size_t dcnt = 0;
@@ -1560,7 +3082,7 @@ namespace ptrie {
                 else if(size >= HEAPBOUND)
                 {
                     uchar* src = nullptr;
-                    uchar* dest = new uchar[size];
+                    uchar* dest = new_suffix(size);
                     *reinterpret_cast<uchar**>(nbucket->data(node->_count) + dcnt) = dest;
                     ++dest;
                     dcnt += sizeof(size_t);
@@ -1576,19 +3098,28 @@ namespace ptrie {
                         // allready on heap, but we need to expand it
                         src = *reinterpret_cast<uchar**>(node->data() + ocnt);
                         std::copy(src, src + (size-1), dest);
+                        delete_suffix(src, size - 1);
                         ocnt += sizeof(size_t);
                     }
                     --dest;
                     dest[0] = push;
                 }
             }
-            // also, handle entries here!
+        }
+
+        if constexpr (HAS_ENTRIES) {
+            if(nbucket != node->_data)
+                std::copy(node->entries(), node->entries() + node->_count, nbucket->entries(node->_count));
         }
 
         assert(ocnt == node->_totsize);
         assert(totsize == dcnt);
 
-        if(nbucket != node->_data) delete[] (uchar*)node->_data;
+        if(nbucket != node->_data)
+        {
+            delete_bucket(node->_data, node->_capacity);
+            node->_capacity = ncapacity;
+        }
 
         node->_data = nbucket;
     }
@@ -1602,23 +3133,24 @@ namespace ptrie {
          * non-empty node
          */
         assert(node->_count == 0);
-        auto parent = node->_parent;
-        for(size_t i = 0; i < WIDTH; ++i) parent->_children[i] = parent;
-        delete node;
+        fwdnode_t* parent = node->_parent;
+        set_children(parent, 0, WIDTH - 1, parent);
+        delete_node(node);
         do {
-            if (parent != &_root) {
+            if (parent != _top) {
                 // we can remove fwd and go back one level
-                parent->_parent->_children[parent->_path] = parent->_parent;
-                --byte;
+                set_children(parent->_parent, parent->_path, parent->_path, parent->_parent);
+                const size_t levels = 1 + parent->_skip;
+                byte -= levels;
                 if((byte % BDIV) == 0)
-                    ++on_heap;
+                    on_heap += levels;
                 fwdnode_t* next = parent->_parent;
-                delete parent;
+                delete_node(parent);
                 parent = next;
                 __base_t* other = parent;
                 for(size_t i = 0; i < WIDTH; ++i)
                 {
-                    if(parent->_children[i] != parent && other != parent->_children[i])
+                    if(parent->child(i) != parent && other != parent->child(i))
                     {
                         if(other != parent)
                         {
@@ -1627,7 +3159,7 @@ namespace ptrie {
                         }
                         else
                         {
-                            other = parent->_children[i];
+                            other = parent->child(i);
                         }
                     }
                 }
@@ -1668,8 +3200,8 @@ namespace ptrie {
         if (nbucketcount >= SPLITBOUND)
             return false;
 
-        bucket_t *nbucket = (bucket_t *) new uchar[nbucketsize +
-                                                bucket_t::overhead(nbucketcount)];
+        uint32_t ncapacity = nbucketsize + bucket_t::overhead(nbucketcount);
+        bucket_t *nbucket = new_bucket(ncapacity);
         node_t *first = node;
         node_t *second = other;
         if (path & _masks[node->_type - 1]) {
@@ -1696,8 +3228,19 @@ namespace ptrie {
             std::copy(second->data(), second->data() + second->_totsize, 
                     nbucket->data(nbucketcount) + first->_totsize);
         }
-        delete[] (uchar*)node->_data;
+        if constexpr (HAS_ENTRIES) {
+            // the entries of other now lives in node
+            for (size_t i = 0; i < other->_count; ++i)
+                _entries->operator[](other->entries()[i])._node = node;
+        }
+        delete_bucket(node->_data, node->_capacity);
+        delete_bucket(other->_data, other->_capacity);
+        other->_data = nullptr;
+        other->_count = 0;
+        other->_totsize = 0;
+        other->_capacity = 0;
         node->_data = nbucket;
+        node->_capacity = ncapacity;
         node->_totsize = nbucketsize;
         node->_count = nbucketcount;
         return true;
@@ -1741,13 +3284,22 @@ namespace ptrie {
          * here.
          */
         assert(node->_count > 0);
-        assert(node->_parent != &_root);
-        auto parent = node->_parent;
-        node->_path = parent->_path;
-        assert(node->_path < WIDTH);
-        node->_parent = parent->_parent;
-        node->_type = BSIZE;
-        parent->_parent->_children[node->_path] = node;
+        assert(node->_parent != _top);
+        fwdnode_t* parent = node->_parent;
+        // a parent covering a run of levels only gives back the last one
+        const bool shrink = parent->_skip > 0;
+        if (shrink) {
+            node->_path = parent->_prefix[--parent->_skip];
+            node->_type = BSIZE;
+            set_children(parent, 0, WIDTH - 1, parent);
+            set_children(parent, node->_path, node->_path, node);
+        } else {
+            node->_path = parent->_path;
+            assert(node->_path < WIDTH);
+            node->_parent = parent->_parent;
+            node->_type = BSIZE;
+            set_children(parent->_parent, node->_path, node->_path, node);
+        }
 
         if((byte % BDIV) == 0)
         {
@@ -1771,7 +3323,7 @@ namespace ptrie {
                     nbucketsize = on_heap * node->_count;
                 }
 
-                uchar inject = parent->get_byte();
+                uchar inject = shrink ? node->_path : parent->get_byte();
                 inject_byte(node, inject, nbucketsize, [on_heap](size_t)
                 {
                     return on_heap;
@@ -1780,7 +3332,8 @@ namespace ptrie {
                 node->_totsize = nbucketsize;
             }
         }
-        delete parent;
+        if (!shrink)
+            delete_node(parent);
 
         merge_down(node, on_heap, data, byte - 1);
     }
@@ -1799,13 +3352,13 @@ namespace ptrie {
                 waiting.pop();
                 for(size_t i = 0; i < WIDTH; ++i)
                 {
-                    if(n->_children[i]->_type == 255 && n->_children[i] != n)
+                    if(n->child(i)->_type == 255 && n->child(i) != n)
                     {
-                        waiting.push((fwdnode_t*)n->_children[i]);
+                        waiting.push((fwdnode_t*)n->child(i));
                     }
 
-                    assert(n->_children[i] == n ||
-                           n->_children[n->_children[i]->_path] == n->_children[i]);
+                    assert(n->child(i) == n ||
+                           n->child(n->child(i)->_path) == n->child(i));
                 }
             }
         }
@@ -1818,16 +3371,14 @@ namespace ptrie {
         if(node->_count > SPLITBOUND / 3) return;
         uchar path = node->_path;
         __base_t* child;
-        auto parent = node->_parent;
+        fwdnode_t* parent = node->_parent;
         if(path & _masks[node->_type - 1])
         {
-            child = parent->_children[
-                     path & ~_masks[node->_type - 1]];
+            child = parent->child(path & ~_masks[node->_type - 1]);
         }
         else
         {
-            child = parent->_children[
-                    path | _masks[node->_type - 1]];
+            child = parent->child(path | _masks[node->_type - 1]);
         }
 
         assert(node != child);
@@ -1844,12 +3395,12 @@ namespace ptrie {
                 for(size_t i = node->_type; i < BSIZE; ++i) {
                     to = to | _masks[i];
                 }
+#ifndef NDEBUG
                 for(size_t i = from; i <= to; ++i)
-                {
-                    assert(node->_parent->_children[i] == node);
-                    node->_parent->_children[i] = node->_parent;
-                }
-                delete node;
+                    assert(node->_parent->child(i) == node);
+#endif
+                set_children(node->_parent, from, to, node->_parent);
+                delete_node(node);
             }
             else if(other->_count <= SPLITBOUND / 3)
             {
@@ -1866,22 +3417,18 @@ namespace ptrie {
                 {
                     if(child->_type == node->_type)
                     {
-                        for(auto& c : parent->_children)
-                            if(c == node)
-                                c = child;
+                        replace_children(parent, node, child);
                         child->_type -= 1;
                         child->_path &= ~_masks[node->_type - 1];
                         assert(child->_path < WIDTH);
-                        delete node;
+                        delete_node(node);
                         merge_down((node_t*)child, on_heap, data, byte);
                         return;
                     }
                     else
                     {
-                        for(auto& c : parent->_children)
-                            if(c == node)
-                                c = parent;
-                        delete node;
+                        replace_children(parent, node, parent);
+                        delete_node(node);
                         return;
                     }
                 }
@@ -1893,10 +3440,8 @@ namespace ptrie {
             } 
             else if(node->_count == 0) // && childe->_type == 255
             {
-                for(auto& c : parent->_children)
-                    if(c == node)
-                        c = parent;
-                delete node;
+                replace_children(parent, node, parent);
+                delete_node(node);
                 return;
             }
             uchar from = node->_path & ~_masks[node->_type - 1];
@@ -1910,8 +3455,8 @@ namespace ptrie {
                 if(child != node->_parent) return;
                 for(size_t i = from; i <= to; ++i)
                 {
-                    if( parent->_children[i] != child &&
-                        parent->_children[i] != node)
+                    if( parent->child(i) != child &&
+                        parent->child(i) != node)
                     {
                         return;
                     }
@@ -1922,12 +3467,14 @@ namespace ptrie {
             node->_path = from;
             assert(node->_path < WIDTH);
             
+#ifndef NDEBUG
             for(size_t i = from; i <= to; ++i)
-            {
-                assert(parent->_children[i] == child ||
-                   parent->_children[i] == node);
-                parent->_children[i] = node;
-            }
+                assert(parent->child(i) == child ||
+                   parent->child(i) == node);
+#endif
+            set_children(parent, from, to, node);
+            if(child->_type != 255)
+                delete_node((node_t*)child);
             merge_down(node, on_heap, data, byte);
         }
     }
@@ -1942,18 +3489,15 @@ namespace ptrie {
         {
             if(node->_count == 0)
             {
+                // node is gone after this
                 merge_empty(node, on_heap, data, byte);
             }
-            else if(node->_parent != &_root)
+            else if(node->_parent != _top)
             {
-                // we need to re-add path to items here.
+                // we need to re-add path to items here, continues merging
+                // from the parent.
                 readd_byte(node, on_heap, data, byte);
             }
-            if(node->_parent != &_root)
-            {
-                assert(node->_count > 0);
-                merge_down(node, on_heap, data, byte);
-            }
         }
         else
         {
@@ -1969,8 +3513,8 @@ namespace ptrie {
         // first find size and amount before
         uint16_t size = 0;
         uint16_t before = 0;
-        auto parent = node->_parent;
-        auto dist = parent->dist_to(&_root);
+        fwdnode_t* parent = node->_parent;
+        const size_t dist = FIXED_LENGTH != 0 ? TOPLEVEL : parent->dist_to(&_root);
         if (dist < BDIV)
         {
             for(size_t i = 0; i < bindex; ++i)
@@ -1996,58 +3540,93 @@ namespace ptrie {
             before = bytes(size) * bindex;
         }
 
+        if constexpr (HAS_ENTRIES)
+            release_id(node->entries()[bindex]);
+
         // got sizes, now we can remove data if we point to anything
         if(size >= HEAPBOUND)
         {
             assert(before + sizeof(size_t) <= node->_totsize);
             uchar* src = *((uchar**)&(node->data()[before]));
-            delete[] src;
+            delete_suffix(src, size);
             size = sizeof(size_t);
         }
 
+        if (_shared) {
+            // a copy without the key takes the place of the node, nothing
+            // is merged as that would change the nodes around it
+            if (node->_count == 1) {
+                set_children(parent, node->_path, last_slot(node), parent);
+                retire(node);
+                return;
+            }
+            node_t* copy = new_node<node_t>();
+            copy->_type = node->_type;
+            copy->_path = node->_path;
+            copy->_parent = parent;
+            copy->_count = node->_count - 1;
+            copy->_totsize = node->_totsize - size;
+            copy->_capacity = copy->_totsize + bucket_t::overhead(copy->_count);
+            copy->_data = new_bucket(copy->_capacity);
+            auto* firsts = node->first();
+            std::copy(firsts, firsts + bindex, copy->first());
+            std::copy(firsts + bindex + 1, firsts + node->_count, copy->first() + bindex);
+            if constexpr (HAS_ENTRIES) {
+                auto* ents = node->entries();
+                std::copy(ents, ents + bindex, copy->entries());
+                std::copy(ents + bindex + 1, ents + node->_count, copy->entries() + bindex);
+                for (size_t i = 0; i < copy->_count; ++i)
+                    (*_entries)[copy->entries()[i]]._node = copy;
+            }
+            std::copy(node->data(), node->data() + before, copy->data());
+            std::copy(node->data() + before + size, node->data() + node->_totsize, copy->data() + before);
+            set_children(parent, copy->_path, last_slot(copy), copy);
+            retire(node);
+            return;
+        }
+
         uint nbucketcount = node->_count - 1;
         if(nbucketcount > 0) {
             uint nbucketsize = node->_totsize - size;
 
-            bucket_t *nbucket = (bucket_t *) new uchar[nbucketsize +
-                                                    bucket_t::overhead(nbucketcount)];
+            // shift everything towards the front of the bucket, only give
+            // memory back if we are using less than half of the capacity.
+            bucket_t* obucket = node->_data;
+            bucket_t* nbucket = obucket;
+            uint32_t ncapacity = nbucketsize + bucket_t::overhead(nbucketcount);
+            if (ncapacity * 2 < node->_capacity) {
+                nbucket = new_bucket(ncapacity);
+            }
 
-            // copy over old "firsts", [0,bindex) to [0,bindex) then (bindex,node->_count) to [bindex, nbucketcount)
+            // move over old "firsts", [0,bindex) to [0,bindex) then (bindex,node->_count) to [bindex, nbucketcount)
             {
-                auto* src = node->first();
-                auto* mid = src + bindex;
-                auto* end = src + node->_count; 
-                auto* dest = &nbucket->first(nbucketcount); 
-                std::copy(node->first(), mid, dest);
-                std::copy(mid + 1, end, dest + bindex);
+                auto* src = &obucket->first(node->_count);
+                auto* dest = &nbucket->first(nbucketcount);
+                if (nbucket != obucket)
+                    std::memcpy(dest, src, bindex * sizeof(uint16_t));
+                std::memmove(dest + bindex, src + bindex + 1, (nbucketcount - bindex) * sizeof(uint16_t));
             }
 
             if constexpr (HAS_ENTRIES) {
-                // copy over entries
-                {
-                    auto* src = node->entries();
-                    auto* mid = src + bindex;
-                    auto* end = src + node->_count;
-                    auto* dest = node->_data->entries(node->_count);
-                    std::copy(src, mid, dest);
-                    std::copy(mid + 1, end, dest + bindex);
-                }
-
-                // copy back entries here in _entries!
-                // TODO fixme!
+                // move over entries
+                auto* src = obucket->entries(node->_count);
+                auto* dest = nbucket->entries(nbucketcount);
+                std::memmove(dest, src, bindex * sizeof(I));
+                std::memmove(dest + bindex, src + bindex + 1, (nbucketcount - bindex) * sizeof(I));
             }
 
-            // copy over old data
+            // move over old data
             if (nbucketsize > 0) {
-                auto* begin = node->data();
-                auto* mid = begin + before;
-                auto* end = node->data() + node->_totsize;
+                auto* src = obucket->data(node->_count);
                 auto* dest = nbucket->data(nbucketcount);
-                std::copy(begin, mid, dest);
-                std::copy(mid + size, end, dest + before);
+                std::memmove(dest, src, before);
+                std::memmove(dest + before, src + before + size, nbucketsize - before);
                 assert(nbucketsize >= before);
             }
-            delete[] (uchar*)node->_data;
+            if (nbucket != obucket) {
+                delete_bucket(obucket, node->_capacity);
+                node->_capacity = ncapacity;
+            }
             node->_data = nbucket;
             node->_count = nbucketcount;
             node->_totsize -= size;
@@ -2055,8 +3634,9 @@ namespace ptrie {
         }
         else
         {
-            delete[] (uchar*)node->_data;
+            delete_bucket(node->_data, node->_capacity);
             node->_data = nullptr;
+            node->_capacity = 0;
             node->_count = 0;
             node->_totsize = 0;
         }
@@ -2072,16 +3652,16 @@ namespace ptrie {
                 waiting.pop();
                 for(size_t i = 0; i < WIDTH; ++i)
                 {
-                    if(n->_children[i]->_type == 255 && n->_children[i] != n)
+                    if(n->child(i)->_type == 255 && n->child(i) != n)
                     {
-                        waiting.push((fwdnode_t*)n->_children[i]);
+                        waiting.push((fwdnode_t*)n->child(i));
                     }
-                    else if(n->_children[i]->_type <= BSIZE)
+                    else if(n->child(i)->_type <= BSIZE)
                     {
-                        assert(((node_t*)n->_children[i])->_count != 0);
+                        assert(((node_t*)n->child(i))->_count != 0);
                     }
-                    assert(n->_children[i] == n ||
-                           n->_children[n->_children[i]->_path] == n->_children[i]);
+                    assert(n->child(i) == n ||
+                           n->child(n->child(i)->_path) == n->child(i));
                 }
             }
         }
@@ -2094,11 +3674,12 @@ namespace ptrie {
     {
         const auto size = length*byte_iterator<KEY>::element_size();
         assert(size <= 65536);
+        assert(FIXED_LENGTH == 0 || length == FIXED_LENGTH);
         uint b_index = 0;
 
-        fwdnode_t* fwd = &_root;
+        fwdnode_t* fwd = _top;
         __base_t* base = nullptr;
-        uint p_byte = 0;
+        uint p_byte = TOPLEVEL;
 
         b_index = 0;
         bool res = best_match(data, size, &fwd, &base, p_byte, b_index);
@@ -2113,6 +3694,13 @@ namespace ptrie {
             onheap -= p_byte/BDIV;
 
             erase((node_t *) base, b_index, onheap, data, p_byte);
+            // shared readers keep their hints, no fwdnode is freed for them
+            if (!_shared)
+                ++_version;
+            if (_suffixes.needs_compaction())
+                compact_suffixes();
+            if (_shared)
+                collect();
             assert(!exists(data, length).first);
 
             return true;
@@ -2124,6 +3712,8 @@ namespace ptrie {
     {
         auto par = node->_parent;
         while (par && par->_parent != nullptr) {
+            for (size_t i = par->_skip; i > 0; --i)
+                path.push(par->_prefix[i - 1]);
             path.push(par->_path);
             par = par->_parent;
         }
@@ -2203,13 +3793,16 @@ namespace ptrie {
         }
 
 
+        // the bytes in first are padding if the key ends before the node
         if (ps > 0) {
             uchar* fc = (uchar*) & first;
             if (ps > 1) {
-                byte_iterator<KEY>::access(dest, pos) = fc[1];
+                if (pos < size)
+                    byte_iterator<KEY>::access(dest, pos) = fc[1];
                 ++pos;
             }
-            byte_iterator<KEY>::access(dest, pos) = fc[0];
+            if (pos < size)
+                byte_iterator<KEY>::access(dest, pos) = fc[0];
             ++pos;
         }        
     }
@@ -35,22 +35,36 @@ namespace ptrie {
     uint16_t SPLITBOUND = 128,
     uint8_t BSIZE = 8,
     size_t ALLOCSIZE = (1024 * 64),
-    typename I = size_t>
-    class map : private __set_stable<KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, T, I> {
+    typename I = size_t,
+    typename ALLOC = std::allocator<uchar>,
+    bool COMPRESSED = false,
+    uint16_t FIXED_LENGTH = 0>
+    class map : private __set_stable<KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, T, I, ALLOC, COMPRESSED, FIXED_LENGTH> {
         static_assert(!std::is_same<void, T>::value, "T (map-to-type) must not be void");
-        using pt = __set_stable<KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, T, I>;
+        using pt = __set_stable<KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, T, I, ALLOC, COMPRESSED, FIXED_LENGTH>;
         using entrylist_t = typename pt::entrylist_t;
     public:
         using typename pt::__set_stable;
         using pt::exists;
         using pt::erase;
+        using pt::exists_batch;
+        using pt::insert_batch;
+        using pt::build;
         using pt::unpack;
         using pt::insert;
         using pt::size;
+        using pt::recycle_ids;
+        using pt::use_filter;
+        using pt::shared_reads;
+        using pt::bucket_stats;
+        using pt::suffix_stats;
+        using pt::memory_usage;
+        using pt::compact;
         
         using node_t = typename pt::node_t;
         using fwdnode_t = typename pt::fwdnode_t;
         using typename pt::key_t; 
+        using typename pt::hint_t;
         static constexpr auto bsize = pt::bsize;
         static constexpr auto bdiv = pt::bdiv;
         static constexpr auto heapbound = HEAPBOUND;
@@ -59,19 +73,35 @@ namespace ptrie {
         const T& get_data(I index) const;
         T& operator[](KEY key)
         {
-            return get_data(pt::insert(key).second);
+            return try_emplace(&key, 1).first;
         }
         
         T& operator[](std::pair<KEY*, size_t> key)
         {
-            return get_data(pt::insert(key.first, key.second).second);
+            return try_emplace(key.first, key.second).first;
         }
 
         T& operator[](const std::vector<KEY>& key)
         {
-            return get_data(pt::insert(key.data(), key.size()).second);
+            return try_emplace(key.data(), key.size()).first;
         }
 
+        // the value of the key and whether the key was inserted, in which
+        // case the value is constructed from args in place. As with
+        // std::map::try_emplace nothing is constructed for a key already
+        // there. Should the constructor throw, the key stays with a
+        // default-constructed value.
+        template<typename... Args>
+        std::pair<T&, bool> try_emplace(const KEY* data, size_t length, Args&&... args);
+        template<typename... Args>
+        std::pair<T&, bool> try_emplace(const std::vector<KEY>& key, Args&&... args)
+        {
+            return try_emplace(key.data(), key.size(), std::forward<Args>(args)...);
+        }
+        // as try_emplace, with the id of the key in place of the flag
+        template<typename... Args>
+        std::pair<T&, returntype_t> try_emplace_id(const KEY* data, size_t length, Args&&... args);
+
         class iterator : public __iterator<map, iterator>
         {
         public:
@@ -107,9 +137,12 @@ namespace ptrie {
     uint16_t SPLITBOUND,
     uint8_t BSIZE,
     size_t ALLOCSIZE,
-    typename I>
+    typename I,
+    typename ALLOC,
+    bool COMPRESSED,
+    uint16_t FIXED_LENGTH>
     T&
-    map<KEY, T, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, I>::get_data(I index) {
+    map<KEY, T, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, I, ALLOC, COMPRESSED, FIXED_LENGTH>::get_data(I index) {
         typename pt::entry_t& ent = this->_entries->operator[](index);
         return ent._data;
     }
@@ -120,9 +153,61 @@ namespace ptrie {
             uint16_t SPLITBOUND,
             uint8_t BSIZE,
             size_t ALLOCSIZE,
-            typename I>
+            typename I,
+            typename ALLOC,
+            bool COMPRESSED,
+            uint16_t FIXED_LENGTH>
+    template<typename... Args>
+    std::pair<T&, bool>
+    map<KEY, T, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, I, ALLOC, COMPRESSED, FIXED_LENGTH>::try_emplace(const KEY* data, size_t length, Args&&... args) {
+        auto res = try_emplace_id(data, length, std::forward<Args>(args)...);
+        return std::pair<T&, bool>(res.first, res.second.first);
+    }
+    template<
+            typename KEY,
+            typename T,
+            uint16_t HEAPBOUND,
+            uint16_t SPLITBOUND,
+            uint8_t BSIZE,
+            size_t ALLOCSIZE,
+            typename I,
+            typename ALLOC,
+            bool COMPRESSED,
+            uint16_t FIXED_LENGTH>
+    template<typename... Args>
+    std::pair<T&, returntype_t>
+    map<KEY, T, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, I, ALLOC, COMPRESSED, FIXED_LENGTH>::try_emplace_id(const KEY* data, size_t length, Args&&... args) {
+        // the entry comes back from insert, so the entries are only indexed once
+        typename pt::entry_t* ent = nullptr;
+        // an inserted key takes an erased id when there is one, which still
+        // holds the erased value, a new id only has zeroed storage
+        const bool reused = this->reuses_id(0);
+        const auto res = pt::insert(nullptr, data, length, &ent);
+        if (res.first) {
+            if (reused)
+                std::destroy_at(&ent->_data);
+            try {
+                std::construct_at(&ent->_data, std::forward<Args>(args)...);
+            } catch (...) {
+                std::construct_at(&ent->_data);
+                throw;
+            }
+        }
+        return std::pair<T&, returntype_t>(ent->_data, res);
+    }
+    template<
+            typename KEY,
+            typename T,
+            uint16_t HEAPBOUND,
+            uint16_t SPLITBOUND,
+            uint8_t BSIZE,
+            size_t ALLOCSIZE,
+            typename I,
+            typename ALLOC,
+            bool COMPRESSED,
+            uint16_t FIXED_LENGTH>
     const T&
-    map<KEY, T, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, I>::get_data(I index) const {
+    map<KEY, T, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, I, ALLOC, COMPRESSED, FIXED_LENGTH>::get_data(I index) const {
         const typename pt::entry_t& ent = this->_entries->operator[](index);
         return ent._data;
     }
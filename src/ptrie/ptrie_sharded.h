@@ -0,0 +1,368 @@
+/*
+ * Copyright Peter G. Jensen <root@petergjoel.dk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * File:   ptrie_sharded.h
+ * Author: Peter G. Jensen
+ *
+ * A set and a map for threads to share, split over SHARDS independent
+ * tries picked by a route.
+ */
+
+#ifndef PTRIE_SHARDED_H
+#define PTRIE_SHARDED_H
+#include "ptrie_stable.h"
+#include "ptrie_map.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+namespace ptrie {
+
+    // Routes for the keys of the tries below: each one maps a key to one of
+    // n tries.
+
+    // the length and the first LEVELS bytes, the path of the key down to
+    // the fwdnode its subtree hangs from in a single trie
+    template<size_t LEVELS>
+    struct route_prefix {
+        template<typename KEY>
+        size_t operator()(const KEY* data, size_t length, size_t n) const {
+            const size_t size = length * byte_iterator<KEY>::element_size();
+            uint64_t h = size;
+            for (size_t i = 0; i < std::min(size, LEVELS); ++i)
+                h = h * 257 + byte_iterator<KEY>::const_access(data, i);
+            return ((h * 0x9e3779b97f4a7c15ULL) >> 32) % n;
+        }
+    };
+
+    // every byte of the key, for keys sharing long prefixes
+    struct route_hash {
+        template<typename KEY>
+        size_t operator()(const KEY* data, size_t length, size_t n) const {
+            const size_t size = length * byte_iterator<KEY>::element_size();
+            uint64_t h = 0xcbf29ce484222325ULL ^ size;
+            for (size_t i = 0; i < size; ++i)
+                h = (h ^ byte_iterator<KEY>::const_access(data, i)) * 0x100000001b3ULL;
+            return ((h * 0x9e3779b97f4a7c15ULL) >> 32) % n;
+        }
+    };
+
+    // COUNT bytes from FIRST read as a number, bytes past the end of the
+    // key reading as 0, cut into n equal ranges. Keys close in those bytes
+    // stay together, at the price of an uneven spread when they are not.
+    template<size_t FIRST, size_t COUNT = 1>
+    struct route_bytes {
+        static_assert(COUNT > 0 && COUNT <= 4, "COUNT must be between 1 and 4");
+        template<typename KEY>
+        size_t operator()(const KEY* data, size_t length, size_t n) const {
+            const size_t size = length * byte_iterator<KEY>::element_size();
+            uint64_t v = 0;
+            for (size_t i = FIRST; i < FIRST + COUNT; ++i)
+                v = (v << 8) | (i < size ? byte_iterator<KEY>::const_access(data, i) : 0);
+            return (v * n) >> (8 * COUNT);
+        }
+    };
+
+    // Tries of PT with the keys split over them by ROUTE, each with its own
+    // nodes, pools and entries, behind a latch taken shared by exists and
+    // exclusive by insert and erase. Threads working in different shards
+    // never wait for each other, and readers of a shard only wait for its
+    // writers.
+    //
+    // There is no latch per node or per fwdnode slot inside one trie: the
+    // bucket pool, the suffix arena, the entries, the filter and the version
+    // counter belong to the whole trie, so every insert and split would still
+    // serialize on them, and the latches would have to be taken on the
+    // single-threaded path as well.
+    template<typename KEY, typename PT, size_t SHARDS, typename ROUTE>
+    class __sharded {
+        static_assert(SHARDS > 0, "SHARDS must be positive");
+    public:
+        using key_t = KEY;
+    protected:
+        struct alignas(64) shard_t {
+            mutable std::shared_mutex _latch;
+            PT _trie;
+        };
+        std::unique_ptr<shard_t[]> _shards = std::make_unique<shard_t[]>(SHARDS);
+
+        static size_t shard(const key_t* data, size_t length) {
+            const size_t s = ROUTE()(data, length, SHARDS);
+            assert(s < SHARDS);
+            return s;
+        }
+
+        template<typename F>
+        void for_each_shard(F&& f) {
+            for (size_t s = 0; s < SHARDS; ++s) {
+                std::unique_lock lock(_shards[s]._latch);
+                f(_shards[s]._trie);
+            }
+        }
+
+        template<typename F>
+        void for_each_shard(F&& f) const {
+            for (size_t s = 0; s < SHARDS; ++s) {
+                std::shared_lock lock(_shards[s]._latch);
+                f(_shards[s]._trie);
+            }
+        }
+        using trie_iterator = decltype(std::declval<const PT&>().begin());
+    public:
+        static constexpr size_t shards = SHARDS;
+
+        // Walks the elements of all shards in the order of the iterators
+        // of a single trie, shorter keys first and then byte by byte, by
+        // merging the iterators of the shards. Takes no latches, so no
+        // thread may write while it is in use.
+        class iterator {
+            struct cursor_t {
+                trie_iterator _it, _end;
+                std::vector<KEY> _key;
+                size_t _shard;
+            };
+            // the iterators of maps cannot be assigned, so the heap orders
+            // indices into the cursors rather than the cursors
+            std::vector<cursor_t> _cursors;
+            std::vector<uint32_t> _heap;
+
+            static bool before(const std::vector<KEY>& a, const std::vector<KEY>& b) {
+                if (a.size() != b.size()) return a.size() < b.size();
+                const size_t size = a.size() * byte_iterator<KEY>::element_size();
+                for (size_t i = 0; i < size; ++i) {
+                    const auto x = byte_iterator<KEY>::const_access(a.data(), i);
+                    const auto y = byte_iterator<KEY>::const_access(b.data(), i);
+                    if (x != y) return x < y;
+                }
+                return false;
+            }
+            // the heap keeps the first key at the front
+            auto after() const {
+                return [this](uint32_t a, uint32_t b) { return before(_cursors[b]._key, _cursors[a]._key); };
+            }
+
+            const cursor_t& top() const { assert(!_heap.empty()); return _cursors[_heap.front()]; }
+        public:
+            iterator() = default;
+            explicit iterator(const __sharded& con) {
+                for (size_t s = 0; s < SHARDS; ++s) {
+                    const PT& t = con._shards[s]._trie;
+                    if (t.begin() == t.end()) continue;
+                    _cursors.push_back(cursor_t{t.begin(), t.end(), {}, s});
+                    _cursors.back()._it.unpack(_cursors.back()._key);
+                    _heap.push_back(_cursors.size() - 1);
+                }
+                std::make_heap(_heap.begin(), _heap.end(), after());
+            }
+
+            bool operator==(const iterator& other) const {
+                if (_heap.size() != other._heap.size()) return false;
+                return _heap.empty() ||
+                    (top()._shard == other.top()._shard && top()._it == other.top()._it);
+            }
+            bool operator!=(const iterator& other) const { return !(*this == other); }
+
+            iterator& operator++() {
+                std::pop_heap(_heap.begin(), _heap.end(), after());
+                auto& c = _cursors[_heap.back()];
+                ++c._it;
+                if (c._it == c._end)
+                    _heap.pop_back();
+                else {
+                    c._it.unpack(c._key);
+                    std::push_heap(_heap.begin(), _heap.end(), after());
+                }
+                return *this;
+            }
+            iterator operator++(int) {
+                auto cpy = *this;
+                ++(*this);
+                return cpy;
+            }
+
+            const std::vector<KEY>& unpack() const { return top()._key; }
+            size_t shard() const { return top()._shard; }
+            // the id of the element, for shards with ids
+            auto index() const { return top()._it.index() * SHARDS + top()._shard; }
+            // the value of the element, for shards that are maps
+            decltype(auto) operator*() const { return *top()._it; }
+        };
+
+        iterator begin() const { return iterator(*this); }
+        iterator end() const { return iterator(); }
+
+        bool erase(const key_t* data, size_t length) {
+            auto& st = _shards[shard(data, length)];
+            std::unique_lock lock(st._latch);
+            return st._trie.erase(data, length);
+        }
+        bool erase(const std::vector<key_t>& data) { return erase(data.data(), data.size()); }
+
+        // the sum over the shards, each one is consistent but they are
+        // not taken at the same time when other threads keep writing
+        memory_usage_t memory_usage() const {
+            memory_usage_t usage;
+            for_each_shard([&](const PT& t) { usage += t.memory_usage(); });
+            return usage;
+        }
+        void compact() { for_each_shard([](PT& t) { t.compact(); }); }
+        void use_filter(bool enable = true) { for_each_shard([enable](PT& t) { t.use_filter(enable); }); }
+    };
+
+    // The id of an element is the id within its shard times SHARDS plus
+    // the shard, so ids stay stable and unique across the shards.
+    template<typename KEY, typename I, typename PT, size_t SHARDS, typename ROUTE>
+    class __sharded_stable : public __sharded<KEY, PT, SHARDS, ROUTE> {
+        using pt = __sharded<KEY, PT, SHARDS, ROUTE>;
+    protected:
+        static returntype_t global(returntype_t res, size_t s) {
+            if (res.second != std::numeric_limits<size_t>::max())
+                res.second = res.second * SHARDS + s;
+            return res;
+        }
+    public:
+        __sharded_stable() = default;
+        // every shard hands out ids to threads threads, see PT::insert
+        explicit __sharded_stable(size_t threads) {
+            for (size_t s = 0; s < SHARDS; ++s)
+                this->_shards[s]._trie = PT(threads);
+        }
+
+        returntype_t insert(const KEY* data, size_t length, size_t thread = 0) {
+            const size_t s = pt::shard(data, length);
+            auto& st = this->_shards[s];
+            std::unique_lock lock(st._latch);
+            return global(st._trie.insert(data, length, thread), s);
+        }
+        returntype_t insert(const std::vector<KEY>& data, size_t thread = 0) { return insert(data.data(), data.size(), thread); }
+
+        returntype_t exists(const KEY* data, size_t length) const {
+            const size_t s = pt::shard(data, length);
+            auto& st = this->_shards[s];
+            std::shared_lock lock(st._latch);
+            return global(st._trie.exists(data, length), s);
+        }
+        returntype_t exists(const std::vector<KEY>& data) const { return exists(data.data(), data.size()); }
+
+        std::vector<KEY> unpack(I index) const {
+            auto& st = this->_shards[index % SHARDS];
+            std::shared_lock lock(st._latch);
+            return st._trie.unpack(index / SHARDS);
+        }
+
+        size_t unpack(I index, KEY* destination) const {
+            auto& st = this->_shards[index % SHARDS];
+            std::shared_lock lock(st._latch);
+            return st._trie.unpack(index / SHARDS, destination);
+        }
+
+        // the shard an id belongs to
+        static size_t shard_of(I index) { return index % SHARDS; }
+
+        // the number of elements, erased ones are not counted
+        size_t size() const {
+            size_t n = 0;
+            this->for_each_shard([&](const auto& t) { n += t.size(); });
+            return n;
+        }
+    };
+
+    // route_hash spreads keys evenly, route_bytes keeps ranges of keys in
+    // the same shard and route_prefix keeps the keys of a subtree of a single
+    // trie together. Ids encode the shard as id % SHARDS.
+    template<
+    typename KEY = uchar,
+    typename I = size_t,
+    size_t SHARDS = 16,
+    typename ROUTE = route_hash,
+    uint16_t HEAPBOUND = 17,
+    uint16_t SPLITBOUND = 128,
+    uint8_t BSIZE = 8,
+    size_t ALLOCSIZE = (1024 * 64),
+    typename ALLOC = std::allocator<uchar>
+    >
+    class sharded_set : public __sharded_stable<KEY, I, set_stable<KEY, I, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, ALLOC>, SHARDS, ROUTE> {
+        using pt = __sharded_stable<KEY, I, set_stable<KEY, I, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, ALLOC>, SHARDS, ROUTE>;
+    public:
+        using pt::__sharded_stable;
+    };
+
+    // The values are only handed out under the latch of their shard, to the
+    // functions given to update and visit.
+    template<
+    typename KEY,
+    typename T,
+    typename I = size_t,
+    size_t SHARDS = 16,
+    typename ROUTE = route_hash,
+    uint16_t HEAPBOUND = 17,
+    uint16_t SPLITBOUND = 128,
+    uint8_t BSIZE = 8,
+    size_t ALLOCSIZE = (1024 * 64),
+    typename ALLOC = std::allocator<uchar>
+    >
+    class sharded_map : public __sharded_stable<KEY, I, map<KEY, T, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, I, ALLOC>, SHARDS, ROUTE> {
+        using pt = __sharded_stable<KEY, I, map<KEY, T, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, I, ALLOC>, SHARDS, ROUTE>;
+    public:
+        using pt::__sharded_stable;
+
+        // as map::try_emplace, with the id in place of the value
+        template<typename... Args>
+        returntype_t try_emplace(const KEY* data, size_t length, Args&&... args) {
+            const size_t s = pt::shard(data, length);
+            auto& st = this->_shards[s];
+            std::unique_lock lock(st._latch);
+            return pt::global(st._trie.try_emplace_id(data, length, std::forward<Args>(args)...).second, s);
+        }
+        template<typename... Args>
+        returntype_t try_emplace(const std::vector<KEY>& data, Args&&... args) {
+            return try_emplace(data.data(), data.size(), std::forward<Args>(args)...);
+        }
+
+        // inserts the key with a value-initialized value when it is not
+        // there and calls f with its value
+        template<typename F>
+        returntype_t update(const KEY* data, size_t length, F&& f) {
+            const size_t s = pt::shard(data, length);
+            auto& st = this->_shards[s];
+            std::unique_lock lock(st._latch);
+            auto res = st._trie.try_emplace_id(data, length);
+            f(res.first);
+            return pt::global(res.second, s);
+        }
+        template<typename F>
+        returntype_t update(const std::vector<KEY>& data, F&& f) { return update(data.data(), data.size(), std::forward<F>(f)); }
+
+        // calls f with the value of the key, if the key is there
+        template<typename F>
+        bool visit(const KEY* data, size_t length, F&& f) const {
+            auto& st = this->_shards[pt::shard(data, length)];
+            std::shared_lock lock(st._latch);
+            auto res = st._trie.exists(data, length);
+            if (res.first) f(st._trie.get_data(res.second));
+            return res.first;
+        }
+        template<typename F>
+        bool visit(const std::vector<KEY>& data, F&& f) const { return visit(data.data(), data.size(), std::forward<F>(f)); }
+    };
+}
+
+#endif /* PTRIE_SHARDED_H */
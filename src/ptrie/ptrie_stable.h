@@ -30,8 +30,8 @@
 
 namespace ptrie {
 
-    #define SPTRIETPL typename KEY, uint16_t HEAPBOUND, uint16_t SPLITBOUND, uint8_t BSIZE, size_t ALLOCSIZE, typename T, typename I
-    #define SPTRIETPLA KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, T, I
+    #define SPTRIETPL typename KEY, uint16_t HEAPBOUND, uint16_t SPLITBOUND, uint8_t BSIZE, size_t ALLOCSIZE, typename T, typename I, typename ALLOC, bool COMPRESSED, uint16_t FIXED_LENGTH
+    #define SPTRIETPLA KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, T, I, ALLOC, COMPRESSED, FIXED_LENGTH
     template<
     typename KEY = unsigned char,
     uint16_t HEAPBOUND = 17,
@@ -39,27 +39,35 @@ namespace ptrie {
     uint8_t BSIZE = 8,
     size_t ALLOCSIZE = (1024 * 64),
     typename T = void,
-    typename I = size_t
+    typename I = size_t,
+    typename ALLOC = std::allocator<uchar>,
+    bool COMPRESSED = false,
+    uint16_t FIXED_LENGTH = 0
     >
-    class __set_stable : protected __ptrie<KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, T, I, true> {
-        using pt = __ptrie<KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, T, I, true>;
+    class __set_stable : protected __ptrie<KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, T, I, true, ALLOC, COMPRESSED, FIXED_LENGTH> {
+        using pt = __ptrie<KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, T, I, true, ALLOC, COMPRESSED, FIXED_LENGTH>;
         static_assert(std::is_integral<I>::value, "I (index-type) must be an integral");
     public:
         using typename pt::__ptrie;
         using pt::insert;
         using pt::exists;
         using pt::erase;
+        using pt::exists_batch;
+        using pt::insert_batch;
+        using pt::build;
 
         using node_t = typename pt::node_t;
         using fwdnode_t = typename pt::fwdnode_t;
         using typename pt::key_t; 
+        using typename pt::hint_t;
 
         static constexpr auto bsize = pt::bsize;
         static constexpr auto bdiv = pt::bdiv;
         static constexpr auto heapbound = HEAPBOUND;
         
+        // the number of elements, erased ones are not counted
         size_t size() const {
-            return this->_entries->size();
+            return this->_entries->size() - this->_dead;
         }
 
         size_t unpack(I index, KEY* destination) const;
@@ -144,19 +152,33 @@ namespace ptrie {
     uint16_t HEAPBOUND = 17,
     uint16_t SPLITBOUND = 128,
     uint8_t BSIZE = 8,
-    size_t ALLOCSIZE = (1024 * 64)
+    size_t ALLOCSIZE = (1024 * 64),
+    typename ALLOC = std::allocator<uchar>,
+    bool COMPRESSED = false,
+    uint16_t FIXED_LENGTH = 0
     >
-    class set_stable : private __set_stable<KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, void, I>
+    class set_stable : private __set_stable<KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, void, I, ALLOC, COMPRESSED, FIXED_LENGTH>
     {
-        using pt = __set_stable<KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, void, I>;
+        using pt = __set_stable<KEY, HEAPBOUND, SPLITBOUND, BSIZE, ALLOCSIZE, void, I, ALLOC, COMPRESSED, FIXED_LENGTH>;
         using iterator = typename pt::siterator;
         public:
-            using typename pt::__ptrie;
+            using typename pt::__set_stable;
             using pt::insert;
             using pt::exists;
             using pt::erase;
+            using pt::exists_batch;
+            using pt::insert_batch;
+            using pt::build;
             using pt::unpack;
             using pt::size;
+            using pt::recycle_ids;
+            using pt::use_filter;
+            using pt::shared_reads;
+            using pt::bucket_stats;
+            using pt::suffix_stats;
+            using pt::memory_usage;
+            using pt::compact;
+            using typename pt::hint_t;
             
             iterator begin() const { return ++iterator(&this->_root, 0); }
             iterator end()   const { return iterator(&this->_root, 256); }
@@ -0,0 +1,89 @@
+/*
+ * Copyright Peter G. Jensen <root@petergjoel.dk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * File:   region_table.h
+ * Author: Peter G. Jensen
+ *
+ * Process-wide table behind the 32-bit references of compressed tries.
+ */
+#include <stdint.h>
+#include <assert.h>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#ifndef REGION_TABLE_H
+#define REGION_TABLE_H
+
+namespace ptrie {
+
+    // A handle names a 16 byte unit inside a registered region of at most
+    // 64KB: the upper 20 bits select the region, the lower 12 the unit. The
+    // table is shared by all tries so a handle can be resolved without
+    // knowing which trie it belongs to, which the iterators rely on.
+    // Region 0 is never handed out and maps to nullptr, so handle 0 is null.
+    // In total 2^20 regions of 64KB, or 64GB, can be registered at a time.
+    class region_table_t {
+    public:
+        static constexpr size_t UNIT = 16;
+        static constexpr size_t UNITBITS = 12;
+        static constexpr size_t REGIONSIZE = UNIT << UNITBITS;
+        static constexpr size_t REGIONS = size_t{1} << (32 - UNITBITS);
+    private:
+        inline static unsigned char* _base[REGIONS] = {};
+        inline static std::mutex _lock;
+        inline static std::vector<uint32_t> _released;
+        inline static uint32_t _next = 1;
+    public:
+        // registers the region starting at base, returns its number
+        static uint32_t add(void* base) {
+            assert(reinterpret_cast<uintptr_t>(base) % UNIT == 0);
+            std::lock_guard<std::mutex> guard(_lock);
+            uint32_t region;
+            if (!_released.empty()) {
+                region = _released.back();
+                _released.pop_back();
+            } else if (_next < REGIONS) {
+                region = _next++;
+            } else {
+                throw std::bad_alloc();
+            }
+            _base[region] = static_cast<unsigned char*>(base);
+            return region;
+        }
+
+        static void remove(uint32_t region) {
+            assert(region != 0 && region < REGIONS);
+            std::lock_guard<std::mutex> guard(_lock);
+            _base[region] = nullptr;
+            _released.push_back(region);
+        }
+
+        static uint32_t handle(uint32_t region, const void* base, const void* ptr) {
+            const size_t offset = static_cast<const unsigned char*>(ptr) - static_cast<const unsigned char*>(base);
+            assert(offset % UNIT == 0 && offset < REGIONSIZE);
+            return (region << UNITBITS) | (offset / UNIT);
+        }
+
+        static void* resolve(uint32_t handle) {
+            return _base[handle >> UNITBITS] + (handle & ((1u << UNITBITS) - 1)) * UNIT;
+        }
+    };
+}
+
+#endif /* REGION_TABLE_H */
@@ -0,0 +1,161 @@
+/*
+ * Copyright Peter G. Jensen <root@petergjoel.dk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * File:   suffix_arena.h
+ * Author: Peter G. Jensen
+ *
+ * Append-only arena for the key suffixes a ptrie keeps outside its buckets.
+ */
+#include <stdint.h>
+#include <assert.h>
+#include <algorithm>
+#include <memory>
+#include <utility>
+
+#include "bucket_pool.h"
+
+#ifndef SUFFIX_ARENA_H
+#define SUFFIX_ARENA_H
+
+namespace ptrie {
+
+    // Suffixes are written once and only freed or replaced as a whole, so
+    // they are bump-allocated from chunks. Freeing only counts the bytes as
+    // dead, the owner reclaims them by copying the live suffixes into a fresh
+    // arena once needs_compaction() says so.
+    template<typename ALLOC>
+    class suffix_arena_t {
+    public:
+        static constexpr size_t CHUNKSIZE = 1024 * 64;
+    private:
+        static constexpr size_t FIRSTCHUNK = 1024 * 4;
+        // chunks keep growing up to the chunk_size the allocator asks for
+        static constexpr size_t MAXCHUNK = std::max(CHUNKSIZE, __chunk_size<ALLOC>::value);
+
+        using word_alloc_t = typename std::allocator_traits<ALLOC>::template rebind_alloc<size_t>;
+        using traits = std::allocator_traits<word_alloc_t>;
+
+        struct chunk_t {
+            chunk_t* _next;
+            size_t _words;
+        };
+
+        [[no_unique_address]] word_alloc_t _alloc;
+        chunk_t* _chunks = nullptr;
+        unsigned char* _cursor = nullptr;
+        unsigned char* _end = nullptr;
+        size_t _next_chunk = FIRSTCHUNK;
+        pool_stats_t _stats;
+
+        static constexpr size_t words(size_t bytes) {
+            return (bytes + sizeof(size_t) - 1) / sizeof(size_t);
+        }
+
+        void new_chunk(size_t bytes);
+    public:
+        explicit suffix_arena_t(const ALLOC& alloc = ALLOC()) : _alloc(alloc) {}
+        suffix_arena_t(const suffix_arena_t&) = delete;
+        suffix_arena_t& operator=(const suffix_arena_t&) = delete;
+        ~suffix_arena_t() { release(); }
+
+        unsigned char* allocate(size_t bytes) {
+            if ((size_t)(_end - _cursor) < bytes)
+                new_chunk(bytes);
+            auto* suffix = _cursor;
+            _cursor += bytes;
+            _stats._live += bytes;
+            return suffix;
+        }
+
+        void deallocate(unsigned char*, size_t bytes) {
+            assert(_stats._live >= bytes);
+            _stats._live -= bytes;
+            _stats._free += bytes;
+        }
+
+        // more than half of the arena is dead and it is worth a copy
+        bool needs_compaction() const {
+            return _stats._free >= CHUNKSIZE && _stats._free > _stats._live;
+        }
+
+        // returns all chunks to the allocator, invalidates every suffix
+        void release();
+        void swap(suffix_arena_t& other);
+
+        // hands the chunks over to the caller, who may still read the
+        // suffixes in them until they are given to free_chunks
+        void* detach() {
+            auto* chunks = _chunks;
+            _chunks = nullptr;
+            release();
+            return chunks;
+        }
+        void free_chunks(void* chunks);
+
+        // _free holds the dead bytes, the unused tail of the chunks is the rest
+        const pool_stats_t& stats() const { return _stats; }
+    };
+
+    template<typename ALLOC>
+    void suffix_arena_t<ALLOC>::new_chunk(size_t bytes)
+    {
+        // the tail of the current chunk is left unused
+        const size_t size = std::max(_next_chunk, bytes + sizeof(chunk_t));
+        auto* chunk = reinterpret_cast<chunk_t*>(traits::allocate(_alloc, words(size)));
+        chunk->_next = _chunks;
+        chunk->_words = words(size);
+        _chunks = chunk;
+        _cursor = reinterpret_cast<unsigned char*>(chunk + 1);
+        _end = reinterpret_cast<unsigned char*>(chunk) + chunk->_words * sizeof(size_t);
+        _stats._reserved += chunk->_words * sizeof(size_t);
+        _next_chunk = std::min(_next_chunk * 2, MAXCHUNK);
+    }
+
+    template<typename ALLOC>
+    void suffix_arena_t<ALLOC>::release()
+    {
+        free_chunks(_chunks);
+        _chunks = nullptr;
+        _cursor = _end = nullptr;
+        _next_chunk = FIRSTCHUNK;
+        _stats = pool_stats_t{};
+    }
+
+    template<typename ALLOC>
+    void suffix_arena_t<ALLOC>::free_chunks(void* chunks)
+    {
+        auto* chunk = static_cast<chunk_t*>(chunks);
+        while (chunk != nullptr) {
+            auto* next = chunk->_next;
+            traits::deallocate(_alloc, reinterpret_cast<size_t*>(chunk), chunk->_words);
+            chunk = next;
+        }
+    }
+
+    template<typename ALLOC>
+    void suffix_arena_t<ALLOC>::swap(suffix_arena_t& other)
+    {
+        std::swap(_chunks, other._chunks);
+        std::swap(_cursor, other._cursor);
+        std::swap(_end, other._end);
+        std::swap(_next_chunk, other._next_chunk);
+        std::swap(_stats, other._stats);
+    }
+}
+
+#endif /* SUFFIX_ARENA_H */
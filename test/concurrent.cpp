@@ -0,0 +1,637 @@
+/*
+ * Copyright Peter G. Jensen <root@petergjoel.dk>
+ *  
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define BOOST_TEST_MODULE PTrieConcurrent
+#include <boost/test/unit_test.hpp>
+#include <ptrie/ptrie_sharded.h>
+#include <ptrie/ptrie_stable.h>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "utils.h"
+
+using namespace ptrie;
+using namespace std;
+
+constexpr size_t THREADS = 8;
+
+// Boost.Test assertions are not thread-safe, the threads count their
+// failures and the test checks the counts once they are joined
+template<typename F>
+void in_parallel(F f)
+{
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < THREADS; ++t)
+        threads.emplace_back(f, t);
+    for(auto& t : threads)
+        t.join();
+}
+
+// calls f(i) for every i below n from two of the threads
+template<typename F>
+void in_parallel_twice(size_t n, F f)
+{
+    in_parallel([&](size_t t) {
+        for(size_t i = 0; i < n; ++i)
+            if(i % THREADS == t || (i + 1) % THREADS == t)
+                f(i);
+    });
+}
+
+std::vector<std::vector<unsigned char>> make_keys(size_t n, size_t maxsize, size_t seed = 0, size_t minsize = sizeof(size_t))
+{
+    std::mt19937_64 gen(seed);
+    std::vector<std::vector<unsigned char>> keys(n);
+    for(size_t i = 0; i < n; ++i)
+    {
+        keys[i].resize(minsize + gen() % (maxsize - minsize + 1));
+        for(auto& b : keys[i]) b = gen();
+        size_t unique = seed * n + i;
+        memcpy(keys[i].data() + keys[i].size() - sizeof(size_t), &unique, sizeof(size_t));
+    }
+    return keys;
+}
+
+std::vector<std::pair<const unsigned char*, size_t>> as_spans(const std::vector<std::vector<unsigned char>>& keys)
+{
+    std::vector<std::pair<const unsigned char*, size_t>> spans;
+    for(auto& k : keys)
+        spans.emplace_back(k.data(), k.size());
+    return spans;
+}
+
+// runs reader(gen, inserted) in all but one thread until writer(inserted) is
+// done, the writer tells the readers how many keys it has added so far
+template<typename R, typename W>
+void with_readers(R reader, W writer)
+{
+    std::atomic<size_t> inserted = 0;
+    std::atomic<bool> stop = false;
+    std::vector<std::thread> readers;
+    for(size_t t = 0; t < THREADS - 1; ++t)
+    {
+        readers.emplace_back([&, t] {
+            std::mt19937_64 gen(t);
+            while(!stop)
+                reader(gen, inserted.load());
+        });
+    }
+    writer(inserted);
+    stop = true;
+    for(auto& r : readers)
+        r.join();
+}
+
+// walks both in order and checks they hold the same keys
+template<typename T, typename S>
+void same_keys(T& set, S& single)
+{
+    auto it = set.begin();
+    for(auto sit = single.begin(); sit != single.end(); ++sit, ++it)
+    {
+        BOOST_REQUIRE(it != set.end());
+        BOOST_REQUIRE(it.unpack() == sit.unpack());
+    }
+    BOOST_REQUIRE(it == set.end());
+}
+
+BOOST_AUTO_TEST_CASE(ConcurrentInsert)
+{
+    std::cerr << "ConcurrentInsert" << std::endl;
+    sharded_set<> set;
+    auto keys = make_keys(40000, 40);
+    // every key is inserted by two threads, exactly one of them adds it
+    std::atomic<size_t> added = 0, missing = 0;
+    in_parallel_twice(keys.size(), [&](size_t i) {
+        added += set.insert(keys[i]).first;
+        missing += !set.exists(keys[i]).first;
+    });
+    BOOST_CHECK_EQUAL(added, keys.size());
+    BOOST_CHECK_EQUAL(missing, 0);
+    for(auto& key : keys)
+    {
+        BOOST_REQUIRE(set.exists(key).first);
+        BOOST_REQUIRE(!set.insert(key).first);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ConcurrentReadWrite)
+{
+    std::cerr << "ConcurrentReadWrite" << std::endl;
+    sharded_set<uchar, size_t, 16, route_prefix<2>> set;
+    auto keys = make_keys(20000, 20);
+    auto others = make_keys(20000, 20, 1);
+    for(size_t i = 0; i < keys.size(); i += 2)
+        set.insert(keys[i]);
+    // half the threads erase the even keys and add the odd ones while the
+    // others keep looking up keys that are never inserted
+    std::atomic<size_t> failed = 0;
+    in_parallel([&](size_t t) {
+        for(size_t i = 0; i < keys.size(); ++i)
+        {
+            if(t % 2 == 0)
+            {
+                if(i % (THREADS / 2) != t / 2) continue;
+                if(i % 2 == 0)
+                    failed += !set.erase(keys[i]);
+                else
+                    failed += !set.insert(keys[i]).first;
+            }
+            else
+                failed += set.exists(others[i]).first;
+        }
+    });
+    BOOST_CHECK_EQUAL(failed, 0);
+    for(size_t i = 0; i < keys.size(); ++i)
+        BOOST_REQUIRE_EQUAL(set.exists(keys[i]).first, i % 2 == 1);
+}
+
+BOOST_AUTO_TEST_CASE(ConcurrentStable)
+{
+    std::cerr << "ConcurrentStable" << std::endl;
+    sharded_set<uchar, size_t, 256, route_prefix<2>> set;
+    auto keys = make_keys(20000, 30);
+    std::vector<size_t> ids(keys.size());
+    std::atomic<size_t> failed = 0;
+    in_parallel([&](size_t t) {
+        for(size_t i = t; i < keys.size(); i += THREADS)
+        {
+            auto res = set.insert(keys[i]);
+            failed += !res.first;
+            ids[i] = res.second;
+        }
+    });
+    BOOST_CHECK_EQUAL(failed, 0);
+    BOOST_CHECK_EQUAL(set.size(), keys.size());
+    in_parallel([&](size_t t) {
+        for(size_t i = t; i < keys.size(); i += THREADS)
+        {
+            failed += set.exists(keys[i]).second != ids[i];
+            failed += set.unpack(ids[i]) != keys[i];
+        }
+    });
+    BOOST_CHECK_EQUAL(failed, 0);
+    std::vector<bool> seen(keys.size() * set.shards);
+    for(auto id : ids)
+    {
+        BOOST_REQUIRE(id < seen.size() && !seen[id]);
+        seen[id] = true;
+    }
+    auto usage = set.memory_usage();
+    BOOST_CHECK(usage._entry_blocks > 0);
+    BOOST_CHECK(usage.total() > 0);
+}
+
+// the writer inserts and erases while the readers look up the keys it is
+// known to have inserted and not erased
+template<typename T>
+void try_shared_reads(size_t n, size_t minsize, size_t maxsize)
+{
+    T set;
+    set.shared_reads();
+    auto keys = make_keys(n, maxsize, 0, minsize);
+    std::atomic<size_t> failed = 0;
+    with_readers([&](std::mt19937_64& gen, size_t known) {
+        // each reader is a thread of its own and keeps its hint between lookups
+        thread_local typename T::hint_t hint;
+        if(known < 2) return;
+        // the odd keys are never erased
+        std::vector<std::pair<const unsigned char*, size_t>> batch;
+        for(size_t j = 0; j < 16; ++j)
+        {
+            auto& key = keys[(gen() % (known / 2)) * 2 + 1];
+            batch.emplace_back(key.data(), key.size());
+        }
+        std::vector<ptrie::returntype_t> results(batch.size());
+        failed += !set.exists(batch[0].first, batch[0].second).first;
+        failed += !set.exists(hint, batch[1].first, batch[1].second).first;
+        set.exists_batch(batch, results);
+        for(auto& r : results)
+            failed += !r.first;
+    }, [&](std::atomic<size_t>& inserted) {
+        for(size_t i = 0; i < keys.size(); ++i)
+        {
+            set.insert(keys[i]);
+            inserted = i + 1;
+        }
+        // erasing most of the even keys leaves enough dead suffixes to compact
+        for(size_t i = 0; i < keys.size(); i += 2)
+            set.erase(keys[i]);
+    });
+    BOOST_CHECK_EQUAL(failed, 0);
+    for(size_t i = 0; i < keys.size(); ++i)
+        BOOST_REQUIRE_EQUAL(set.exists(keys[i]).first, i % 2 == 1);
+}
+
+BOOST_AUTO_TEST_CASE(SharedReads)
+{
+    std::cerr << "SharedReads" << std::endl;
+    try_shared_reads<set<>>(100000, 8, 30);
+    try_shared_reads<set<unsigned char, 17, 129, 4>>(50000, 8, 30);
+    try_shared_reads<set<unsigned char, 17, 129, 8, 1024*64, std::allocator<unsigned char>, false, 24>>(50000, 24, 24);
+}
+
+BOOST_AUTO_TEST_CASE(SharedReadsStable)
+{
+    std::cerr << "SharedReadsStable" << std::endl;
+    set_stable<> set;
+    set.shared_reads();
+    // long keys keep their suffixes on the heap, erasing all but a few
+    // makes the writer compact them while the readers are on them
+    auto keys = make_keys(60000, 120);
+    std::atomic<size_t> failed = 0;
+    with_readers([&](std::mt19937_64& gen, size_t known) {
+        if(known < 16) return;
+        const size_t i = (gen() % (known / 16)) * 16;
+        auto res = set.exists(keys[i]);
+        failed += !res.first || res.second != i;
+    }, [&](std::atomic<size_t>& inserted) {
+        for(size_t i = 0; i < keys.size(); ++i)
+        {
+            set.insert(keys[i]);
+            inserted = i + 1;
+        }
+        for(size_t i = 0; i < keys.size(); ++i)
+            if(i % 16 != 0) set.erase(keys[i]);
+    });
+    BOOST_CHECK_EQUAL(failed, 0);
+    BOOST_CHECK_EQUAL(set.size(), keys.size() / 16);
+    BOOST_CHECK(set.suffix_stats()._free < set.suffix_stats()._live);
+    for(size_t i = 0; i < keys.size(); i += 16)
+        BOOST_REQUIRE(set.unpack(i) == keys[i]);
+    set.compact();
+    for(size_t i = 0; i < keys.size(); ++i)
+        BOOST_REQUIRE_EQUAL(set.exists(keys[i]).first, i % 16 == 0);
+}
+
+BOOST_AUTO_TEST_CASE(SharedReadsFilled)
+{
+    std::cerr << "SharedReadsFilled" << std::endl;
+    // keys sharing their first bytes leave fwdnodes covering several levels,
+    // which are cut when shared reads are switched on for a filled trie
+    set<> set;
+    auto keys = make_keys(40000, 40, 13, 24);
+    for(auto& k : keys)
+        std::fill(k.begin(), k.begin() + 16, 0x2a);
+    for(size_t i = 0; i < keys.size() / 2; ++i)
+        set.insert(keys[i]);
+    set.use_filter();
+    auto before = set.memory_usage();
+    set.shared_reads();
+    auto after = set.memory_usage();
+    BOOST_CHECK(after._fwdnodes > before._fwdnodes);
+    BOOST_CHECK_EQUAL(after._filter_bytes, 0);
+    set.use_filter();
+    BOOST_CHECK_EQUAL(set.memory_usage()._filter_bytes, 0);
+    std::atomic<size_t> failed = 0;
+    with_readers([&](std::mt19937_64& gen, size_t known) {
+        if(known < 2) return;
+        // the odd keys are never erased
+        failed += !set.exists(keys[(gen() % (known / 2)) * 2 + 1]).first;
+    }, [&](std::atomic<size_t>& inserted) {
+        inserted = keys.size() / 2;
+        for(size_t i = keys.size() / 2; i < keys.size(); ++i)
+        {
+            set.insert(keys[i]);
+            inserted = i + 1;
+        }
+        for(size_t i = 0; i < keys.size(); i += 2)
+            set.erase(keys[i]);
+    });
+    BOOST_CHECK_EQUAL(failed, 0);
+    for(size_t i = 0; i < keys.size(); ++i)
+        BOOST_REQUIRE_EQUAL(set.exists(keys[i]).first, i % 2 == 1);
+}
+
+template<typename T>
+void try_sharded(size_t n)
+{
+    T set;
+    auto keys = make_keys(n, 30, 3);
+    std::vector<size_t> ids(keys.size());
+    std::atomic<size_t> wrong = 0;
+    in_parallel([&](size_t t) {
+        for(size_t i = t; i < keys.size(); i += THREADS)
+        {
+            auto res = set.insert(keys[i]);
+            ids[i] = res.second;
+            wrong += !res.first;
+            wrong += res.second % T::shards != set.shard_of(res.second);
+            wrong += set.unpack(res.second) != keys[i];
+        }
+    });
+    BOOST_REQUIRE_EQUAL(wrong, 0);
+    BOOST_REQUIRE_EQUAL(set.size(), keys.size());
+    for(size_t i = 0; i < keys.size(); ++i)
+        BOOST_REQUIRE_EQUAL(set.exists(keys[i]).second, ids[i]);
+
+    // the merged iterator walks the keys as a single trie would
+    set_stable<> single;
+    for(auto& key : keys)
+        single.insert(key);
+    same_keys(set, single);
+    for(auto it = set.begin(); it != set.end(); ++it)
+        BOOST_REQUIRE(set.unpack(it.index()) == it.unpack());
+}
+
+BOOST_AUTO_TEST_CASE(ShardedSet)
+{
+    std::cerr << "ShardedSet" << std::endl;
+    try_sharded<sharded_set<>>(50000);
+    try_sharded<sharded_set<uchar, size_t, 4, route_bytes<0>>>(50000);
+    try_sharded<sharded_set<uchar, size_t, 7, route_bytes<1, 2>>>(20000);
+}
+
+BOOST_AUTO_TEST_CASE(ShardedRange)
+{
+    std::cerr << "ShardedRange" << std::endl;
+    // route_bytes keeps the first bytes of a shard apart from the others
+    sharded_set<uchar, size_t, 4, route_bytes<0>> set;
+    for(auto& key : make_keys(10000, 20, 4))
+    {
+        auto res = set.insert(key);
+        BOOST_REQUIRE_EQUAL(set.shard_of(res.second), key[0] / 64);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ShardedMap)
+{
+    std::cerr << "ShardedMap" << std::endl;
+    sharded_map<uchar, size_t> map;
+    auto keys = make_keys(20000, 24, 5);
+    // every key is counted by two threads
+    in_parallel_twice(keys.size(), [&](size_t i) {
+        map.update(keys[i], [](size_t& v) { ++v; });
+    });
+    size_t n = 0;
+    for(auto it = map.begin(); it != map.end(); ++it, ++n)
+        BOOST_REQUIRE_EQUAL(*it, 2);
+    BOOST_REQUIRE_EQUAL(n, keys.size());
+    for(auto& key : keys)
+    {
+        size_t value = 0;
+        BOOST_REQUIRE(map.visit(key, [&](const size_t& v) { value = v; }));
+        BOOST_REQUIRE_EQUAL(value, 2);
+        BOOST_REQUIRE(!map.try_emplace(key, 7).first);
+    }
+    auto key = make_keys(1, 24, 6)[0];
+    auto res = map.try_emplace(key, 7);
+    BOOST_REQUIRE(res.first);
+    BOOST_REQUIRE(map.unpack(res.second) == key);
+    BOOST_REQUIRE(map.visit(key, [](const size_t& v) { BOOST_REQUIRE_EQUAL(v, 7); }));
+    BOOST_REQUIRE(map.erase(key));
+    BOOST_REQUIRE(!map.visit(key, [](const size_t&) {}));
+
+    // update constructs the value of a new key before handing it out
+    sharded_map<uchar, std::string> strings;
+    for(size_t i = 0; i < 1000; ++i)
+    {
+        auto id = strings.update(keys[i], [](std::string& v) { v += "ab"; }).second;
+        strings.update(keys[i], [](std::string& v) { v += "cd"; });
+        BOOST_REQUIRE_EQUAL(strings.exists(keys[i]).second, id);
+    }
+    for(size_t i = 0; i < 1000; ++i)
+        BOOST_REQUIRE(strings.visit(keys[i], [](const std::string& v) { BOOST_REQUIRE_EQUAL(v, "abcd"); }));
+}
+
+// the iterators need BSIZE 8
+template<typename T, bool ITERATE = true>
+void try_build(size_t n, size_t minsize, size_t maxsize, size_t threads)
+{
+    auto keys = make_keys(n, maxsize, 8, minsize);
+    // repeats of the first keys, which build reports as not added
+    for(size_t i = 0; i < n / 10; ++i)
+        keys.push_back(keys[i]);
+    auto spans = as_spans(keys);
+    std::vector<returntype_t> results(keys.size());
+    T set;
+    set.build(spans, results, threads);
+    T single;
+    for(size_t i = 0; i < keys.size(); ++i)
+    {
+        BOOST_REQUIRE_EQUAL(results[i].first, i < n);
+        BOOST_REQUIRE(set.exists(keys[i]).first);
+        BOOST_REQUIRE(!single.insert(keys[i]).first == (i >= n));
+    }
+    // the same trie as inserting the keys one by one
+    if constexpr (ITERATE)
+        same_keys(set, single);
+    // and it keeps working as one
+    auto more = make_keys(n / 4, maxsize, 9, minsize);
+    for(auto& k : more)
+        BOOST_REQUIRE(set.insert(k).first);
+    for(size_t i = 0; i < n; i += 2)
+        BOOST_REQUIRE(set.erase(keys[i]));
+    for(size_t i = 0; i < n; ++i)
+        BOOST_REQUIRE_EQUAL(set.exists(keys[i]).first, i % 2 == 1);
+    for(auto& k : more)
+        BOOST_REQUIRE(set.exists(k).first);
+}
+
+BOOST_AUTO_TEST_CASE(Build)
+{
+    std::cerr << "Build" << std::endl;
+    try_build<set<>>(60000, 8, 40, THREADS);
+    try_build<set<>>(20000, 8, 12, 1);
+    // too few keys of each size for a group, all inserted at the end
+    try_build<set<>>(3000, 8, 40, THREADS);
+    try_build<set<unsigned char, 17, 129, 4>, false>(30000, 8, 30, THREADS);
+    try_build<set<unsigned char, 17, 129, 8, 1024*64, std::allocator<unsigned char>, false, 24>>(40000, 24, 24, THREADS);
+    try_build<set_stable<>>(40000, 8, 120, THREADS);
+}
+
+// a trie that is not empty takes the keys by insert, and what a thread
+// throws reaches the caller once they are joined
+BOOST_AUTO_TEST_CASE(BuildFallback)
+{
+    std::cerr << "BuildFallback" << std::endl;
+    auto keys = make_keys(30000, 40, 12);
+    auto spans = as_spans(keys);
+    std::vector<returntype_t> results(keys.size());
+    set_stable<> set;
+    auto first = set.insert(keys[0]).second;
+    set.build(spans, results, THREADS);
+    BOOST_REQUIRE(!results[0].first);
+    BOOST_REQUIRE_EQUAL(results[0].second, first);
+    for(size_t i = 1; i < keys.size(); ++i)
+    {
+        BOOST_REQUIRE(results[i].first);
+        BOOST_REQUIRE(set.unpack(results[i].second) == keys[i]);
+    }
+    BOOST_REQUIRE_EQUAL(set.size(), keys.size());
+
+    for(long budget : {0, 20, 200})
+    {
+        set_stable<unsigned char, size_t, 17, 128, 8, 1024*64, failing_allocator<unsigned char>> failing;
+        allocations_left = budget;
+        BOOST_CHECK_THROW(failing.build(spans, results, THREADS), std::bad_alloc);
+        allocations_left = std::numeric_limits<long>::max();
+        // the keys copied in before are there and counted
+        size_t in = 0;
+        for(auto& k : keys)
+            in += failing.exists(k).first;
+        BOOST_REQUIRE_EQUAL(failing.size(), in);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(BuildIds)
+{
+    std::cerr << "BuildIds" << std::endl;
+    auto keys = make_keys(50000, 60, 10);
+    const size_t n = keys.size();
+    for(size_t i = 0; i < n / 10; ++i)
+        keys.push_back(keys[i * 7]);
+    auto spans = as_spans(keys);
+    // the ids do not depend on the number of threads, they are dense and
+    // unpack to their keys, repeats get the id of the first
+    std::vector<returntype_t> one(keys.size()), many(keys.size());
+    for(size_t threads : {size_t{1}, size_t{2}, THREADS})
+    {
+        set_stable<> set;
+        set.build(spans, threads == 1 ? one : many, threads);
+        if(threads == 1) continue;
+        for(size_t i = 0; i < keys.size(); ++i)
+            BOOST_REQUIRE(one[i] == many[i]);
+    }
+    set_stable<> set;
+    set.build(spans, many, THREADS);
+    std::vector<bool> seen(n);
+    for(size_t i = 0; i < keys.size(); ++i)
+    {
+        BOOST_REQUIRE_EQUAL(many[i].first, i < n);
+        BOOST_REQUIRE(many[i].second < n);
+        BOOST_REQUIRE(seen[many[i].second] == (i >= n));
+        seen[many[i].second] = true;
+        BOOST_REQUIRE(set.unpack(many[i].second) == keys[i]);
+        BOOST_REQUIRE_EQUAL(set.exists(keys[i]).second, many[i].second);
+    }
+    BOOST_REQUIRE_EQUAL(set.size(), n);
+
+    ptrie::map<unsigned char, size_t> map;
+    map.build(spans, many, THREADS);
+    for(size_t i = 0; i < n; ++i)
+    {
+        BOOST_REQUIRE(many[i] == one[i]);
+        BOOST_REQUIRE_EQUAL(map.exists(keys[i]).second, many[i].second);
+        map.get_data(many[i].second) = i;
+    }
+    for(size_t i = 0; i < n; ++i)
+        BOOST_REQUIRE_EQUAL(map[keys[i]], i);
+}
+
+// each thread takes its ids from blocks of its own, the ids are sparse
+// but still unique and still unpack to their keys, and an erased id only
+// comes back to the thread that handed it out
+BOOST_AUTO_TEST_CASE(ThreadIds)
+{
+    std::cerr << "ThreadIds" << std::endl;
+    auto keys = make_keys(20000, 30, 11);
+    set_stable<> set(THREADS);
+    set.recycle_ids();
+    std::mutex latch;
+    std::vector<size_t> ids(keys.size());
+    std::atomic<size_t> failed = 0;
+    in_parallel([&](size_t t) {
+        for(size_t i = t; i < keys.size(); i += THREADS)
+        {
+            std::lock_guard lock(latch);
+            auto res = set.insert(keys[i], t);
+            failed += !res.first;
+            ids[i] = res.second;
+        }
+    });
+    BOOST_CHECK_EQUAL(failed, 0);
+    BOOST_CHECK_EQUAL(set.size(), keys.size());
+    std::unordered_set<size_t> seen(ids.begin(), ids.end());
+    BOOST_CHECK_EQUAL(seen.size(), ids.size());
+    for(size_t i = 0; i < keys.size(); ++i)
+    {
+        BOOST_REQUIRE(set.unpack(ids[i]) == keys[i]);
+        BOOST_REQUIRE_EQUAL(set.exists(keys[i]).second, ids[i]);
+    }
+
+    // the ids of thread 0 are erased, new keys of the other threads do not
+    // take them, the keys of thread 0 get them back
+    std::unordered_set<size_t> erased;
+    for(size_t i = 0; i < keys.size(); i += THREADS)
+    {
+        BOOST_REQUIRE(set.erase(keys[i]));
+        erased.insert(ids[i]);
+    }
+    for(size_t i = 1; i < keys.size(); i += THREADS)
+    {
+        auto key = keys[i];
+        key.push_back('x');
+        auto res = set.insert(key, 1);
+        BOOST_REQUIRE(res.first);
+        BOOST_REQUIRE(erased.count(res.second) == 0);
+        BOOST_REQUIRE(seen.count(res.second) == 0);
+        seen.insert(res.second);
+    }
+    for(size_t i = 0; i < keys.size(); i += THREADS)
+    {
+        auto res = set.insert(keys[i], 0);
+        BOOST_REQUIRE(res.first);
+        BOOST_REQUIRE_EQUAL(erased.erase(res.second), 1);
+        BOOST_REQUIRE(set.unpack(res.second) == keys[i]);
+    }
+    BOOST_CHECK(erased.empty());
+
+    // the copy keeps the threads, the copy's ids are its own
+    auto copy = set;
+    for(size_t i = 0; i < keys.size(); ++i)
+        BOOST_REQUIRE(copy.exists(keys[i]).first);
+    BOOST_REQUIRE(copy.insert(keys[0].data(), keys[0].size() - 1, THREADS - 1).first);
+
+    ptrie::map<unsigned char, size_t> map(THREADS);
+    map.recycle_ids();
+    for(size_t i = 0; i < keys.size(); ++i)
+    {
+        auto res = map.insert(keys[i], i % THREADS);
+        BOOST_REQUIRE(res.first);
+        map.get_data(res.second) = i;
+        ids[i] = res.second;
+    }
+    for(size_t i = 0; i < keys.size(); ++i)
+        BOOST_REQUIRE_EQUAL(map[keys[i]], i);
+    BOOST_REQUIRE(map.erase(keys[1]));
+    BOOST_REQUIRE(map.insert(keys[0].data(), keys[0].size() - 1, 0).second != ids[1]);
+    BOOST_REQUIRE_EQUAL(map.insert(keys[1], 1).second, ids[1]);
+
+    sharded_set<> sharded(THREADS);
+    in_parallel([&](size_t t) {
+        for(size_t i = t; i < keys.size(); i += THREADS)
+        {
+            auto res = sharded.insert(keys[i], t);
+            failed += !res.first;
+            ids[i] = res.second;
+        }
+    });
+    BOOST_CHECK_EQUAL(failed, 0);
+    BOOST_CHECK_EQUAL(sharded.size(), keys.size());
+    seen = std::unordered_set<size_t>(ids.begin(), ids.end());
+    BOOST_CHECK_EQUAL(seen.size(), ids.size());
+    for(size_t i = 0; i < keys.size(); ++i)
+        BOOST_REQUIRE(sharded.unpack(ids[i]) == keys[i]);
+
+    sharded_map<unsigned char, size_t> smap(THREADS);
+    BOOST_REQUIRE(smap.insert(keys[0], THREADS - 1).first);
+}
@@ -360,3 +360,216 @@ BOOST_AUTO_TEST_CASE(InsertDeleteLarge3)
         BOOST_REQUIRE(ok);
     }
 }
+
+BOOST_AUTO_TEST_CASE(InsertDeleteUnpack)
+{
+    std::cerr << "InsertDeleteUnpack" << std::endl;
+    const size_t max = 8000;
+    set_stable<unsigned char, size_t, sizeof(size_t)+1,6> set;
+    auto fun = [](size_t i){
+        if((i % 2) == 0)
+            return rand_data(i, 17, 15);
+        return rand_data(i, 9, 8);
+    };
+    std::vector<size_t> ids(max);
+    for(size_t i = 0; i < max; ++i)
+    {
+        auto data = fun(i);
+        auto res = set.insert(data.first.get(), data.second);
+        BOOST_REQUIRE(res.first);
+        ids[i] = res.second;
+        if(i % 3 == 2)
+        {
+            // erase in the middle of buckets that are still growing
+            auto old = fun(i - 1);
+            BOOST_REQUIRE(set.erase(old.first.get(), old.second));
+        }
+    }
+    for(size_t i = 0; i < max; ++i)
+    {
+        auto data = fun(i);
+        auto res = set.exists(data.first.get(), data.second);
+        BOOST_REQUIRE_EQUAL(res.first, i % 3 != 1 || i + 1 == max);
+        if(!res.first) continue;
+        BOOST_REQUIRE_EQUAL(res.second, ids[i]);
+        auto unpacked = set.unpack(res.second);
+        BOOST_REQUIRE_EQUAL(unpacked.size(), data.second);
+        BOOST_REQUIRE(std::equal(unpacked.begin(), unpacked.end(), data.first.get()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(InsertDeleteSuffixCompaction)
+{
+    std::cerr << "InsertDeleteSuffixCompaction" << std::endl;
+    const size_t max = 20000;
+    set_stable<unsigned char, size_t, sizeof(size_t)+1,6> set;
+    std::vector<size_t> ids(max);
+    for(size_t i = 0; i < max; ++i)
+    {
+        auto data = rand_data(i, 200, 100);
+        auto res = set.insert(data.first.get(), data.second);
+        BOOST_REQUIRE(res.first);
+        ids[i] = res.second;
+    }
+    for(size_t i = 0; i < max; ++i)
+    {
+        if(i % 4 == 0) continue;
+        auto data = rand_data(i, 200, 100);
+        BOOST_REQUIRE(set.erase(data.first.get(), data.second));
+    }
+    // the dead suffixes have been reclaimed along the way
+    auto& stats = set.suffix_stats();
+    BOOST_CHECK(stats._free <= stats._live);
+    for(size_t i = 0; i < max; i += 4)
+    {
+        auto data = rand_data(i, 200, 100);
+        auto res = set.exists(data.first.get(), data.second);
+        BOOST_REQUIRE(res.first);
+        BOOST_REQUIRE_EQUAL(res.second, ids[i]);
+        auto unpacked = set.unpack(res.second);
+        BOOST_REQUIRE_EQUAL(unpacked.size(), data.second);
+        BOOST_REQUIRE(std::equal(unpacked.begin(), unpacked.end(), data.first.get()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(InsertDeleteSparseFanout)
+{
+    std::cerr << "InsertDeleteSparseFanout" << std::endl;
+    // first bytes with a stride of four, the forwarding nodes go from a
+    // few runs over the medium map to a full table and back again
+    const size_t max = 64 * 64;
+    auto fun = [](size_t i){
+        auto data = std::make_unique<unsigned char[]>(3);
+        data[0] = (uchar)((i % 64) * 4);
+        data[1] = (uchar)(i / 64);
+        data[2] = 0x5a;
+        return std::make_pair(std::move(data), 3);
+    };
+    set_stable<unsigned char, size_t, sizeof(size_t)+1, 8> set;
+    for(size_t round = 0; round < 2; ++round)
+    {
+        try_insert(set, fun, max);
+        for(size_t i = 0; i < max; ++i)
+        {
+            auto data = fun(max - 1 - i);
+            BOOST_REQUIRE(set.erase(data.first.get(), data.second));
+            if(i % 512 != 0) continue;
+            for(size_t j = 0; j < max; ++j)
+            {
+                auto other = fun(j);
+                BOOST_REQUIRE_EQUAL(set.exists(other.first.get(), other.second).first, j < max - 1 - i);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(InsertDeletePrefix)
+{
+    std::cerr << "InsertDeletePrefix" << std::endl;
+    // a long run of bytes shared by all keys ends up in a few fwdnodes,
+    // keys leaving the run in its middle cut it up again
+    const size_t max = 64 * 64;
+    const size_t shared = 30;
+    auto fun = [&](size_t i){
+        auto data = std::make_unique<unsigned char[]>(shared + 2);
+        for(size_t j = 0; j < shared; ++j)
+            data[j] = (uchar)(j * 37);
+        if(i >= max)
+        {
+            // differ from the run at one of its bytes
+            data[(i - max) % shared] ^= 0xff;
+            i = (i - max) / shared;
+        }
+        data[shared] = (uchar)(i / 64);
+        data[shared + 1] = (uchar)(i % 64);
+        return std::make_pair(std::move(data), shared + 2);
+    };
+    set_stable<unsigned char, size_t, sizeof(size_t)+1, 8> set;
+    for(size_t round = 0; round < 2; ++round)
+    {
+        try_insert(set, fun, max);
+        // the 64 fwdnodes splitting on the last byte and a few for the run
+        BOOST_REQUIRE(set.memory_usage()._fwdnodes < 64 + shared / 2);
+        for(size_t i = 0; i < max; ++i)
+        {
+            auto other = fun(max + i);
+            BOOST_REQUIRE(!set.exists(other.first.get(), other.second).first);
+        }
+        try_insert(set, [&](size_t i){ return fun(max + i); }, shared * 8);
+        for(size_t i = 0; i < max + shared * 8; ++i)
+        {
+            auto data = fun(i);
+            auto res = set.exists(data.first.get(), data.second);
+            BOOST_REQUIRE(res.first);
+            auto unpacked = set.unpack(res.second);
+            BOOST_REQUIRE_EQUAL(unpacked.size(), data.second);
+            BOOST_REQUIRE(std::equal(unpacked.begin(), unpacked.end(), data.first.get()));
+        }
+        size_t count = 0;
+        for(auto it = set.begin(); it != set.end(); ++it)
+            ++count;
+        BOOST_REQUIRE_EQUAL(count, max + shared * 8);
+        for(size_t i = 0; i < max + shared * 8; ++i)
+        {
+            auto data = fun(i);
+            BOOST_REQUIRE(set.erase(data.first.get(), data.second));
+            if(i % 256 != 0) continue;
+            for(size_t j = 0; j < max + shared * 8; ++j)
+            {
+                auto other = fun(j);
+                BOOST_REQUIRE_EQUAL(set.exists(other.first.get(), other.second).first, j > i);
+            }
+        }
+        BOOST_REQUIRE_EQUAL(set.memory_usage()._fwdnodes, 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(InsertDeleteCompact)
+{
+    std::cerr << "InsertDeleteCompact" << std::endl;
+    const size_t max = 20000;
+    set_stable<unsigned char, size_t, sizeof(size_t)+1, 6> set;
+    std::vector<size_t> ids(max);
+    for(size_t i = 0; i < max; ++i)
+    {
+        auto data = rand_data(i, 60);
+        auto res = set.insert(data.first.get(), data.second);
+        BOOST_REQUIRE(res.first);
+        ids[i] = res.second;
+    }
+    for(size_t i = 0; i < max; i += 2)
+    {
+        auto data = rand_data(i, 60);
+        BOOST_REQUIRE(set.erase(data.first.get(), data.second));
+    }
+    set.compact();
+    // the relayout keeps the ids and drops the dead suffixes
+    BOOST_CHECK_EQUAL(set.suffix_stats()._free, 0);
+    for(size_t i = 0; i < max; ++i)
+    {
+        auto data = rand_data(i, 60);
+        auto res = set.exists(data.first.get(), data.second);
+        BOOST_REQUIRE_EQUAL(res.first, i % 2 == 1);
+        if(!res.first) continue;
+        BOOST_REQUIRE_EQUAL(res.second, ids[i]);
+        auto unpacked = set.unpack(res.second);
+        BOOST_REQUIRE_EQUAL(unpacked.size(), data.second);
+        BOOST_REQUIRE(std::equal(unpacked.begin(), unpacked.end(), data.first.get()));
+    }
+    // and the trie keeps working afterwards
+    for(size_t i = 0; i < max; i += 2)
+    {
+        auto data = rand_data(i, 60);
+        BOOST_REQUIRE(set.insert(data.first.get(), data.second).first);
+    }
+    for(size_t i = 1; i < max; i += 2)
+    {
+        auto data = rand_data(i, 60);
+        BOOST_REQUIRE(set.erase(data.first.get(), data.second));
+    }
+    for(size_t i = 0; i < max; ++i)
+    {
+        auto data = rand_data(i, 60);
+        BOOST_REQUIRE_EQUAL(set.exists(data.first.get(), data.second).first, i % 2 == 0);
+    }
+}
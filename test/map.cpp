@@ -223,3 +223,161 @@ BOOST_AUTO_TEST_CASE(SimpleIterator)
     }
     BOOST_CHECK_EQUAL(cnt, x);
 }
+
+BOOST_AUTO_TEST_CASE(Compact)
+{
+    std::cerr << "Compact" << std::endl;
+    ptrie::map<unsigned char,size_t,sizeof(size_t ) + 1, 6> map;
+    for(size_t i = 0; i < 1024*10; ++i) {
+        auto data = rand_data(i, 20);
+        auto res = map.insert(data.first.get(), data.second);
+        BOOST_CHECK(res.first);
+        map.get_data(res.second) = i;
+    }
+    map.compact();
+    for(size_t i = 0; i < 1024*10; ++i) {
+        auto data = rand_data(i, 20);
+        auto res = map.exists(data.first.get(), data.second);
+        BOOST_CHECK(res.first);
+        BOOST_CHECK_EQUAL(map.get_data(res.second), i);
+        BOOST_CHECK_EQUAL(map.unpack(res.second).size(), data.second);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(RecycleIds)
+{
+    std::cerr << "RecycleIds" << std::endl;
+    ptrie::map<unsigned char, size_t> map;
+    map.recycle_ids();
+    const size_t max = 1024*10;
+    for(size_t i = 0; i < max; ++i) {
+        auto data = rand_data(i, 40);
+        auto res = map.insert(data.first.get(), data.second);
+        map.get_data(res.second) = i + 1;
+    }
+    for(size_t i = 0; i < max; i += 2) {
+        auto data = rand_data(i, 40);
+        BOOST_CHECK(map.erase(data.first.get(), data.second));
+    }
+    BOOST_REQUIRE_EQUAL(map.size(), max / 2);
+    for(size_t i = max; i < max + max / 2; ++i) {
+        auto data = rand_data(i, 40);
+        auto res = map.insert(data.first.get(), data.second);
+        BOOST_CHECK(res.first);
+        BOOST_REQUIRE_LT(res.second, max);
+        // a reused id does not carry the data of the erased element
+        BOOST_REQUIRE_EQUAL(map.get_data(res.second), 0);
+    }
+    BOOST_REQUIRE_EQUAL(map.size(), max);
+}
+
+BOOST_AUTO_TEST_CASE(Batch)
+{
+    std::cerr << "Batch" << std::endl;
+    ptrie::map<unsigned char, size_t> map;
+    const size_t max = 1024*10;
+    std::vector<std::pair<std::unique_ptr<unsigned char[]>, size_t>> data;
+    std::vector<std::pair<const unsigned char*, size_t>> keys;
+    for(size_t i = 0; i < max; ++i) {
+        data.push_back(rand_data(i, 40));
+        keys.emplace_back(data.back().first.get(), data.back().second);
+    }
+    std::vector<std::pair<bool, size_t>> results(max);
+    map.insert_batch(keys, results);
+    for(size_t i = 0; i < max; ++i) {
+        BOOST_REQUIRE(results[i].first);
+        map.get_data(results[i].second) = i;
+    }
+    map.insert_batch(keys, results);
+    for(size_t i = 0; i < max; ++i) {
+        BOOST_REQUIRE(!results[i].first);
+        BOOST_REQUIRE_EQUAL(map.get_data(results[i].second), i);
+    }
+    map.exists_batch(keys, results);
+    for(size_t i = 0; i < max; ++i) {
+        BOOST_REQUIRE(results[i].first);
+        BOOST_REQUIRE_EQUAL(map.get_data(results[i].second), i);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TryEmplace)
+{
+    std::cerr << "TryEmplace" << std::endl;
+    ptrie::map<unsigned char, std::string> map;
+    map.recycle_ids();
+    const size_t max = 1024*10;
+    auto value = [](size_t i) { return std::string(1 + i % 50, 'a' + i % 26); };
+    for(size_t i = 0; i < max; ++i) {
+        auto data = rand_data(i, 40);
+        auto res = map.try_emplace(data.first.get(), data.second, 1 + i % 50, 'a' + i % 26);
+        BOOST_REQUIRE(res.second);
+        BOOST_REQUIRE_EQUAL(res.first, value(i));
+    }
+    for(size_t i = 0; i < max; ++i) {
+        auto data = rand_data(i, 40);
+        auto res = map.try_emplace(data.first.get(), data.second, "not used");
+        BOOST_REQUIRE(!res.second);
+        BOOST_REQUIRE_EQUAL(res.first, value(i));
+        // the reference is the stored value
+        BOOST_REQUIRE_EQUAL(&res.first, &map.get_data(map.exists(data.first.get(), data.second).second));
+    }
+    for(size_t i = 0; i < max; i += 2) {
+        auto data = rand_data(i, 40);
+        BOOST_CHECK(map.erase(data.first.get(), data.second));
+    }
+    // reused ids get the new value, or a default one through operator[]
+    for(size_t i = max; i < max + max / 2; ++i) {
+        auto data = rand_data(i, 40);
+        std::vector<unsigned char> key(data.first.get(), data.first.get() + data.second);
+        if(i % 2 == 0) {
+            auto res = map.try_emplace(key, value(i));
+            BOOST_REQUIRE(res.second);
+            BOOST_REQUIRE_EQUAL(res.first, value(i));
+        } else {
+            BOOST_REQUIRE_EQUAL(map[key], "");
+        }
+        BOOST_REQUIRE_LT(map.exists(key).second, max);
+    }
+    BOOST_REQUIRE_EQUAL(map.size(), max);
+
+    struct throwing_t {
+        int _value = 0;
+        throwing_t() = default;
+        explicit throwing_t(int value) : _value(value) {
+            if(value < 0) throw std::invalid_argument("negative");
+        }
+    };
+    ptrie::map<unsigned char, throwing_t> tmap;
+    auto data = rand_data(1, 40);
+    BOOST_CHECK_THROW(tmap.try_emplace(data.first.get(), data.second, -1), std::invalid_argument);
+    auto res = tmap.try_emplace(data.first.get(), data.second, 1);
+    BOOST_CHECK(!res.second);
+    BOOST_CHECK_EQUAL(res.first._value, 0);
+
+    // only values that were constructed are destroyed, the storage of a new
+    // id is zeroed and not a value yet
+    static size_t unconstructed = 0;
+    struct tracked_t {
+        int _magic = 7;
+        tracked_t() = default;
+        tracked_t(const tracked_t&) = default;
+        ~tracked_t() { unconstructed += _magic != 7; _magic = 0; }
+    };
+    {
+        ptrie::map<unsigned char, tracked_t> tracked;
+        tracked.recycle_ids();
+        for(size_t i = 0; i < max; ++i) {
+            auto data = rand_data(i, 40);
+            BOOST_REQUIRE(tracked.try_emplace(data.first.get(), data.second).second);
+        }
+        for(size_t i = 0; i < max; i += 2) {
+            auto data = rand_data(i, 40);
+            BOOST_REQUIRE(tracked.erase(data.first.get(), data.second));
+        }
+        for(size_t i = max; i < 2 * max; ++i) {
+            auto data = rand_data(i, 40);
+            BOOST_REQUIRE(tracked.try_emplace(data.first.get(), data.second).second);
+        }
+        BOOST_CHECK_EQUAL(unconstructed, 0);
+    }
+}
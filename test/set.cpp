@@ -19,10 +19,42 @@
 #include <boost/test/unit_test.hpp>
 
 #include <ptrie/ptrie.h>
+#include <ptrie/hugepage_allocator.h>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <span>
+#include <vector>
 #include "utils.h"
 
 using namespace ptrie;
 
+// keys from make(i), kept alive next to the spans the batch calls take
+struct rand_keys
+{
+    std::vector<std::pair<std::unique_ptr<unsigned char[]>, size_t>> data;
+    std::vector<std::pair<const unsigned char*, size_t>> spans;
+
+    template<typename F>
+    rand_keys(size_t n, F make)
+    {
+        for(size_t i = 0; i < n; ++i) {
+            data.push_back(make(i));
+            spans.emplace_back(data.back().first.get(), data.back().second);
+        }
+    }
+};
+
+// the even keys of the first 2 * max are in the set, but for those below erased
+template<typename T>
+void check_even(const T& set, size_t max, size_t erased, size_t maxsize, size_t minsize = sizeof(size_t))
+{
+    for(size_t i = 0; i < 2 * max; ++i) {
+        auto data = rand_data(i, maxsize, minsize);
+        BOOST_REQUIRE_EQUAL(set.exists(data.first.get(), data.second).first, i % 2 == 0 && i >= erased);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(EmptyTest)
 {
     set<> set;
@@ -204,4 +236,347 @@ BOOST_AUTO_TEST_CASE(Dealloc)
         std::fill(tmp, tmp + i, std::numeric_limits<ptrie::uchar>::max());
         set.insert(tmp, i);
     }
-}
\ No newline at end of file
+}
+
+BOOST_AUTO_TEST_CASE(CountingAllocator)
+{
+    std::cerr << "CountingAllocator" << std::endl;
+    counted_bytes = 0;
+    {
+        set<unsigned char, sizeof(size_t)+1, 6, 8, 1024*64, counting_allocator<uchar>> set;
+        for(size_t i = 0; i < 1024*10; ++i) {
+            auto data = rand_data(i, 20);
+            BOOST_CHECK(set.insert(data.first.get(), data.second).first);
+        }
+        BOOST_CHECK(counted_bytes > 0);
+        auto cpy = set;
+        for(size_t i = 0; i < 1024*10; i += 2) {
+            auto data = rand_data(i, 20);
+            BOOST_CHECK(set.erase(data.first.get(), data.second));
+            BOOST_CHECK(cpy.exists(data.first.get(), data.second).first);
+        }
+    }
+    BOOST_CHECK_EQUAL(counted_bytes, 0);
+}
+
+BOOST_AUTO_TEST_CASE(BucketPoolStats)
+{
+    std::cerr << "BucketPoolStats" << std::endl;
+    set<unsigned char, sizeof(size_t)+1, 6> set;
+    BOOST_CHECK_EQUAL(set.bucket_stats()._reserved, 0);
+    for(size_t i = 0; i < 1024*10; ++i) {
+        auto data = rand_data(i, 20);
+        BOOST_CHECK(set.insert(data.first.get(), data.second).first);
+    }
+    auto& stats = set.bucket_stats();
+    BOOST_CHECK(stats._live > 0);
+    BOOST_CHECK(stats._live + stats._free <= stats._reserved);
+    BOOST_CHECK(stats.fragmentation() < 0.5);
+    for(size_t i = 0; i < 1024*10; ++i) {
+        auto data = rand_data(i, 20);
+        BOOST_CHECK(set.erase(data.first.get(), data.second));
+    }
+    BOOST_CHECK_EQUAL(stats._live, 0);
+    BOOST_CHECK_EQUAL(stats._large, 0);
+}
+
+BOOST_AUTO_TEST_CASE(MemoryUsage)
+{
+    std::cerr << "MemoryUsage" << std::endl;
+    set<unsigned char, sizeof(size_t)+1, 6> set;
+    auto empty = set.memory_usage();
+    BOOST_CHECK_EQUAL(empty._fwdnodes, 1);
+    BOOST_CHECK_EQUAL(empty._nodes, 0);
+    const size_t max = 1024*10;
+    for(size_t i = 0; i < max; ++i) {
+        auto data = rand_data(i, 40, 20);
+        BOOST_CHECK(set.insert(data.first.get(), data.second).first);
+    }
+    auto usage = set.memory_usage();
+    BOOST_CHECK(usage._fwdnodes > 1);
+    BOOST_CHECK(usage._nodes > 0);
+    BOOST_CHECK_EQUAL(usage._first_bytes, max * sizeof(uint16_t));
+    BOOST_CHECK_EQUAL(usage._entry_bytes, 0);
+    // every key is long enough to leave a suffix on the heap
+    BOOST_CHECK_EQUAL(usage._suffixes, max);
+    BOOST_CHECK_EQUAL(usage._suffix_bytes, set.suffix_stats()._live);
+    BOOST_CHECK_EQUAL(usage.bucket_bytes(), set.bucket_stats()._live + set.bucket_stats()._large);
+    BOOST_CHECK_EQUAL(usage._entry_blocks, 0);
+    BOOST_CHECK(usage.total() > usage._suffix_bytes);
+}
+
+BOOST_AUTO_TEST_CASE(CompressedRefs)
+{
+    std::cerr << "CompressedRefs" << std::endl;
+    using cset = set<unsigned char, sizeof(size_t)+1, 6, 8, 1024*64, std::allocator<uchar>, true>;
+    BOOST_CHECK(sizeof(cset::fwdnode_t) < sizeof(set<>::fwdnode_t));
+    cset set;
+    for(size_t i = 0; i < 1024*10; ++i) {
+        auto data = rand_data(i, 40);
+        BOOST_CHECK(set.insert(data.first.get(), data.second).first);
+    }
+    for(size_t i = 0; i < 1024*10; i += 2) {
+        auto data = rand_data(i, 40);
+        BOOST_CHECK(set.erase(data.first.get(), data.second));
+    }
+    auto cpy = set;
+    size_t n = 0;
+    for(auto it = cpy.begin(); it != cpy.end(); ++it)
+        ++n;
+    BOOST_CHECK_EQUAL(n, 1024*5);
+    for(size_t i = 0; i < 1024*10; ++i) {
+        auto data = rand_data(i, 40);
+        BOOST_CHECK_EQUAL(set.exists(data.first.get(), data.second).first, i % 2 == 1);
+        BOOST_CHECK_EQUAL(cpy.exists(data.first.get(), data.second).first, i % 2 == 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(HugepageAllocator)
+{
+    std::cerr << "HugepageAllocator" << std::endl;
+    // works with and without huge pages available
+    set<unsigned char, sizeof(size_t)+1, 6, 8, 1024*64, hugepage_allocator<uchar>> set;
+    for(size_t i = 0; i < 1024*10; ++i) {
+        auto data = rand_data(i, 40);
+        BOOST_CHECK(set.insert(data.first.get(), data.second).first);
+    }
+    // slabs are reserved in whole huge pages
+    BOOST_CHECK_EQUAL(set.bucket_stats()._reserved % hugepage_allocator<uchar>::HUGEPAGE, 0);
+    for(size_t i = 0; i < 1024*10; i += 2) {
+        auto data = rand_data(i, 40);
+        BOOST_CHECK(set.erase(data.first.get(), data.second));
+    }
+    for(size_t i = 0; i < 1024*10; ++i) {
+        auto data = rand_data(i, 40);
+        BOOST_CHECK_EQUAL(set.exists(data.first.get(), data.second).first, i % 2 == 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(FirstScan)
+{
+    std::cerr << "FirstScan" << std::endl;
+    std::mt19937 gen(7);
+    for(size_t count = 0; count < 80; ++count) {
+        std::vector<uint16_t> first(count);
+        for(auto& f : first) f = gen() % (count < 40 ? 64 : 0x10000);
+        std::sort(first.begin(), first.end());
+        for(uint32_t key : {0u, 1u, 31u, 63u, 0x7fffu, 0x8000u, 0xffffu, first.empty() ? 5u : (uint32_t)first[count / 2]}) {
+            size_t expected = std::lower_bound(first.begin(), first.end(), (uint16_t)key) - first.begin();
+            BOOST_REQUIRE_EQUAL(first_scan::lower_bound(first.data(), count, key), expected);
+        }
+        for(bool byte : {false, true}) {
+            const uint16_t high = byte ? 0x100 : 0;
+            size_t expected = 0;
+            for(auto f : first) {
+                uint16_t len = byte ? (uint16_t)((high | (f >> 8)) - 1) : f;
+                expected += len >= 17 ? sizeof(unsigned char*) : len;
+            }
+            BOOST_REQUIRE_EQUAL(first_scan::suffix_bytes<17>(first.data(), count, byte, high), expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(SuffixCompare)
+{
+    std::cerr << "SuffixCompare" << std::endl;
+    auto sign = [](int v) { return (v > 0) - (v < 0); };
+    std::vector<unsigned char> a(40), b(40);
+    for(size_t n = 0; n <= a.size(); ++n) {
+        for(size_t pos = 0; pos <= n; ++pos) {
+            for(auto [x, y] : {std::pair<uchar, uchar>{0, 1}, {1, 0}, {0x7f, 0x80}, {0xff, 0x00}, {0x10, 0x01}}) {
+                for(size_t i = 0; i < a.size(); ++i) a[i] = b[i] = 0x55 + i;
+                if(pos < n) {
+                    a[pos] = x;
+                    b[pos] = y;
+                    // bytes after the first difference do not count
+                    if(pos + 1 < n) a[pos + 1] = y, b[pos + 1] = x;
+                }
+                BOOST_REQUIRE_EQUAL(first_scan::compare(a.data(), b.data(), n), sign(memcmp(a.data(), b.data(), n)));
+            }
+        }
+    }
+}
+
+template<typename T>
+void try_batch(size_t max)
+{
+    T set;
+    rand_keys data(max, [&](size_t i) { return rand_data(i % (max / 2), 30); });
+    auto& keys = data.spans;
+    std::vector<std::pair<bool, size_t>> results(max);
+    // the second half repeats the first, in batches of their own and mixed
+    set.insert_batch(std::span(keys).first(max / 2 + 7), results);
+    for(size_t i = 0; i < max / 2 + 7; ++i)
+        BOOST_REQUIRE_EQUAL(results[i].first, i < max / 2);
+    set.exists_batch(keys, results);
+    for(size_t i = 0; i < max; ++i) {
+        BOOST_REQUIRE(results[i].first);
+        BOOST_REQUIRE(set.exists(keys[i].first, keys[i].second) == results[i]);
+    }
+    for(size_t i = 0; i < max; i += 3)
+        set.erase(keys[i].first, keys[i].second);
+    set.exists_batch(keys, results);
+    for(size_t i = 0; i < max; ++i)
+        BOOST_REQUIRE(set.exists(keys[i].first, keys[i].second) == results[i]);
+}
+
+BOOST_AUTO_TEST_CASE(Batch)
+{
+    std::cerr << "Batch" << std::endl;
+    try_batch<set<>>(1024*20);
+    try_batch<set<unsigned char, 17, 6, 4>>(1024*20);
+    try_batch<set<unsigned char, 17, 6, 8, 1024*64, std::allocator<uchar>, true>>(1024*20);
+}
+
+template<typename T>
+void try_hint(size_t max)
+{
+    // successive keys differ in a short suffix, as the states of a
+    // depth-first search, and now and then in their length
+    T set, plain;
+    typename T::hint_t hint, probe;
+    std::mt19937_64 gen(42);
+    std::geometric_distribution<size_t> suffix(0.2);
+    std::vector<unsigned char> key(40);
+    std::vector<std::vector<unsigned char>> keys;
+    for(size_t i = 0; i < max; ++i) {
+        if(gen() % 64 == 0)
+            key.resize(30 + gen() % 20, 1);
+        const size_t n = std::min(key.size(), 1 + suffix(gen));
+        for(size_t j = key.size() - n; j < key.size(); ++j)
+            key[j] = gen() % 4;
+        keys.push_back(key);
+        BOOST_REQUIRE(set.insert(hint, key.data(), key.size()) == plain.insert(key.data(), key.size()));
+        BOOST_REQUIRE(set.exists(hint, key.data(), key.size()).first);
+        // the probe goes back and forth between the tries
+        auto other = key;
+        other[gen() % other.size()] ^= 0x80;
+        BOOST_REQUIRE(set.exists(probe, other.data(), other.size()) == plain.exists(probe, other.data(), other.size()));
+        if(i % 97 == 0) {
+            BOOST_REQUIRE(set.erase(key.data(), key.size()));
+            BOOST_REQUIRE(plain.erase(key.data(), key.size()));
+        }
+    }
+    for(auto& k : keys)
+        BOOST_REQUIRE(set.exists(hint, k.data(), k.size()) == plain.exists(k.data(), k.size()));
+}
+
+BOOST_AUTO_TEST_CASE(Hint)
+{
+    std::cerr << "Hint" << std::endl;
+    try_hint<set<>>(1024*20);
+    try_hint<set<unsigned char, 17, 6>>(1024*20);
+    try_hint<set<unsigned char, 17, 6, 4>>(1024*20);
+    try_hint<set<unsigned char, 17, 6, 8, 1024*64, std::allocator<uchar>, true>>(1024*20);
+}
+
+template<typename T>
+void try_filter(size_t max)
+{
+    // the even keys are inserted, the filter has to let all of them through
+    // and must not change the answer for the odd ones
+    T set;
+    set.use_filter();
+    auto check = [&](const T& set, size_t erased) { check_even(set, max, erased, 30); };
+    for(size_t i = 0; i < 2 * max; i += 2) {
+        auto data = rand_data(i, 30);
+        BOOST_REQUIRE(set.insert(data.first.get(), data.second).first);
+    }
+    // grown past its first size by rebuilding
+    BOOST_REQUIRE(set.memory_usage()._filter_bytes > max / 4);
+    check(set, 0);
+    typename T::hint_t hint;
+    rand_keys data(2 * max, [](size_t i) { return rand_data(i, 30); });
+    auto& keys = data.spans;
+    std::vector<std::pair<bool, size_t>> results(keys.size());
+    set.exists_batch(keys, results);
+    for(size_t i = 0; i < keys.size(); ++i) {
+        BOOST_REQUIRE_EQUAL(results[i].first, i % 2 == 0);
+        BOOST_REQUIRE_EQUAL(set.exists(hint, keys[i].first, keys[i].second).first, i % 2 == 0);
+    }
+    for(size_t i = 0; i < max; i += 2)
+        BOOST_REQUIRE(set.erase(keys[i].first, keys[i].second));
+    check(set, max);
+    set.compact();
+    check(set, max);
+    T copy;
+    copy = set;
+    check(copy, max);
+    T moved(std::move(copy));
+    check(moved, max);
+    set.use_filter(false);
+    BOOST_REQUIRE_EQUAL(set.memory_usage()._filter_bytes, 0);
+    check(set, max);
+}
+
+BOOST_AUTO_TEST_CASE(Filter)
+{
+    std::cerr << "Filter" << std::endl;
+    try_filter<set<>>(1024*20);
+    try_filter<set<unsigned char, 17, 6, 4>>(1024*20);
+    try_filter<set<unsigned char, 17, 6, 8, 1024*64, std::allocator<uchar>, true>>(1024*20);
+}
+
+template<typename T, size_t N>
+void try_fixed(size_t max)
+{
+    // the even keys are inserted, all of N bytes
+    T set;
+    auto check = [&](const T& set, size_t erased) { check_even(set, max, erased, N, N); };
+    for(size_t i = 0; i < 2 * max; i += 2) {
+        auto data = rand_data(i, N, N);
+        BOOST_REQUIRE(set.insert(data.first.get(), N).first);
+        BOOST_REQUIRE(!set.insert(data.first.get(), N).first);
+    }
+    check(set, 0);
+    if constexpr (T::bsize == 8) {
+        size_t cnt = 0;
+        for(auto it = set.begin(); it != set.end(); ++it) {
+            auto key = it.unpack();
+            BOOST_REQUIRE_EQUAL(key.size(), N);
+            BOOST_REQUIRE(set.exists(key.data(), N).first);
+            ++cnt;
+        }
+        BOOST_REQUIRE_EQUAL(cnt, max);
+    }
+    rand_keys data(2 * max, [](size_t i) { return rand_data(i, N, N); });
+    auto& keys = data.spans;
+    std::vector<std::pair<bool, size_t>> results(keys.size());
+    set.exists_batch(keys, results);
+    typename T::hint_t hint;
+    for(size_t i = 0; i < keys.size(); ++i) {
+        BOOST_REQUIRE_EQUAL(results[i].first, i % 2 == 0);
+        BOOST_REQUIRE_EQUAL(set.exists(hint, keys[i].first, N).first, i % 2 == 0);
+    }
+    for(size_t i = 0; i < max; i += 2) {
+        auto data = rand_data(i, N, N);
+        BOOST_REQUIRE(set.erase(data.first.get(), N));
+    }
+    check(set, max);
+    set.compact();
+    check(set, max);
+    T copy = set;
+    T moved = std::move(set);
+    check(copy, max);
+    check(moved, max);
+    for(size_t i = max; i < 2 * max; i += 2) {
+        auto data = rand_data(i, N, N);
+        BOOST_REQUIRE(moved.erase(data.first.get(), N));
+    }
+    check(moved, 2 * max);
+    // the moved-from set is empty and can be used again
+    for(size_t i = 0; i < 2 * max; i += 2) {
+        auto data = rand_data(i, N, N);
+        BOOST_REQUIRE(set.insert(data.first.get(), N).first);
+    }
+    check(set, 0);
+}
+
+BOOST_AUTO_TEST_CASE(FixedLength)
+{
+    std::cerr << "FixedLength" << std::endl;
+    try_fixed<set<unsigned char, 17, 129, 8, 1024*64, std::allocator<uchar>, false, 12>, 12>(1024*20);
+    try_fixed<set<unsigned char, 17, 129, 8, 1024*64, std::allocator<uchar>, false, 40>, 40>(1024*20);
+    try_fixed<set<unsigned char, 17, 6, 4, 1024*64, std::allocator<uchar>, false, 20>, 20>(1024*20);
+    try_fixed<set<unsigned char, 17, 6, 8, 1024*64, std::allocator<uchar>, true, 20>, 20>(1024*20);
+}
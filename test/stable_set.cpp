@@ -342,6 +342,7 @@ BOOST_AUTO_TEST_CASE(ComplexType2Vector)
 BOOST_AUTO_TEST_CASE(SimpleCopy)
 {
     set_stable<size_t> set;
+    set.recycle_ids();
     for(size_t i = 0; i < 100000; ++i)
     {
         set.insert(i);
@@ -353,5 +354,164 @@ BOOST_AUTO_TEST_CASE(SimpleCopy)
             BOOST_REQUIRE(cpy.exists(i).first);
         for(; i < 200000; ++i)
             BOOST_REQUIRE(!cpy.exists(i).first);
+        // the copy reuses ids as the original does
+        auto id = cpy.exists(size_t{0}).second;
+        BOOST_REQUIRE(cpy.erase(size_t{0}));
+        BOOST_REQUIRE_EQUAL(cpy.insert(size_t{200000}).second, id);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(CountingAllocator)
+{
+    std::cerr << "CountingAllocator" << std::endl;
+    counted_bytes = 0;
+    {
+        set_stable<unsigned char, size_t, sizeof(size_t)+1, 6, 8, 1024*64, counting_allocator<uchar>> set;
+        auto scratchpad = std::make_unique<unsigned char[]>(20+sizeof(size_t));
+        for(size_t i = 0; i < 1024*10; ++i) {
+            auto data = rand_data(i, 20);
+            auto res = set.insert(data.first.get(), data.second);
+            BOOST_CHECK(res.first);
+            auto size = set.unpack(res.second, scratchpad.get());
+            BOOST_CHECK_EQUAL(data.second, size);
+        }
+        for(size_t i = 0; i < 1024*10; i += 3) {
+            auto data = rand_data(i, 20);
+            BOOST_CHECK(set.erase(data.first.get(), data.second));
+        }
+        BOOST_CHECK(counted_bytes > 0);
+    }
+    BOOST_CHECK_EQUAL(counted_bytes, 0);
+}
+
+BOOST_AUTO_TEST_CASE(MemoryUsage)
+{
+    std::cerr << "MemoryUsage" << std::endl;
+    set_stable<unsigned char, size_t, sizeof(size_t)+1, 6> set;
+    const size_t max = 1024*10;
+    for(size_t i = 0; i < max; ++i) {
+        auto data = rand_data(i, 20);
+        BOOST_CHECK(set.insert(data.first.get(), data.second).first);
+    }
+    auto usage = set.memory_usage();
+    BOOST_CHECK_EQUAL(usage._first_bytes, max * sizeof(uint16_t));
+    BOOST_CHECK_EQUAL(usage._entry_bytes, max * sizeof(size_t));
+    BOOST_CHECK_EQUAL(usage.bucket_bytes(), set.bucket_stats()._live + set.bucket_stats()._large);
+    BOOST_CHECK(usage._entry_blocks > 0);
+    BOOST_CHECK(usage._entry_block_bytes > 0);
+    BOOST_CHECK_EQUAL(usage._index_blocks, 1);
+}
+
+BOOST_AUTO_TEST_CASE(EntryDirectory)
+{
+    std::cerr << "EntryDirectory" << std::endl;
+    // blocks of four entries, so the index needs many leaves and its
+    // directory has to grow a few times
+    set_stable<unsigned char, size_t, sizeof(size_t)+1, 6, 8, 4> set;
+    const size_t max = 1024*40;
+    std::vector<size_t> ids(max);
+    for(size_t i = 0; i < max; ++i) {
+        auto data = rand_data(i, 20);
+        auto res = set.insert(data.first.get(), data.second);
+        BOOST_CHECK(res.first);
+        ids[i] = res.second;
+    }
+    for(size_t i = 0; i < max; ++i) {
+        auto data = rand_data(i, 20);
+        auto unpacked = set.unpack(ids[i]);
+        BOOST_REQUIRE_EQUAL(unpacked.size(), data.second);
+        BOOST_REQUIRE(std::equal(unpacked.begin(), unpacked.end(), data.first.get()));
+    }
+    auto usage = set.memory_usage();
+    BOOST_CHECK_EQUAL(usage._entry_blocks, max / 4);
+    BOOST_CHECK_EQUAL(usage._index_blocks, max / 4 / 512);
+    BOOST_CHECK(usage._index_bytes > usage._index_blocks * 512 * sizeof(void*));
+}
+
+BOOST_AUTO_TEST_CASE(FixedLength)
+{
+    std::cerr << "FixedLength" << std::endl;
+    set_stable<unsigned char, size_t, sizeof(size_t)+1, 6, 8, 1024*64, std::allocator<uchar>, false, 24> set;
+    const size_t max = 1024*10;
+    std::vector<size_t> ids(max);
+    for(size_t i = 0; i < max; ++i) {
+        auto data = rand_data(i, 24, 24);
+        auto res = set.insert(data.first.get(), data.second);
+        BOOST_CHECK(res.first);
+        ids[i] = res.second;
+    }
+    for(size_t i = 0; i < max; i += 3) {
+        auto data = rand_data(i, 24, 24);
+        BOOST_CHECK(set.erase(data.first.get(), data.second));
+    }
+    set.compact();
+    for(size_t i = 0; i < max; ++i) {
+        auto data = rand_data(i, 24, 24);
+        auto res = set.exists(data.first.get(), data.second);
+        BOOST_REQUIRE_EQUAL(res.first, i % 3 != 0);
+        if(!res.first) continue;
+        BOOST_REQUIRE_EQUAL(res.second, ids[i]);
+        auto unpacked = set.unpack(res.second);
+        BOOST_REQUIRE_EQUAL(unpacked.size(), 24);
+        BOOST_REQUIRE(std::equal(unpacked.begin(), unpacked.end(), data.first.get()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(CompressedRefs)
+{
+    std::cerr << "CompressedRefs" << std::endl;
+    set_stable<unsigned char, size_t, sizeof(size_t)+1, 6, 8, 1024*64, std::allocator<uchar>, true> set;
+    const size_t max = 1024*10;
+    std::vector<size_t> ids(max);
+    for(size_t i = 0; i < max; ++i) {
+        auto data = rand_data(i, 40);
+        auto res = set.insert(data.first.get(), data.second);
+        BOOST_CHECK(res.first);
+        ids[i] = res.second;
+    }
+    for(size_t i = 0; i < max; i += 3) {
+        auto data = rand_data(i, 40);
+        BOOST_CHECK(set.erase(data.first.get(), data.second));
+    }
+    auto moved = std::move(set);
+    moved.compact();
+    for(size_t i = 0; i < max; ++i) {
+        auto data = rand_data(i, 40);
+        auto res = moved.exists(data.first.get(), data.second);
+        BOOST_REQUIRE_EQUAL(res.first, i % 3 != 0);
+        if(!res.first) continue;
+        BOOST_REQUIRE_EQUAL(res.second, ids[i]);
+        auto unpacked = moved.unpack(res.second);
+        BOOST_REQUIRE_EQUAL(unpacked.size(), data.second);
+        BOOST_REQUIRE(std::equal(unpacked.begin(), unpacked.end(), data.first.get()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(RecycleIds)
+{
+    std::cerr << "RecycleIds" << std::endl;
+    const size_t max = 1024*10;
+    for(bool recycle : {false, true}) {
+        set_stable<unsigned char, size_t, sizeof(size_t)+1, 6> set;
+        set.recycle_ids(recycle);
+        for(size_t i = 0; i < max; ++i) {
+            auto data = rand_data(i, 40);
+            BOOST_CHECK(set.insert(data.first.get(), data.second).first);
+        }
+        for(size_t i = 0; i < max; i += 2) {
+            auto data = rand_data(i, 40);
+            BOOST_CHECK(set.erase(data.first.get(), data.second));
+        }
+        BOOST_REQUIRE_EQUAL(set.size(), max / 2);
+        for(size_t i = max; i < max + max / 2; ++i) {
+            auto data = rand_data(i, 40);
+            auto res = set.insert(data.first.get(), data.second);
+            BOOST_CHECK(res.first);
+            BOOST_REQUIRE_EQUAL(res.second < max, recycle);
+            auto unpacked = set.unpack(res.second);
+            BOOST_REQUIRE_EQUAL(unpacked.size(), data.second);
+            BOOST_REQUIRE(std::equal(unpacked.begin(), unpacked.end(), data.first.get()));
+        }
+        BOOST_REQUIRE_EQUAL(set.size(), max);
     }
 }
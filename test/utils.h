@@ -65,4 +65,58 @@ std::pair<std::unique_ptr<unsigned char[]>, size_t> rand_data(size_t seed, size_
     }
     return std::make_pair(std::move(data), size);
 }
+
+// keeps track of the bytes currently held through any counting_allocator
+inline long counted_bytes = 0;
+
+template<typename T>
+struct counting_allocator {
+    using value_type = T;
+    counting_allocator() = default;
+    template<typename U>
+    counting_allocator(const counting_allocator<U>&) {}
+
+    T* allocate(size_t n)
+    {
+        counted_bytes += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        counted_bytes -= n * sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template<typename U>
+    bool operator==(const counting_allocator<U>&) const { return true; }
+};
+
+// the allocations any failing_allocator still grants, after that they
+// throw std::bad_alloc
+inline std::atomic<long> allocations_left = std::numeric_limits<long>::max();
+
+template<typename T>
+struct failing_allocator {
+    using value_type = T;
+    failing_allocator() = default;
+    template<typename U>
+    failing_allocator(const failing_allocator<U>&) {}
+
+    T* allocate(size_t n)
+    {
+        if(allocations_left.fetch_sub(1) <= 0)
+            throw std::bad_alloc();
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template<typename U>
+    bool operator==(const failing_allocator<U>&) const { return true; }
+};
+
 #endif //PTRIE_UTILS_H